@@ -0,0 +1,73 @@
+#pragma once
+
+#include "ffmpeg.h"
+
+#include <vector>
+
+// Heap allocations the calling thread has made so far, counted by the allocator interposers in
+// AllocationCount.cpp, so allocations inside FFmpeg (frame buffers, the encoders, the muxer's packet
+// queue) are seen as well as the recorder's own.
+uint64_t HeapAllocations();
+
+// Fixed-size free list of libav objects. Items are created up front and handed back with
+// Release(); the pool never unrefs them, so callers decide whether buffers are kept for reuse.
+// Not thread-safe: each pool belongs to the single thread that drives it.
+template <typename T, T* (*Alloc)(), void (*Free)(T**)>
+class AVPool
+{
+public:
+    AVPool(size_t size) : capacity(size)
+    {
+        items.reserve(capacity);
+
+        for (size_t i = 0; i < capacity; ++i)
+        {
+            items.push_back(NewItem());
+        }
+    }
+
+    ~AVPool()
+    {
+        for (T* item : items)
+        {
+            Free(&item);
+        }
+    }
+
+    T* Acquire()
+    {
+        if (items.empty())
+        {
+            return NewItem();
+        }
+
+        T* item = items.back();
+        items.pop_back();
+
+        return item;
+    }
+
+    void Release(T* item)
+    {
+        if (items.size() < capacity)
+        {
+            items.push_back(item);
+        }
+        else
+        {
+            Free(&item);
+        }
+    }
+
+private:
+    T* NewItem()
+    {
+        return Alloc();
+    }
+
+    std::vector<T*>     items;
+    size_t              capacity;
+};
+
+typedef AVPool<AVFrame, av_frame_alloc, av_frame_free>      FramePool;
+typedef AVPool<AVPacket, av_packet_alloc, av_packet_free>   PacketPool;
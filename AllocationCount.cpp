@@ -0,0 +1,66 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Interposes the C allocator for the whole process, FFmpeg's libraries included: av_malloc ends up in
+// posix_memalign, and everything else in malloc, calloc or realloc. Each call is counted for the thread
+// that made it and passed on to glibc. free() isn't counted, and isn't interposed.
+
+extern "C"
+{
+void*   __libc_malloc(size_t size);
+void*   __libc_calloc(size_t count, size_t size);
+void*   __libc_realloc(void* ptr, size_t size);
+void*   __libc_memalign(size_t alignment, size_t size);
+}
+
+// initial-exec: the counter must be reachable without the TLS lookup allocating.
+static __thread uint64_t threadAllocations __attribute__((tls_model("initial-exec"))) = 0;
+
+uint64_t HeapAllocations()
+{
+    return threadAllocations;
+}
+
+extern "C" void* malloc(size_t size)
+{
+    threadAllocations++;
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    threadAllocations++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+    threadAllocations++;
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void* memalign(size_t alignment, size_t size)
+{
+    threadAllocations++;
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void* aligned_alloc(size_t alignment, size_t size)
+{
+    threadAllocations++;
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+    {
+        return EINVAL;
+    }
+
+    threadAllocations++;
+    *ptr = __libc_memalign(alignment, size);
+
+    return *ptr || !size ? 0 : ENOMEM;
+}
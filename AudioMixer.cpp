@@ -0,0 +1,272 @@
+#include "AudioMixer.h"
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+SampleRing::SampleRing(int channels, int capacity) :
+  channels(channels), capacity(capacity)
+, readPos(0), writePos(0), overflows(0)
+{
+    for (int ch = 0; ch < channels; ++ch)
+    {
+        planes.push_back((float*)av_mallocz(capacity * sizeof(float)));
+    }
+}
+
+SampleRing::~SampleRing()
+{
+    for (float* plane : planes)
+    {
+        av_free(plane);
+    }
+}
+
+int SampleRing::Write(const float* const* src, int nbSamples)
+{
+    int64_t w = writePos.load(std::memory_order_relaxed);
+    int64_t r = readPos.load(std::memory_order_acquire);
+    int n = std::min<int>(nbSamples, capacity - (int)(w - r));
+
+    if (n < nbSamples)
+    {
+        overflows += nbSamples - n;
+    }
+
+    int idx = (int)(w % capacity);
+    int first = std::min(n, capacity - idx);
+
+    for (int ch = 0; ch < channels; ++ch)
+    {
+        memcpy(planes[ch] + idx, src[ch], first * sizeof(float));
+        memcpy(planes[ch], src[ch] + first, (n - first) * sizeof(float));
+    }
+
+    writePos.store(w + n, std::memory_order_release);
+
+    return n;
+}
+
+int SampleRing::Available() const
+{
+    return (int)(writePos.load(std::memory_order_acquire) - readPos.load(std::memory_order_relaxed));
+}
+
+const float* SampleRing::Peek(int ch, int offset, int* nbSamples) const
+{
+    int idx = (int)((readPos.load(std::memory_order_relaxed) + offset) % capacity);
+    *nbSamples = std::min(*nbSamples, capacity - idx);
+
+    return planes[ch] + idx;
+}
+
+void SampleRing::Consume(int nbSamples)
+{
+    readPos.store(readPos.load(std::memory_order_relaxed) + nbSamples, std::memory_order_release);
+}
+
+void MixSet(float* dst, const float* src, float gain, int n)
+{
+    int i = 0;
+
+#if defined(__AVX__)
+    __m256 g8 = _mm256_set1_ps(gain);
+
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(src + i), g8));
+    }
+#endif
+#if defined(__SSE__)
+    __m128 g4 = _mm_set1_ps(gain);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), g4));
+    }
+#endif
+
+    for (; i < n; ++i)
+    {
+        dst[i] = src[i] * gain;
+    }
+}
+
+void MixAdd(float* dst, const float* src, float gain, int n)
+{
+    int i = 0;
+
+#if defined(__AVX__)
+    __m256 g8 = _mm256_set1_ps(gain);
+
+    for (; i + 8 <= n; i += 8)
+    {
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(_mm256_loadu_ps(src + i), g8)));
+    }
+#endif
+#if defined(__SSE__)
+    __m128 g4 = _mm_set1_ps(gain);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), g4)));
+    }
+#endif
+
+    for (; i < n; ++i)
+    {
+        dst[i] += src[i] * gain;
+    }
+}
+
+void MixClip(float* dst, int n)
+{
+    int i = 0;
+
+#if defined(__SSE__)
+    __m128 lo = _mm_set1_ps(-1.0f);
+    __m128 hi = _mm_set1_ps(1.0f);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        _mm_storeu_ps(dst + i, _mm_min_ps(_mm_max_ps(_mm_loadu_ps(dst + i), lo), hi));
+    }
+#endif
+
+    for (; i < n; ++i)
+    {
+        dst[i] = std::min(std::max(dst[i], -1.0f), 1.0f);
+    }
+}
+
+AudioMixer::AudioMixer(int channels, int blockSize, int sampleRate) :
+  channels(channels), blockSize(blockSize), sampleRate(sampleRate)
+, blocks(0)
+{
+}
+
+AudioMixer::~AudioMixer()
+{
+    for (Input* input : inputs)
+    {
+        delete input;
+    }
+}
+
+void AudioMixer::AddSource(SampleRing* ring, float gain)
+{
+    Input* input = new Input();
+
+    input->ring = ring;
+    input->gain = gain;
+    input->fillAverage = 0;
+    input->underruns = 0;
+    input->compensation = 0;
+
+    inputs.push_back(input);
+}
+
+bool AudioMixer::MixBlock(float* const* out, bool flush)
+{
+    if (inputs.empty() || inputs[0]->ring->Available() < (flush ? 1 : blockSize))
+    {
+        return false;
+    }
+
+    int64_t start = ThreadCpuNanos();
+    int target = 2 * blockSize;
+
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        Input* input = inputs[i];
+        int available = input->ring->Available();
+        int n = std::min(available, blockSize);
+
+        for (int ch = 0; ch < channels; ++ch)
+        {
+            int done = 0;
+
+            while (done < n)
+            {
+                int span = n - done;
+                const float* src = input->ring->Peek(ch, done, &span);
+
+                if (i == 0)
+                {
+                    MixSet(out[ch] + done, src, input->gain, span);
+                }
+                else
+                {
+                    MixAdd(out[ch] + done, src, input->gain, span);
+                }
+
+                done += span;
+            }
+        }
+
+        input->ring->Consume(n);
+
+        if (i == 0)
+        {
+            // Only short when flushing: the rest of the last block is silence.
+            for (int ch = 0; ch < channels; ++ch)
+            {
+                std::fill(out[ch] + n, out[ch] + blockSize, 0.0f);
+            }
+
+            continue;
+        }
+
+        if (n < blockSize)
+        {
+            input->underruns++;
+        }
+
+        // A source that started well ahead of the master is resynced outright; small clock drift is
+        // left to the resampler, one nudge per second of audio.
+        if (available - n > 4 * blockSize)
+        {
+            input->ring->Consume(available - n - target);
+            input->fillAverage = target;
+            continue;
+        }
+
+        input->fillAverage = 0.95 * input->fillAverage + 0.05 * available;
+
+        if ((blocks + 1) % std::max(1, sampleRate / blockSize) == 0)
+        {
+            int error = (int)(input->fillAverage - target);
+
+            if (std::abs(error) > blockSize / 2)
+            {
+                input->compensation = std::max(-sampleRate / 200, std::min(sampleRate / 200, -error));
+            }
+        }
+    }
+
+    if (inputs.size() > 1)
+    {
+        for (int ch = 0; ch < channels; ++ch)
+        {
+            MixClip(out[ch], blockSize);
+        }
+    }
+
+    blocks++;
+    blockCost.Record((ThreadCpuNanos() - start) * 1024 / blockSize);
+
+    return true;
+}
+
+void AudioMixer::PrintStats() const
+{
+    std::cout << "Audio mixer: " << blocks << " blocks of " << blockSize << " samples from " << inputs.size() << " sources." << std::endl;
+    blockCost.Print("Mixer CPU time per 1024-sample block", "us");
+
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        std::cout << "  source " << i << ": gain " << inputs[i]->gain
+        << ", underruns " << inputs[i]->underruns
+        << ", dropped on overflow " << inputs[i]->ring->Overflows() << " samples" << std::endl;
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "ffmpeg.h"
+#include "Stats.h"
+
+#include <vector>
+
+// Single-producer single-consumer ring of planar float samples. The capture thread of one audio
+// source writes, the mixer reads; the only shared state is the pair of atomic counters.
+class SampleRing
+{
+public:
+    SampleRing(int channels, int capacity);
+    ~SampleRing();
+
+    int             Write(const float* const* planes, int nbSamples);
+    int             Available() const;
+
+    // Contiguous readable span of at most nbSamples starting at the read position of channel ch.
+    const float*    Peek(int ch, int offset, int* nbSamples) const;
+    void            Consume(int nbSamples);
+
+    int             Capacity() const    { return capacity; }
+    int64_t         Overflows() const   { return overflows; }
+
+private:
+    int                         channels;
+    int                         capacity;
+    std::vector<float*>         planes;
+    std::atomic<int64_t>        readPos;
+    std::atomic<int64_t>        writePos;
+    std::atomic<int64_t>        overflows;
+};
+
+// Sums blocks from several SampleRings into one planar float block. Source 0 is the master clock:
+// a block is produced whenever it has a full block buffered, other sources are zero-padded on
+// underrun. At stop, MixBlock(out, true) takes the master's last partial block and zero-pads it.
+// The fill level of every other ring is tracked and turned into a resampler compensation request
+// that its capture thread applies with swr_set_compensation().
+class AudioMixer
+{
+public:
+    AudioMixer(int channels, int blockSize, int sampleRate);
+    ~AudioMixer();
+
+    void            AddSource(SampleRing* ring, float gain);
+    bool            MixBlock(float* const* out, bool flush = false);
+
+    // Polled by the capture thread of source i; returns the pending sample delta (0 if none).
+    int             TakeCompensation(int i)     { return inputs[i]->compensation.exchange(0); }
+    int             CompensationDistance() const { return sampleRate; }
+
+    void            PrintStats() const;
+
+private:
+    struct Input
+    {
+        SampleRing*         ring;
+        float               gain;
+        double              fillAverage;
+        int64_t             underruns;
+        std::atomic<int>    compensation;
+    };
+
+    int                         channels;
+    int                         blockSize;
+    int                         sampleRate;
+    std::vector<Input*>         inputs;
+    int64_t                     blocks;
+    DurationStats               blockCost;
+};
+
+void    MixSet(float* dst, const float* src, float gain, int n);
+void    MixAdd(float* dst, const float* src, float gain, int n);
+void    MixClip(float* dst, int n);
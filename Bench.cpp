@@ -0,0 +1,582 @@
+#include "Bench.h"
+#include "RoiMap.h"
+#include "EncoderBackend.h"
+
+#include <cmath>
+#include <vector>
+
+namespace
+{
+    struct Clip
+    {
+        int                     width;
+        int                     height;
+        int                     fps;
+        std::vector<AVFrame*>   frames;
+    };
+
+    struct RatePoint
+    {
+        int     crf;
+        double  kbps;
+        double  ssim;
+    };
+
+    const int MaxClipFrames = 600;
+
+    AVFrame* AllocPicture(int width, int height)
+    {
+        AVFrame* frame = av_frame_alloc();
+
+        frame->format = AV_PIX_FMT_YUV420P;
+        frame->width = width;
+        frame->height = height;
+
+        if (av_frame_get_buffer(frame, 32) < 0)
+        {
+            av_frame_free(&frame);
+        }
+
+        return frame;
+    }
+
+    bool LoadClip(const std::string& path, Clip& clip)
+    {
+        AVFormatContext* formatContext = nullptr;
+        AVCodec* decoder = nullptr;
+
+        if (avformat_open_input(&formatContext, path.c_str(), nullptr, nullptr) != 0 || avformat_find_stream_info(formatContext, nullptr) < 0)
+        {
+            std::cout << "Can't open " << path << "." << std::endl;
+            return false;
+        }
+
+        int index = av_find_best_stream(formatContext, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+
+        if (index < 0)
+        {
+            std::cout << "No video stream in " << path << "." << std::endl;
+            avformat_close_input(&formatContext);
+            return false;
+        }
+
+        AVStream* stream = formatContext->streams[index];
+        AVCodecContext* decodeContext = avcodec_alloc_context3(decoder);
+
+        avcodec_parameters_to_context(decodeContext, stream->codecpar);
+
+        if (avcodec_open2(decodeContext, decoder, nullptr) < 0)
+        {
+            std::cout << "Can't open the decoder for " << path << "." << std::endl;
+            avcodec_free_context(&decodeContext);
+            avformat_close_input(&formatContext);
+            return false;
+        }
+
+        clip.width = decodeContext->width & ~1;
+        clip.height = decodeContext->height & ~1;
+        clip.fps = stream->avg_frame_rate.den ? (stream->avg_frame_rate.num + stream->avg_frame_rate.den / 2) / stream->avg_frame_rate.den : 30;
+
+        SwsContext* swsContext = sws_getContext(decodeContext->width, decodeContext->height, decodeContext->pix_fmt, clip.width, clip.height, AV_PIX_FMT_YUV420P, SWS_POINT, nullptr, nullptr, nullptr);
+        AVPacket* pkt = av_packet_alloc();
+        AVFrame* decoded = av_frame_alloc();
+        bool draining = false;
+
+        while (clip.frames.size() < MaxClipFrames)
+        {
+            if (!draining)
+            {
+                if (av_read_frame(formatContext, pkt) < 0)
+                {
+                    draining = true;
+                    avcodec_send_packet(decodeContext, nullptr);
+                }
+                else
+                {
+                    if (pkt->stream_index == index)
+                    {
+                        avcodec_send_packet(decodeContext, pkt);
+                    }
+
+                    av_packet_unref(pkt);
+                }
+            }
+
+            while (clip.frames.size() < MaxClipFrames && avcodec_receive_frame(decodeContext, decoded) == 0)
+            {
+                AVFrame* frame = AllocPicture(clip.width, clip.height);
+
+                sws_scale(swsContext, (const uint8_t* const*)decoded->data, decoded->linesize, 0, decodeContext->height, frame->data, frame->linesize);
+                clip.frames.push_back(frame);
+                av_frame_unref(decoded);
+            }
+
+            if (draining)
+            {
+                break;
+            }
+        }
+
+        av_frame_free(&decoded);
+        av_packet_free(&pkt);
+        sws_freeContext(swsContext);
+        avcodec_free_context(&decodeContext);
+        avformat_close_input(&formatContext);
+
+        return !clip.frames.empty();
+    }
+
+    // Mean SSIM over non-overlapping 8x8 windows, the usual constants for 8-bit samples.
+    double PlaneSsim(const uint8_t* a, int strideA, const uint8_t* b, int strideB, int width, int height)
+    {
+        const double c1 = 6.5025, c2 = 58.5225;
+        double total = 0;
+        int windows = 0;
+
+        for (int y = 0; y + 8 <= height; y += 8)
+        {
+            for (int x = 0; x + 8 <= width; x += 8)
+            {
+                int64_t sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+
+                for (int r = 0; r < 8; ++r)
+                {
+                    const uint8_t* pa = a + (y + r) * strideA + x;
+                    const uint8_t* pb = b + (y + r) * strideB + x;
+
+                    for (int i = 0; i < 8; ++i)
+                    {
+                        sa += pa[i];
+                        sb += pb[i];
+                        saa += pa[i] * pa[i];
+                        sbb += pb[i] * pb[i];
+                        sab += pa[i] * pb[i];
+                    }
+                }
+
+                double ma = sa / 64.0, mb = sb / 64.0;
+                double va = saa / 64.0 - ma * ma, vb = sbb / 64.0 - mb * mb, cov = sab / 64.0 - ma * mb;
+
+                total += (2 * ma * mb + c1) * (2 * cov + c2) / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+                windows++;
+            }
+        }
+
+        return windows ? total / windows : 0;
+    }
+
+    // Same encoder settings as the recorder, except for the rate control which is swept through the CRF.
+    RatePoint EncodeAtCrf(const Clip& clip, int crf, bool roi)
+    {
+        RatePoint point = { crf, 0, 0 };
+        AVCodec* encoder = avcodec_find_encoder_by_name("libx264");
+        AVCodec* decoder = avcodec_find_decoder(AV_CODEC_ID_H264);
+
+        if (!encoder || !decoder)
+        {
+            std::cout << "libx264 and the h264 decoder are needed for the benchmark." << std::endl;
+            return point;
+        }
+
+        AVCodecContext* encodeContext = avcodec_alloc_context3(encoder);
+        AVCodecContext* decodeContext = avcodec_alloc_context3(decoder);
+
+        encodeContext->width = clip.width;
+        encodeContext->height = clip.height;
+        encodeContext->time_base = AVRational{ 1, clip.fps };
+        encodeContext->pix_fmt = AV_PIX_FMT_YUV420P;
+        encodeContext->gop_size = 30;
+        encodeContext->max_b_frames = 3;
+        encodeContext->me_range = 16;
+        av_opt_set(encodeContext->priv_data, "crf", std::to_string(crf).c_str(), 0);
+
+        if (avcodec_open2(encodeContext, encoder, nullptr) < 0 || avcodec_open2(decodeContext, decoder, nullptr) < 0)
+        {
+            std::cout << "Can't open the benchmark codecs." << std::endl;
+            avcodec_free_context(&encodeContext);
+            avcodec_free_context(&decodeContext);
+            return point;
+        }
+
+        RoiAnalyzer analyzer(clip.width, clip.height);
+        std::vector<int8_t> map(analyzer.MapSize());
+        std::vector<AVRegionOfInterest> regions(analyzer.MapSize());
+        AVPacket* pkt = av_packet_alloc();
+        AVFrame* decoded = av_frame_alloc();
+        int64_t bytes = 0;
+        size_t next = 0, checked = 0;
+        double ssim = 0;
+
+        auto drain = [&]()
+        {
+            while (avcodec_receive_packet(encodeContext, pkt) == 0)
+            {
+                bytes += pkt->size;
+                avcodec_send_packet(decodeContext, pkt);
+                av_packet_unref(pkt);
+
+                while (avcodec_receive_frame(decodeContext, decoded) == 0)
+                {
+                    const AVFrame* source = clip.frames[checked++];
+
+                    ssim += PlaneSsim(source->data[0], source->linesize[0], decoded->data[0], decoded->linesize[0], clip.width, clip.height);
+                    av_frame_unref(decoded);
+                }
+            }
+        };
+
+        for (next = 0; next < clip.frames.size(); ++next)
+        {
+            AVFrame* frame = clip.frames[next];
+
+            frame->pts = next;
+
+            if (roi)
+            {
+                analyzer.Analyze(frame->data[0], frame->linesize[0], map.data());
+
+                int n = analyzer.BuildRegions(map.data(), regions.data(), regions.size());
+                AVFrameSideData* sd = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, n * sizeof(AVRegionOfInterest));
+
+                if (sd)
+                {
+                    memcpy(sd->data, regions.data(), n * sizeof(AVRegionOfInterest));
+                }
+            }
+
+            avcodec_send_frame(encodeContext, frame);
+            av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+            drain();
+        }
+
+        avcodec_send_frame(encodeContext, nullptr);
+        drain();
+        avcodec_send_packet(decodeContext, nullptr);
+
+        while (avcodec_receive_frame(decodeContext, decoded) == 0 && checked < clip.frames.size())
+        {
+            const AVFrame* source = clip.frames[checked++];
+
+            ssim += PlaneSsim(source->data[0], source->linesize[0], decoded->data[0], decoded->linesize[0], clip.width, clip.height);
+            av_frame_unref(decoded);
+        }
+
+        point.kbps = bytes * 8.0 * clip.fps / clip.frames.size() / 1000.0;
+        point.ssim = checked ? ssim / checked : 0;
+
+        av_frame_free(&decoded);
+        av_packet_free(&pkt);
+        avcodec_free_context(&encodeContext);
+        avcodec_free_context(&decodeContext);
+
+        return point;
+    }
+
+    struct SpeedPoint
+    {
+        bool    opened;
+        double  fps;
+        double  kbps;
+        double  cpuMsPerFrame;
+    };
+
+    int64_t ProcessCpuNanos()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    // The recorder's rate settings (800 kbps at 30 fps, one second GOP) with the backend's preset on top.
+    SpeedPoint EncodeWithBackend(const Clip& clip, const std::string& backend, EncoderPreset preset)
+    {
+        SpeedPoint point = { false, 0, 0, 0 };
+        AVCodec* encoder = FindVideoBackend(backend);
+        AVCodecContext* c = encoder ? avcodec_alloc_context3(encoder) : nullptr;
+        AVDictionary* options = nullptr;
+
+        if (!c)
+        {
+            return point;
+        }
+
+        c->width = clip.width;
+        c->height = clip.height;
+        c->time_base = AVRational{ 1, clip.fps };
+        c->pix_fmt = AV_PIX_FMT_YUV420P;
+        c->bit_rate = 800 * 1000 * (int64_t)clip.fps / 30;
+        c->rc_max_rate = c->bit_rate;
+        c->rc_buffer_size = 500 * 1000 * clip.fps / 30;
+        c->gop_size = clip.fps;
+        ApplyVideoPreset(backend, preset, c, &options);
+
+        if (avcodec_open2(c, encoder, &options) < 0)
+        {
+            av_dict_free(&options);
+            avcodec_free_context(&c);
+            return point;
+        }
+
+        av_dict_free(&options);
+
+        AVPacket* pkt = av_packet_alloc();
+        int64_t bytes = 0;
+        int64_t cpuBegin = ProcessCpuNanos();
+        auto begin = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i <= clip.frames.size(); ++i)
+        {
+            if (i < clip.frames.size())
+            {
+                clip.frames[i]->pts = i;
+            }
+
+            avcodec_send_frame(c, i < clip.frames.size() ? clip.frames[i] : nullptr);
+
+            while (avcodec_receive_packet(c, pkt) == 0)
+            {
+                bytes += pkt->size;
+                av_packet_unref(pkt);
+            }
+        }
+
+        double seconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count() / 1e6;
+
+        point.opened = true;
+        point.fps = clip.frames.size() / seconds;
+        point.kbps = bytes * 8.0 * clip.fps / clip.frames.size() / 1000.0;
+        point.cpuMsPerFrame = (ProcessCpuNanos() - cpuBegin) / 1e6 / clip.frames.size();
+
+        av_packet_free(&pkt);
+        avcodec_free_context(&c);
+
+        return point;
+    }
+
+    // Ten seconds of a stereo tone; speed is reported as a multiple of real time.
+    SpeedPoint EncodeAudioWithBackend(const std::string& backend, EncoderPreset preset)
+    {
+        const int Seconds = 10;
+        SpeedPoint point = { false, 0, 0, 0 };
+        AVCodec* encoder = FindAudioBackend(backend);
+        AVCodecContext* c = encoder ? avcodec_alloc_context3(encoder) : nullptr;
+        AVDictionary* options = nullptr;
+
+        if (!c)
+        {
+            return point;
+        }
+
+        c->sample_fmt = AV_SAMPLE_FMT_FLTP;
+        c->sample_rate = encoder->supported_samplerates ? encoder->supported_samplerates[0] : 48000;
+        c->channel_layout = AV_CH_LAYOUT_STEREO;
+        c->channels = 2;
+        c->time_base = AVRational{ 1, c->sample_rate };
+        c->bit_rate = 128000;
+        c->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+        ApplyAudioPreset(backend, preset, c, &options);
+
+        if (avcodec_open2(c, encoder, &options) < 0)
+        {
+            av_dict_free(&options);
+            avcodec_free_context(&c);
+            return point;
+        }
+
+        av_dict_free(&options);
+
+        AVFrame* frame = av_frame_alloc();
+        AVPacket* pkt = av_packet_alloc();
+        int frameSize = c->frame_size ? c->frame_size : 1024;
+        int64_t bytes = 0;
+
+        frame->format = c->sample_fmt;
+        frame->channel_layout = c->channel_layout;
+        frame->sample_rate = c->sample_rate;
+        frame->nb_samples = frameSize;
+        av_frame_get_buffer(frame, 0);
+
+        auto begin = std::chrono::steady_clock::now();
+
+        for (int64_t sample = 0; sample < (int64_t)Seconds * c->sample_rate; sample += frameSize)
+        {
+            for (int ch = 0; ch < 2; ++ch)
+            {
+                float* data = (float*)frame->data[ch];
+
+                for (int i = 0; i < frameSize; ++i)
+                {
+                    data[i] = 0.25f * sinf(2 * M_PI * 440 * (sample + i) / c->sample_rate);
+                }
+            }
+
+            frame->pts = sample;
+            avcodec_send_frame(c, frame);
+
+            while (avcodec_receive_packet(c, pkt) == 0)
+            {
+                bytes += pkt->size;
+                av_packet_unref(pkt);
+            }
+        }
+
+        double seconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count() / 1e6;
+
+        point.opened = true;
+        point.fps = Seconds / seconds;
+        point.kbps = bytes * 8.0 / Seconds / 1000.0;
+
+        av_frame_free(&frame);
+        av_packet_free(&pkt);
+        avcodec_free_context(&c);
+
+        return point;
+    }
+
+    // Linear interpolation of the bitrate on a curve sorted by increasing CRF (decreasing SSIM); -1 outside it.
+    double BitrateAt(const std::vector<RatePoint>& curve, double ssim)
+    {
+        for (size_t i = 0; i + 1 < curve.size(); ++i)
+        {
+            const RatePoint& hi = curve[i];
+            const RatePoint& lo = curve[i + 1];
+
+            if (ssim <= hi.ssim && ssim >= lo.ssim && hi.ssim > lo.ssim)
+            {
+                double t = (ssim - lo.ssim) / (hi.ssim - lo.ssim);
+                return lo.kbps + t * (hi.kbps - lo.kbps);
+            }
+        }
+
+        return -1;
+    }
+}
+
+int RunRoiBench(const std::string& clipPath)
+{
+    const int crfs[] = { 18, 22, 26, 30, 34 };
+    Clip clip;
+    std::vector<RatePoint> plain, roi;
+
+    if (!LoadClip(clipPath, clip))
+    {
+        return -1;
+    }
+
+    std::cout << "ROI benchmark on " << clip.frames.size() << " frames of " << clip.width << "x" << clip.height << " at " << clip.fps << " fps." << std::endl;
+
+    for (int crf : crfs)
+    {
+        plain.push_back(EncodeAtCrf(clip, crf, false));
+        roi.push_back(EncodeAtCrf(clip, crf, true));
+
+        std::cout << "crf " << crf << ": plain " << plain.back().kbps << " kbps SSIM " << plain.back().ssim
+        << ", roi " << roi.back().kbps << " kbps SSIM " << roi.back().ssim << std::endl;
+    }
+
+    double saved = 0;
+    int compared = 0;
+
+    for (const RatePoint& point : roi)
+    {
+        double baseline = BitrateAt(plain, point.ssim);
+
+        if (baseline > 0)
+        {
+            std::cout << "At SSIM " << point.ssim << ": plain needs " << baseline << " kbps, roi " << point.kbps << " kbps ("
+            << 100.0 * (baseline - point.kbps) / baseline << "% saved)." << std::endl;
+            saved += (baseline - point.kbps) / baseline;
+            compared++;
+        }
+    }
+
+    if (compared)
+    {
+        std::cout << "Average bitrate saving at equal SSIM: " << 100.0 * saved / compared << "%." << std::endl;
+    }
+    else
+    {
+        std::cout << "The two curves don't overlap in SSIM, no equal-quality comparison possible." << std::endl;
+    }
+
+    for (AVFrame* frame : clip.frames)
+    {
+        av_frame_free(&frame);
+    }
+
+    return 0;
+}
+
+int RunEncoderBench(const std::string& clipPath)
+{
+    const EncoderPreset presets[] = { EncoderPreset::Realtime, EncoderPreset::Balanced, EncoderPreset::Archival };
+    Clip clip;
+    std::string best;
+    double bestKbps = 0;
+
+    if (!LoadClip(clipPath, clip))
+    {
+        return -1;
+    }
+
+    std::cout << "Encoder benchmark on " << clip.frames.size() << " frames of " << clip.width << "x" << clip.height << " at " << clip.fps << " fps." << std::endl;
+
+    for (const std::string& backend : VideoBackends())
+    {
+        for (EncoderPreset preset : presets)
+        {
+            SpeedPoint point = EncodeWithBackend(clip, backend, preset);
+            std::string name = backend + " " + EncoderPresetName(preset);
+
+            if (!point.opened)
+            {
+                std::cout << name << ": not available in this FFmpeg build." << std::endl;
+                break;
+            }
+
+            bool realtime = point.fps >= clip.fps;
+
+            std::cout << name << ": " << point.fps << " fps, " << point.kbps << " kbps, " << point.cpuMsPerFrame << " ms CPU per frame"
+            << (realtime ? "" : ", can't hold real time") << "." << std::endl;
+
+            if (realtime && (best.empty() || point.kbps < bestKbps))
+            {
+                best = name;
+                bestKbps = point.kbps;
+            }
+        }
+    }
+
+    if (!best.empty())
+    {
+        std::cout << "Smallest output that holds " << clip.fps << " fps on this host: " << best << " (" << bestKbps << " kbps)." << std::endl;
+    }
+    else
+    {
+        std::cout << "No backend holds " << clip.fps << " fps on this host." << std::endl;
+    }
+
+    for (const std::string& backend : AudioBackends())
+    {
+        for (EncoderPreset preset : presets)
+        {
+            SpeedPoint point = EncodeAudioWithBackend(backend, preset);
+
+            if (!point.opened)
+            {
+                std::cout << backend << ": not available in this FFmpeg build." << std::endl;
+                break;
+            }
+
+            std::cout << backend << " " << EncoderPresetName(preset) << ": " << point.fps << "x real time, " << point.kbps << " kbps." << std::endl;
+        }
+    }
+
+    for (AVFrame* frame : clip.frames)
+    {
+        av_frame_free(&frame);
+    }
+
+    return 0;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "ffmpeg.h"
+
+// Offline benchmarks that run on a recorded clip instead of a live capture.
+
+// Encodes the clip at several CRFs with and without the ROI map, decodes the result back and reports
+// the bitrate needed by each mode to reach the same luma SSIM.
+int RunRoiBench(const std::string& clipPath);
+
+// Encodes the clip with every available video backend at each speed preset, reporting encode fps,
+// bitrate and CPU time per frame, and times the audio backends on a synthetic tone.
+int RunEncoderBench(const std::string& clipPath);
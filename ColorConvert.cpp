@@ -0,0 +1,177 @@
+#include "ColorConvert.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// BT.601 limited range, coefficients scaled by 1 << 15 so they still fit pmaddwd's signed 16-bit inputs.
+static const int YB = 3208, YG = 16519, YR = 8414;
+static const int UB = 14372, UG = -9521, UR = -4850;
+static const int VB = -2337, VG = -12035, VR = 14372;
+static const int Shift = 15;
+
+static inline void ConvertPixel(const uint8_t* p, uint8_t* y, uint8_t* u, uint8_t* v)
+{
+    int b = p[0], g = p[1], r = p[2];
+
+    *y = (uint8_t)(((YB * b + YG * g + YR * r + (1 << (Shift - 1))) >> Shift) + 16);
+    *u = (uint8_t)(((UB * b + UG * g + UR * r + (1 << (Shift - 1))) >> Shift) + 128);
+    *v = (uint8_t)(((VB * b + VG * g + VR * r + (1 << (Shift - 1))) >> Shift) + 128);
+}
+
+#if defined(__SSE2__)
+// Four BGR0 pixels in, four 32-bit dot products with (b, g, r, 0) out.
+static inline __m128i Dot4(__m128i pixels, __m128i coeffs)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), coeffs);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), coeffs);
+    __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1));
+
+    return _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+}
+
+// Sixteen pixels to one output row segment: scale back, add the offset and saturate to bytes.
+static inline __m128i Plane16(const __m128i px[4], __m128i coeffs, __m128i round, __m128i offset)
+{
+    __m128i a = _mm_srai_epi32(_mm_add_epi32(Dot4(px[0], coeffs), round), Shift);
+    __m128i b = _mm_srai_epi32(_mm_add_epi32(Dot4(px[1], coeffs), round), Shift);
+    __m128i c = _mm_srai_epi32(_mm_add_epi32(Dot4(px[2], coeffs), round), Shift);
+    __m128i d = _mm_srai_epi32(_mm_add_epi32(Dot4(px[3], coeffs), round), Shift);
+
+    return _mm_packus_epi16(_mm_add_epi16(_mm_packs_epi32(a, b), offset), _mm_add_epi16(_mm_packs_epi32(c, d), offset));
+}
+#endif
+
+void ConvertBgr0ToYuv444(const uint8_t* src, int srcStride, uint8_t* const dst[3], const int dstStride[3], int width, int height)
+{
+#if defined(__SSE2__)
+    const __m128i yCoeffs = _mm_setr_epi16(YB, YG, YR, 0, YB, YG, YR, 0);
+    const __m128i uCoeffs = _mm_setr_epi16(UB, UG, UR, 0, UB, UG, UR, 0);
+    const __m128i vCoeffs = _mm_setr_epi16(VB, VG, VR, 0, VB, VG, VR, 0);
+    const __m128i round = _mm_set1_epi32(1 << (Shift - 1));
+    const __m128i lumaOffset = _mm_set1_epi16(16);
+    const __m128i chromaOffset = _mm_set1_epi16(128);
+#endif
+
+    for (int row = 0; row < height; ++row)
+    {
+        const uint8_t* p = src + row * srcStride;
+        uint8_t* y = dst[0] + row * dstStride[0];
+        uint8_t* u = dst[1] + row * dstStride[1];
+        uint8_t* v = dst[2] + row * dstStride[2];
+        int x = 0;
+
+#if defined(__SSE2__)
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i px[4];
+
+            for (int i = 0; i < 4; ++i)
+            {
+                px[i] = _mm_loadu_si128((const __m128i*)(p + 4 * x + 16 * i));
+            }
+
+            _mm_storeu_si128((__m128i*)(y + x), Plane16(px, yCoeffs, round, lumaOffset));
+            _mm_storeu_si128((__m128i*)(u + x), Plane16(px, uCoeffs, round, chromaOffset));
+            _mm_storeu_si128((__m128i*)(v + x), Plane16(px, vCoeffs, round, chromaOffset));
+        }
+#endif
+
+        for (; x < width; ++x)
+        {
+            ConvertPixel(p + 4 * x, y + x, u + x, v + x);
+        }
+    }
+}
+
+// Sum of the B, G and R of one k x k source block (k = 1 << shift).
+struct BlockSum
+{
+    int b, g, r;
+};
+
+static inline BlockSum SumBlock(const uint8_t* p, int stride, int shift)
+{
+    int k = 1 << shift;
+    BlockSum s;
+
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+
+    // 16-bit lanes hold B, G, R, 0 of two pixels; 16 pixels of 255 still fit.
+    for (int r = 0; r < k; ++r)
+    {
+        if (shift == 1)
+        {
+            acc = _mm_add_epi16(acc, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(p + r * stride)), zero));
+        }
+        else
+        {
+            __m128i px = _mm_loadu_si128((const __m128i*)(p + r * stride));
+            acc = _mm_add_epi16(acc, _mm_add_epi16(_mm_unpacklo_epi8(px, zero), _mm_unpackhi_epi8(px, zero)));
+        }
+    }
+
+    acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 8));
+    s.b = _mm_extract_epi16(acc, 0);
+    s.g = _mm_extract_epi16(acc, 1);
+    s.r = _mm_extract_epi16(acc, 2);
+#else
+    s.b = s.g = s.r = 0;
+
+    for (int r = 0; r < k; ++r)
+    {
+        for (int x = 0; x < k; ++x)
+        {
+            s.b += p[r * stride + 4 * x];
+            s.g += p[r * stride + 4 * x + 1];
+            s.r += p[r * stride + 4 * x + 2];
+        }
+    }
+#endif
+
+    return s;
+}
+
+static inline uint8_t LumaOf(const BlockSum& s, int shift)
+{
+    return (uint8_t)(((YB * s.b + YG * s.g + YR * s.r + (1 << (shift - 1))) >> shift) + 16);
+}
+
+void ConvertBgr0ToI420Downscale(const uint8_t* src, int srcStride, uint8_t* const dst[3], const int dstStride[3], int outWidth, int outHeight, int shift)
+{
+    int k = 1 << shift;
+    int lumaShift = Shift + 2 * shift;
+    int chromaShift = lumaShift + 2;
+
+    for (int oy = 0; oy < outHeight; oy += 2)
+    {
+        const uint8_t* row0 = src + oy * k * srcStride;
+        const uint8_t* row1 = row0 + k * srcStride;
+        uint8_t* y0 = dst[0] + oy * dstStride[0];
+        uint8_t* y1 = y0 + dstStride[0];
+        uint8_t* u = dst[1] + (oy / 2) * dstStride[1];
+        uint8_t* v = dst[2] + (oy / 2) * dstStride[2];
+
+        for (int ox = 0; ox < outWidth; ox += 2)
+        {
+            BlockSum s00 = SumBlock(row0 + ox * k * 4, srcStride, shift);
+            BlockSum s01 = SumBlock(row0 + (ox + 1) * k * 4, srcStride, shift);
+            BlockSum s10 = SumBlock(row1 + ox * k * 4, srcStride, shift);
+            BlockSum s11 = SumBlock(row1 + (ox + 1) * k * 4, srcStride, shift);
+            int b = s00.b + s01.b + s10.b + s11.b;
+            int g = s00.g + s01.g + s10.g + s11.g;
+            int r = s00.r + s01.r + s10.r + s11.r;
+
+            y0[ox] = LumaOf(s00, lumaShift);
+            y0[ox + 1] = LumaOf(s01, lumaShift);
+            y1[ox] = LumaOf(s10, lumaShift);
+            y1[ox + 1] = LumaOf(s11, lumaShift);
+            u[ox / 2] = (uint8_t)(((UB * b + UG * g + UR * r + (1 << (chromaShift - 1))) >> chromaShift) + 128);
+            v[ox / 2] = (uint8_t)(((VB * b + VG * g + VR * r + (1 << (chromaShift - 1))) >> chromaShift) + 128);
+        }
+    }
+}
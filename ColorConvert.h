@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+// Packed BGR0 (x11grab on 24/32-bit visuals) to planar BT.601 limited-range YUV 4:4:4, every pixel
+// keeping its own chroma sample. Plane strides are in bytes.
+void ConvertBgr0ToYuv444(const uint8_t* src, int srcStride, uint8_t* const dst[3], const int dstStride[3], int width, int height);
+
+// Box-filtered 2x (shift 1) or 4x (shift 2) downscale fused with BGR0 to BT.601 limited-range I420.
+// Every source pixel is read once; each 2x2 group of output pixels shares the chroma of its whole
+// source block. The output dimensions must be even.
+void ConvertBgr0ToI420Downscale(const uint8_t* src, int srcStride, uint8_t* const dst[3], const int dstStride[3], int outWidth, int outHeight, int shift);
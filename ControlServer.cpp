@@ -0,0 +1,161 @@
+#include "ControlServer.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <map>
+
+ControlServer::~ControlServer()
+{
+    if (listenFd >= 0)
+    {
+        close(listenFd);
+        unlink(socketPath.c_str());
+    }
+}
+
+std::string ControlServer::Handle(const std::string& line, bool* shutdown)
+{
+    std::stringstream in(line);
+    std::string command, argument;
+
+    in >> command >> argument;
+
+    try
+    {
+        if (command == "start")
+        {
+            if (argument.empty())
+            {
+                return "ERROR missing output file";
+            }
+
+            capture->Start(argument);
+        }
+        else if (command == "pause")
+        {
+            capture->Pause();
+        }
+        else if (command == "resume")
+        {
+            capture->Resume();
+        }
+        else if (command == "stop")
+        {
+            capture->Stop();
+        }
+        else if (command == "status")
+        {
+            return "OK " + capture->Status();
+        }
+        else if (command == "shutdown")
+        {
+            *shutdown = true;
+        }
+        else
+        {
+            return "ERROR unknown command '" + command + "'";
+        }
+    }
+    catch (std::exception& e)
+    {
+        return std::string("ERROR ") + e.what();
+    }
+
+    return "OK " + capture->Status();
+}
+
+void ControlServer::Run()
+{
+    struct sockaddr_un addr;
+    bool shutdown = false;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(socketPath.c_str());
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 8) < 0)
+    {
+        throw std::runtime_error("Can't listen on control socket " + socketPath + ": " + strerror(errno));
+    }
+
+    std::cout << "Listening for commands on " << socketPath << std::endl;
+
+    std::vector<struct pollfd> fds;
+    std::map<int, std::string> pendingInput;
+
+    fds.push_back(pollfd{ listenFd, POLLIN, 0 });
+
+    while (!shutdown)
+    {
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            throw std::runtime_error(std::string("Control socket poll failed: ") + strerror(errno));
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            int client = accept(listenFd, nullptr, nullptr);
+
+            if (client >= 0)
+            {
+                fds.push_back(pollfd{ client, POLLIN, 0 });
+            }
+        }
+
+        for (size_t i = 1; i < fds.size() && !shutdown; ++i)
+        {
+            if (!fds[i].revents)
+            {
+                continue;
+            }
+
+            char buf[512];
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+
+            if (n <= 0)
+            {
+                close(fds[i].fd);
+                pendingInput.erase(fds[i].fd);
+                fds.erase(fds.begin() + i--);
+                continue;
+            }
+
+            std::string& input = pendingInput[fds[i].fd];
+            input.append(buf, n);
+
+            size_t eol;
+
+            while ((eol = input.find('\n')) != std::string::npos && !shutdown)
+            {
+                auto begin = std::chrono::steady_clock::now();
+                std::string reply = Handle(input.substr(0, eol), &shutdown) + "\n";
+
+                commandLatency.Record(std::chrono::steady_clock::now() - begin);
+                input.erase(0, eol + 1);
+
+                if (send(fds[i].fd, reply.c_str(), reply.size(), MSG_NOSIGNAL) < 0)
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 1; i < fds.size(); ++i)
+    {
+        close(fds[i].fd);
+    }
+
+    commandLatency.Print("Control command latency", "us");
+    capture->Shutdown();
+}
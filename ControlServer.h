@@ -0,0 +1,29 @@
+#pragma once
+
+#include "ScreenRecord.h"
+
+// Line-based control plane for a persistent ScreenRecord over a Unix domain socket.
+// Commands: "start <file>", "pause", "resume", "stop", "status", "shutdown".
+// Every command gets one reply line, "OK <info>" or "ERROR <reason>". Any number of clients may
+// stay connected; commands are served in arrival order on the server thread.
+class ControlServer
+{
+public:
+    ControlServer(ScreenRecord* capture, std::string socketPath) :
+      capture(capture), socketPath(socketPath), listenFd(-1)
+    {
+    }
+
+    ~ControlServer();
+
+    // Blocks until a "shutdown" command has been served.
+    void Run();
+
+private:
+    std::string     Handle(const std::string& line, bool* shutdown);
+
+    ScreenRecord*   capture;
+    std::string     socketPath;
+    int             listenFd;
+    DurationStats   commandLatency;
+};
@@ -0,0 +1,273 @@
+#include "Cursor.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <poll.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xfixes.h>
+
+static inline int64_t PackPosition(int x, int y)
+{
+    return ((int64_t)x << 32) | (uint32_t)y;
+}
+
+static inline uint8_t Div255(int v)
+{
+    return (uint8_t)((v + 128 + ((v + 128) >> 8)) >> 8);
+}
+
+void BlendPremultipliedRow(uint8_t* dst, const uint8_t* src, const uint8_t* alpha, int n)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i full = _mm_set1_epi16(255);
+    __m128i half = _mm_set1_epi16(128);
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(dst + i)), zero);
+        __m128i s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + i)), zero);
+        __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(alpha + i)), zero);
+
+        __m128i t = _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(full, a)), half);
+        t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+
+        _mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(_mm_add_epi16(t, s), zero));
+    }
+#endif
+
+    for (; i < n; ++i)
+    {
+        dst[i] = (uint8_t)std::min(255, src[i] + Div255(dst[i] * (255 - alpha[i])));
+    }
+}
+
+CursorTracker::CursorTracker(std::string display, int fps) :
+  display(display), fps(fps), running(false)
+, position(PackPosition(INT32_MIN, INT32_MIN))
+, imageUpdates(0), lastPosition(0), framesMoved(0), framesStill(0)
+{
+}
+
+CursorTracker::~CursorTracker()
+{
+    Stop();
+}
+
+bool CursorTracker::Start()
+{
+    Display* dpy = XOpenDisplay(display.c_str());
+    int eventBase, errorBase;
+
+    if (!dpy)
+    {
+        return false;
+    }
+
+    if (!XFixesQueryExtension(dpy, &eventBase, &errorBase))
+    {
+        XCloseDisplay(dpy);
+        return false;
+    }
+
+    XFixesSelectCursorInput(dpy, DefaultRootWindow(dpy), XFixesDisplayCursorNotifyMask);
+    LoadImage(dpy);
+
+    running = true;
+    thread = std::thread(&CursorTracker::ThreadProc, this, (void*)dpy);
+
+    return true;
+}
+
+void CursorTracker::Stop()
+{
+    running = false;
+
+    if (thread.joinable())
+    {
+        thread.join();
+    }
+}
+
+void CursorTracker::LoadImage(void* connection)
+{
+    XFixesCursorImage* cursor = XFixesGetCursorImage((Display*)connection);
+
+    if (!cursor)
+    {
+        return;
+    }
+
+    std::shared_ptr<Image> img = std::make_shared<Image>();
+    int w = cursor->width, h = cursor->height;
+    int cw = (w + 1) / 2, ch = (h + 1) / 2;
+
+    img->width = w;
+    img->height = h;
+    img->xhot = cursor->xhot;
+    img->yhot = cursor->yhot;
+    img->y.resize(w * h);
+    img->u.resize(w * h);
+    img->v.resize(w * h);
+    img->a.resize(w * h);
+
+    // XFixes hands out premultiplied ARGB in the low 32 bits of each unsigned long. The BT.601
+    // limited-range offsets are scaled by alpha too, so the planes stay premultiplied.
+    for (int i = 0; i < w * h; ++i)
+    {
+        uint32_t p = (uint32_t)cursor->pixels[i];
+        int a = p >> 24, r = (p >> 16) & 0xff, g = (p >> 8) & 0xff, b = p & 0xff;
+
+        img->a[i] = a;
+        img->y[i] = (uint8_t)std::min(255, ((66 * r + 129 * g + 25 * b + 128) >> 8) + Div255(16 * a));
+        img->u[i] = (uint8_t)std::max(0, std::min(255, ((-38 * r - 74 * g + 112 * b + 128) >> 8) + Div255(128 * a)));
+        img->v[i] = (uint8_t)std::max(0, std::min(255, ((112 * r - 94 * g - 18 * b + 128) >> 8) + Div255(128 * a)));
+    }
+
+    img->u2.resize(cw * ch);
+    img->v2.resize(cw * ch);
+    img->a2.resize(cw * ch);
+
+    for (int cy = 0; cy < ch; ++cy)
+    {
+        for (int cx = 0; cx < cw; ++cx)
+        {
+            int su = 0, sv = 0, sa = 0, n = 0;
+
+            for (int dy = 0; dy < 2 && 2 * cy + dy < h; ++dy)
+            {
+                for (int dx = 0; dx < 2 && 2 * cx + dx < w; ++dx)
+                {
+                    int i = (2 * cy + dy) * w + 2 * cx + dx;
+                    su += img->u[i];
+                    sv += img->v[i];
+                    sa += img->a[i];
+                    n++;
+                }
+            }
+
+            // Pixels outside the image count as transparent, so partially covered blocks stay premultiplied.
+            img->u2[cy * cw + cx] = su / 4;
+            img->v2[cy * cw + cx] = sv / 4;
+            img->a2[cy * cw + cx] = sa / 4;
+        }
+    }
+
+    XFree(cursor);
+
+    {
+        std::lock_guard<std::mutex> lk(mutexImage);
+        image = img;
+    }
+
+    imageUpdates++;
+}
+
+void CursorTracker::ThreadProc(void* connection)
+{
+    Display* dpy = (Display*)connection;
+    int eventBase, errorBase;
+    struct pollfd pfd = { ConnectionNumber(dpy), POLLIN, 0 };
+
+    XFixesQueryExtension(dpy, &eventBase, &errorBase);
+
+    while (running)
+    {
+        while (XPending(dpy))
+        {
+            XEvent event;
+            XNextEvent(dpy, &event);
+
+            if (event.type == eventBase + XFixesCursorNotify)
+            {
+                LoadImage(dpy);
+            }
+        }
+
+        Window root, child;
+        int rootX, rootY, winX, winY;
+        unsigned int mask;
+
+        if (XQueryPointer(dpy, DefaultRootWindow(dpy), &root, &child, &rootX, &rootY, &winX, &winY, &mask))
+        {
+            position = PackPosition(rootX, rootY);
+        }
+
+        // Sample the pointer once per frame period, waking early for cursor shape changes.
+        poll(&pfd, 1, 1000 / fps);
+    }
+
+    XCloseDisplay(dpy);
+}
+
+void CursorTracker::Blend(AVFrame* frame, int originX, int originY, int chromaShift, double scale)
+{
+    auto begin = std::chrono::steady_clock::now();
+    std::shared_ptr<const Image> img;
+    int64_t pos = position;
+
+    {
+        std::lock_guard<std::mutex> lk(mutexImage);
+        img = image;
+    }
+
+    if (pos == lastPosition)
+    {
+        framesStill++;
+    }
+    else
+    {
+        framesMoved++;
+        lastPosition = pos;
+    }
+
+    if (!img || (int32_t)(pos >> 32) == INT32_MIN)
+    {
+        return;
+    }
+
+    int x0 = (int)(((int32_t)(pos >> 32) - originX) * scale) - img->xhot;
+    int y0 = (int)(((int32_t)(pos & 0xffffffff) - originY) * scale) - img->yhot;
+
+    // Luma: clip the cursor rectangle against the frame and blend row by row.
+    int left = std::max(0, -x0), top = std::max(0, -y0);
+    int right = std::min(img->width, frame->width - x0), bottom = std::min(img->height, frame->height - y0);
+
+    for (int r = top; r < bottom; ++r)
+    {
+        BlendPremultipliedRow(frame->data[0] + (y0 + r) * frame->linesize[0] + x0 + left, &img->y[r * img->width + left], &img->a[r * img->width + left], right - left);
+    }
+
+    // Chroma: in 4:2:0 the cursor origin is snapped to the chroma grid.
+    int cw = chromaShift ? (img->width + 1) / 2 : img->width;
+    int ch = chromaShift ? (img->height + 1) / 2 : img->height;
+    int cx0 = chromaShift ? (x0 >> 1) : x0, cy0 = chromaShift ? (y0 >> 1) : y0;
+    int frameCw = chromaShift ? (frame->width + 1) / 2 : frame->width;
+    int frameCh = chromaShift ? (frame->height + 1) / 2 : frame->height;
+    const uint8_t *u = chromaShift ? img->u2.data() : img->u.data();
+    const uint8_t *v = chromaShift ? img->v2.data() : img->v.data();
+    const uint8_t *a = chromaShift ? img->a2.data() : img->a.data();
+
+    left = std::max(0, -cx0);
+    top = std::max(0, -cy0);
+    right = std::min(cw, frameCw - cx0);
+    bottom = std::min(ch, frameCh - cy0);
+
+    for (int r = top; r < bottom; ++r)
+    {
+        BlendPremultipliedRow(frame->data[1] + (cy0 + r) * frame->linesize[1] + cx0 + left, u + r * cw + left, a + r * cw + left, right - left);
+        BlendPremultipliedRow(frame->data[2] + (cy0 + r) * frame->linesize[2] + cx0 + left, v + r * cw + left, a + r * cw + left, right - left);
+    }
+
+    blendCost.Record(std::chrono::steady_clock::now() - begin);
+}
+
+void CursorTracker::PrintStats() const
+{
+    std::cout << "Cursor: " << imageUpdates << " image updates, " << framesMoved << " frames with pointer motion, " << framesStill << " still." << std::endl;
+    blendCost.Print("Cursor blend time per frame", "us");
+}
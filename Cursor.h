@@ -0,0 +1,59 @@
+#pragma once
+
+#include "ffmpeg.h"
+#include "Stats.h"
+
+#include <memory>
+#include <vector>
+
+// Tracks the X pointer on its own display connection so x11grab can run with draw_mouse=0.
+// The cursor image is only fetched again on XFixes cursor-change events and is cached as
+// premultiplied Y/U/V/alpha planes; the capture thread then just blends that bounding box
+// into each converted frame.
+class CursorTracker
+{
+public:
+    CursorTracker(std::string display, int fps);
+    ~CursorTracker();
+
+    bool            Start();
+    void            Stop();
+
+    // Blend into a planar YUV frame (4:2:0 or 4:4:4) whose top-left corner is at (originX, originY)
+    // in root window coordinates. A scaled output moves the pointer by scale but keeps its size.
+    void            Blend(AVFrame* frame, int originX, int originY, int chromaShift, double scale = 1.0);
+    void            PrintStats() const;
+
+private:
+    struct Image
+    {
+        int                     width;
+        int                     height;
+        int                     xhot;
+        int                     yhot;
+        std::vector<uint8_t>    y, u, v, a;             // full resolution, premultiplied
+        std::vector<uint8_t>    u2, v2, a2;             // 2x2 averaged for 4:2:0 chroma
+    };
+
+    // The X connection is only used by the tracker thread; it is passed as void* to keep Xlib out of this header.
+    void            ThreadProc(void* connection);
+    void            LoadImage(void* connection);
+
+    std::string                 display;
+    int                         fps;
+    std::atomic<bool>           running;
+    std::thread                 thread;
+
+    std::atomic<int64_t>        position;
+    std::shared_ptr<const Image> image;
+    std::mutex                  mutexImage;
+
+    std::atomic<int64_t>        imageUpdates;
+    int64_t                     lastPosition;
+    int64_t                     framesMoved;
+    int64_t                     framesStill;
+    DurationStats               blendCost;
+};
+
+// dst = src + dst * (255 - alpha) / 255 over n pixels, with src already premultiplied.
+void    BlendPremultipliedRow(uint8_t* dst, const uint8_t* src, const uint8_t* alpha, int n);
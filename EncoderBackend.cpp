@@ -0,0 +1,202 @@
+#include "EncoderBackend.h"
+
+namespace
+{
+    struct Backend
+    {
+        const char*     name;
+        const char*     encoder;        // libavcodec encoder name
+        // Codec-specific speed setting per preset: realtime, balanced, archival.
+        const char*     speedOption;
+        const char*     speeds[3];
+    };
+
+    const Backend videoBackends[] =
+    {
+        { "x264",       "libx264",      "preset",       { "veryfast", "fast", "slow" } },
+        { "x265",       "libx265",      "preset",       { "ultrafast", "fast", "slow" } },
+        { "svt-av1",    "libsvtav1",    "preset",       { "8", "6", "4" } },
+        { "openh264",   "libopenh264",  nullptr,        { nullptr, nullptr, nullptr } },
+    };
+
+    const Backend audioBackends[] =
+    {
+        { "aac",        "aac",          "aac_coder",            { "fast", "twoloop", "twoloop" } },
+        { "opus",       "libopus",      "compression_level",    { "0", "5", "10" } },
+    };
+
+    template <size_t N>
+    const Backend* Find(const Backend (&backends)[N], const std::string& name)
+    {
+        for (const Backend& backend : backends)
+        {
+            if (name == backend.name)
+            {
+                return &backend;
+            }
+        }
+
+        return nullptr;
+    }
+
+    template <size_t N>
+    std::vector<std::string> Names(const Backend (&backends)[N])
+    {
+        std::vector<std::string> names;
+
+        for (const Backend& backend : backends)
+        {
+            names.push_back(backend.name);
+        }
+
+        return names;
+    }
+}
+
+bool ParseEncoderPreset(const std::string& name, EncoderPreset* preset)
+{
+    static const EncoderPreset presets[] = { EncoderPreset::Realtime, EncoderPreset::Balanced, EncoderPreset::Archival };
+
+    for (EncoderPreset p : presets)
+    {
+        if (name == EncoderPresetName(p))
+        {
+            *preset = p;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char* EncoderPresetName(EncoderPreset preset)
+{
+    static const char* names[] = { "default", "realtime", "balanced", "archival" };
+
+    return names[(int)preset];
+}
+
+const std::vector<std::string>& VideoBackends()
+{
+    static const std::vector<std::string> names = Names(videoBackends);
+
+    return names;
+}
+
+const std::vector<std::string>& AudioBackends()
+{
+    static const std::vector<std::string> names = Names(audioBackends);
+
+    return names;
+}
+
+AVCodec* FindVideoBackend(const std::string& name)
+{
+    const Backend* backend = Find(videoBackends, name);
+
+    return backend ? const_cast<AVCodec*>(avcodec_find_encoder_by_name(backend->encoder)) : nullptr;
+}
+
+AVCodec* FindAudioBackend(const std::string& name)
+{
+    const Backend* backend = Find(audioBackends, name);
+
+    return backend ? const_cast<AVCodec*>(avcodec_find_encoder_by_name(backend->encoder)) : nullptr;
+}
+
+void ApplyVideoRateControl(AVCodecContext* c, int fps)
+{
+    c->bit_rate = 800 * 1000 * (int64_t)fps / 30;
+    c->rc_max_rate = 800 * 1000 * (int64_t)fps / 30;
+    c->rc_buffer_size = 500 * 1000 * fps / 30;
+    c->gop_size = fps;
+    c->max_b_frames = 3;
+    c->qmin = 10;
+    c->qmax = 31;
+    c->max_qdiff = 4;
+    c->me_range = 16;
+    c->qcompress = 0.6;
+}
+
+void ApplyVideoPreset(const std::string& name, EncoderPreset preset, AVCodecContext* c, AVDictionary** options)
+{
+    const Backend* backend = Find(videoBackends, name);
+
+    if (!backend || preset == EncoderPreset::Default)
+    {
+        return;
+    }
+
+    int level = (int)preset - 1;
+
+    if (backend->speedOption)
+    {
+        av_dict_set(options, backend->speedOption, backend->speeds[level], 0);
+    }
+
+    // Realtime: no reordering delay and slice threads, so a frame leaves the encoder as soon as it's done.
+    // The others use frame threads and B-frames for compression.
+    c->max_b_frames = preset == EncoderPreset::Realtime ? 0 : preset == EncoderPreset::Balanced ? 2 : 3;
+    c->thread_type = preset == EncoderPreset::Realtime ? FF_THREAD_SLICE : FF_THREAD_FRAME;
+
+    if (name == "x264" || name == "x265")
+    {
+        // The hand-set quantiser range and motion search belong to the default tuning only.
+        c->qmin = -1;
+        c->qmax = -1;
+        c->me_range = -1;
+
+        if (preset == EncoderPreset::Realtime)
+        {
+            av_dict_set(options, "tune", "zerolatency", 0);
+        }
+    }
+    else if (name == "svt-av1")
+    {
+        c->max_b_frames = 0;
+        c->gop_size = preset == EncoderPreset::Archival ? c->gop_size * 4 : c->gop_size;
+    }
+    else if (name == "openh264")
+    {
+        // OpenH264 has no speed knob; realtime lets it skip frames under load, archival uses CABAC.
+        c->max_b_frames = 0;
+
+        if (preset == EncoderPreset::Realtime)
+        {
+            av_dict_set(options, "allow_skip_frames", "1", 0);
+        }
+        else if (preset == EncoderPreset::Archival)
+        {
+            av_dict_set(options, "coder", "cabac", 0);
+        }
+    }
+}
+
+void ApplyAudioPreset(const std::string& name, EncoderPreset preset, AVCodecContext* c, AVDictionary** options)
+{
+    const Backend* backend = Find(audioBackends, name);
+
+    if (!backend || preset == EncoderPreset::Default)
+    {
+        return;
+    }
+
+    int level = (int)preset - 1;
+
+    av_dict_set(options, backend->speedOption, backend->speeds[level], 0);
+
+    if (name == "aac")
+    {
+        static const int64_t bitrates[] = { 96000, 128000, 192000 };
+
+        c->bit_rate = bitrates[level];
+    }
+    else if (name == "opus")
+    {
+        static const int64_t bitrates[] = { 64000, 96000, 128000 };
+
+        c->bit_rate = bitrates[level];
+        av_dict_set(options, "application", preset == EncoderPreset::Realtime ? "lowdelay" : "audio", 0);
+        av_dict_set(options, "frame_duration", preset == EncoderPreset::Realtime ? "10" : "20", 0);
+    }
+}
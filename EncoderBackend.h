@@ -0,0 +1,39 @@
+#pragma once
+
+#include "ffmpeg.h"
+
+#include <string>
+#include <vector>
+
+// Named encoder backends and speed presets. Video: "x264" (default), "x265", "svt-av1", "openh264";
+// audio: "aac", "opus". A backend is only usable if the linked FFmpeg was built with its library.
+//
+// Presets trade speed for compression the same way on every backend: realtime favours low latency
+// and slice threads, balanced is the usual live-recording trade-off, archival spends CPU on size.
+// Default leaves the recorder's hand-tuned x264 settings untouched.
+enum class EncoderPreset
+{
+    Default,
+    Realtime,
+    Balanced,
+    Archival,
+};
+
+bool                        ParseEncoderPreset(const std::string& name, EncoderPreset* preset);
+const char*                 EncoderPresetName(EncoderPreset preset);
+
+const std::vector<std::string>& VideoBackends();
+const std::vector<std::string>& AudioBackends();
+
+// nullptr if the name is unknown or the library isn't in this FFmpeg build.
+AVCodec*                    FindVideoBackend(const std::string& backend);
+AVCodec*                    FindAudioBackend(const std::string& backend);
+
+// The recorder's rate control and GOP, tuned at 30 fps: bits per frame and a one second GOP are kept
+// at any frame rate. Set before ApplyVideoPreset, which adjusts them per backend.
+void                        ApplyVideoRateControl(AVCodecContext* c, int fps);
+
+// Codec-specific options and thread settings for a preset, on a context that already has its size,
+// time base and rate control set. Private options go into *options for avcodec_open2.
+void                        ApplyVideoPreset(const std::string& backend, EncoderPreset preset, AVCodecContext* c, AVDictionary** options);
+void                        ApplyAudioPreset(const std::string& backend, EncoderPreset preset, AVCodecContext* c, AVDictionary** options);
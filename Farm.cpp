@@ -0,0 +1,149 @@
+#include "Farm.h"
+#include "ScreenRecord.h"
+
+#include <fstream>
+
+namespace
+{
+    const int ReportSeconds = 5;
+
+    void Report(const std::vector<ScreenRecord*>& sessions, std::vector<int>& lastFrames, double seconds)
+    {
+        for (size_t i = 0; i < sessions.size(); ++i)
+        {
+            int frames = sessions[i]->FramesEncoded();
+
+            std::cout << "Session " << i << " (" << sessions[i]->FilePath() << "): " << (frames - lastFrames[i]) / seconds << " fps, lag "
+            << sessions[i]->SliceLag() / 1000.0 << " ms, " << sessions[i]->SlicesDropped() << " dropped." << std::endl;
+            lastFrames[i] = frames;
+        }
+    }
+
+    // Stops the first count sessions, armed or started, and waits for their slices to leave the pool,
+    // then deletes them all.
+    void StopSessions(std::vector<ScreenRecord*>& sessions, size_t count)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            sessions[i]->Stop();
+        }
+
+        for (size_t i = 0; i < sessions.size(); ++i)
+        {
+            while (i < count && !sessions[i]->hasFinished())
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+
+            delete sessions[i];
+        }
+
+        sessions.clear();
+    }
+}
+
+int RunFarm(const std::string& listPath, int workers)
+{
+    std::ifstream list(listPath);
+
+    if (!list)
+    {
+        std::cout << "Can't open the session list " << listPath << "." << std::endl;
+        return -1;
+    }
+
+    WorkPool pool(workers);
+    std::vector<ScreenRecord*> sessions;
+    std::string line;
+
+    while (std::getline(list, line))
+    {
+        std::istringstream fields(line);
+        std::string display, region, output, rate;
+        int width, height, x, y, fps = 30;
+
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        if (!(fields >> display >> region >> output) || sscanf(region.c_str(), "%dx%d+%d+%d", &width, &height, &x, &y) != 4)
+        {
+            std::cout << "Session line \"" << line << "\" must be <display> <width>x<height>+<x>+<y> <output.mp4> [fps], skipped." << std::endl;
+            continue;
+        }
+
+        if (fields >> rate && (sscanf(rate.c_str(), "%d", &fps) != 1 || fps < 1 || fps > 144))
+        {
+            std::cout << "Session line \"" << line << "\": frame rate must be between 1 and 144, skipped." << std::endl;
+            continue;
+        }
+
+        ScreenRecord* session = new ScreenRecord(output, display, "", false);
+
+        session->SetDimensions(width, x, height, y);
+        session->SetFrameRate(fps);
+        session->SetWorkPool(&pool, sessions.size());
+        sessions.push_back(session);
+    }
+
+    std::cout << sessions.size() << " sessions on " << pool.Workers() << " pool workers." << std::endl;
+
+    size_t armed = 0;
+
+    // Arming opens the devices, encoders and output on this thread, so a session that can't record
+    // throws here instead of in its mux thread. Only once every session is armed do they start.
+    try
+    {
+        for (; armed < sessions.size(); ++armed)
+        {
+            sessions[armed]->Arm();
+        }
+
+        for (ScreenRecord* session : sessions)
+        {
+            session->Start();
+        }
+    }
+    catch (std::exception& e)
+    {
+        // Armed sessions have capture threads that would submit to the pool, which goes away on return.
+        std::cout << "[ERROR]  " << e.what() << std::endl;
+        StopSessions(sessions, armed);
+        return -1;
+    }
+
+    std::mutex mutexReport;
+    std::condition_variable cvStop;
+    bool stopping = false;
+
+    std::thread reporter([&]
+    {
+        std::vector<int> lastFrames(sessions.size(), 0);
+        std::unique_lock<std::mutex> lk(mutexReport);
+
+        while (!cvStop.wait_for(lk, std::chrono::seconds(ReportSeconds), [&] { return stopping; }))
+        {
+            Report(sessions, lastFrames, ReportSeconds);
+        }
+    });
+
+    std::string command;
+
+    while (std::getline(std::cin, command) && command != "stop")
+    {
+        std::cout << "Type 'stop' to finish all sessions." << std::endl;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(mutexReport);
+        stopping = true;
+    }
+
+    cvStop.notify_one();
+    reporter.join();
+
+    StopSessions(sessions, sessions.size());
+    pool.PrintStats();
+    return 0;
+}
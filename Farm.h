@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+
+// Many concurrent recordings in one process, for fleets of Xvfb displays. The session list has one
+// line per recording, "<display> <width>x<height>+<x>+<y> <output.mp4> [fps]"; blank lines and lines
+// starting with '#' are skipped. Every session converts and encodes on one shared WorkPool of
+// `workers` threads (0: one per hardware thread). Runs until "stop" or end of input on stdin,
+// printing each session's frame rate, lag and drops every few seconds.
+int RunFarm(const std::string& listPath, int workers);
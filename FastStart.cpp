@@ -0,0 +1,217 @@
+#include "FastStart.h"
+
+#include <fcntl.h>
+#include <iostream>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    struct Atom
+    {
+        uint64_t    offset;
+        uint64_t    size;
+        uint32_t    header;
+        char        type[5];
+    };
+
+    uint32_t ReadBE32(const uint8_t* p)
+    {
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
+
+    uint64_t ReadBE64(const uint8_t* p)
+    {
+        return (uint64_t)ReadBE32(p) << 32 | ReadBE32(p + 4);
+    }
+
+    void WriteBE32(uint8_t* p, uint32_t v)
+    {
+        p[0] = v >> 24;
+        p[1] = v >> 16;
+        p[2] = v >> 8;
+        p[3] = v;
+    }
+
+    void WriteBE64(uint8_t* p, uint64_t v)
+    {
+        WriteBE32(p, v >> 32);
+        WriteBE32(p + 4, (uint32_t)v);
+    }
+
+    bool ParseAtom(const uint8_t* data, uint64_t offset, uint64_t end, Atom& atom)
+    {
+        if (end - offset < 8)
+        {
+            return false;
+        }
+
+        atom.offset = offset;
+        atom.size = ReadBE32(data + offset);
+        atom.header = 8;
+        memcpy(atom.type, data + offset + 4, 4);
+        atom.type[4] = 0;
+
+        if (atom.size == 1)
+        {
+            if (end - offset < 16)
+            {
+                return false;
+            }
+
+            atom.size = ReadBE64(data + offset + 8);
+            atom.header = 16;
+        }
+        else if (atom.size == 0)
+        {
+            atom.size = end - offset;
+        }
+
+        return atom.size >= atom.header && atom.size <= end - offset;
+    }
+
+    // Walks moov/trak/mdia/minf/stbl and adds delta to every chunk offset.
+    bool PatchChunkOffsets(uint8_t* data, uint64_t begin, uint64_t end, uint64_t delta)
+    {
+        static const char* containers[] = { "moov", "trak", "mdia", "minf", "stbl" };
+        Atom atom;
+
+        for (uint64_t offset = begin; offset < end; offset += atom.size)
+        {
+            if (!ParseAtom(data, offset, end, atom))
+            {
+                return false;
+            }
+
+            uint8_t* body = data + offset + atom.header;
+
+            if (!strcmp(atom.type, "stco") || !strcmp(atom.type, "co64"))
+            {
+                bool wide = atom.type[0] == 'c';
+                uint32_t count = ReadBE32(body + 4);
+
+                if (8 + (uint64_t)count * (wide ? 8 : 4) > atom.size - atom.header)
+                {
+                    return false;
+                }
+
+                for (uint32_t i = 0; i < count; ++i)
+                {
+                    uint8_t* entry = body + 8 + i * (wide ? 8 : 4);
+
+                    if (wide)
+                    {
+                        WriteBE64(entry, ReadBE64(entry) + delta);
+                    }
+                    else if (ReadBE32(entry) + delta > UINT32_MAX)
+                    {
+                        return false;
+                    }
+                    else
+                    {
+                        WriteBE32(entry, ReadBE32(entry) + (uint32_t)delta);
+                    }
+                }
+
+                continue;
+            }
+
+            for (const char* container : containers)
+            {
+                if (!strcmp(atom.type, container) && !PatchChunkOffsets(data, offset + atom.header, offset + atom.size, delta))
+                {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+}
+
+bool MoveIndexToFront(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDWR);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < 16)
+    {
+        std::cout << "Faststart: can't open " << path << "." << std::endl;
+
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        return false;
+    }
+
+    uint64_t fileSize = st.st_size;
+    uint8_t* data = (uint8_t*)mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        std::cout << "Faststart: can't map " << path << "." << std::endl;
+        return false;
+    }
+
+    // Top level: ftyp first, then (free) mdat, then moov last, as the mov muxer writes them.
+    Atom atom, ftyp = {}, moov = {};
+    bool haveMdat = false, haveMoov = false;
+
+    for (uint64_t offset = 0; offset < fileSize; offset += atom.size)
+    {
+        if (!ParseAtom(data, offset, fileSize, atom))
+        {
+            break;
+        }
+
+        if (!strcmp(atom.type, "ftyp"))
+        {
+            ftyp = atom;
+        }
+        else if (!strcmp(atom.type, "mdat"))
+        {
+            haveMdat = true;
+        }
+        else if (!strcmp(atom.type, "moov"))
+        {
+            moov = atom;
+            haveMoov = haveMdat;
+        }
+    }
+
+    bool moved = false;
+
+    if (!ftyp.size || !haveMoov || moov.offset + moov.size != fileSize)
+    {
+        std::cout << "Faststart: " << path << " doesn't end with its index, left as is." << std::endl;
+    }
+    else
+    {
+        std::vector<uint8_t> index(data + moov.offset, data + moov.offset + moov.size);
+        uint64_t mediaBegin = ftyp.offset + ftyp.size;
+
+        if (!PatchChunkOffsets(index.data(), 0, index.size(), moov.size))
+        {
+            std::cout << "Faststart: chunk offsets of " << path << " can't be patched, left as is." << std::endl;
+        }
+        else
+        {
+            memmove(data + mediaBegin + moov.size, data + mediaBegin, moov.offset - mediaBegin);
+            memcpy(data + mediaBegin, index.data(), index.size());
+            msync(data, fileSize, MS_SYNC);
+            moved = true;
+        }
+    }
+
+    munmap(data, fileSize);
+
+    return moved;
+}
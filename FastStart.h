@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+
+// Moves the moov atom of a finished MP4/MOV file in front of its media data, in place, so players
+// can start before the whole file is downloaded. The file is memory-mapped and the media data shifted
+// by the size of the index; stco/co64 chunk offsets are patched on the way. Unlike the mov muxer's
+// faststart option, nothing goes back through libavformat. Returns false (leaving the file as it
+// was) if the layout isn't ftyp..mdat..moov or a 32-bit chunk offset would overflow.
+bool MoveIndexToFront(const std::string& path);
@@ -0,0 +1,333 @@
+#include "FilterStage.h"
+
+FilterStage::FilterStage(const std::string& description, int width, int height, AVPixelFormat format, int fps, int queueDepth) :
+  description(description), width(width), height(height), format(format), fps(fps)
+, outputWidth(width), outputHeight(height)
+, graph(nullptr), source(nullptr), sink(nullptr), placement(nullptr)
+, running(false), flushRequested(false), reopenAfterFlush(false), ended(false), nextPts(0), queueStalls(0)
+{
+    for (int i = 0; i < queueDepth; ++i)
+    {
+        AVFrame* frame = av_frame_alloc();
+
+        frame->format = format;
+        frame->width = width;
+        frame->height = height;
+
+        if (av_frame_get_buffer(frame, 32) < 0)
+        {
+            av_frame_free(&frame);
+            throw std::runtime_error("Can't allocate the filter queue.");
+        }
+
+        slots.push_back(frame);
+        freeSlots.push_back(frame);
+    }
+}
+
+FilterStage::~FilterStage()
+{
+    Stop();
+
+    for (AVFrame* frame : slots)
+    {
+        av_frame_free(&frame);
+    }
+
+    avfilter_graph_free(&graph);
+}
+
+void FilterStage::Open()
+{
+    AVFilterInOut* inputs = avfilter_inout_alloc();
+    AVFilterInOut* outputs = avfilter_inout_alloc();
+    std::string args = "video_size=" + std::to_string(width) + "x" + std::to_string(height) + ":pix_fmt=" + std::to_string((int)format)
+        + ":time_base=1/1000000:frame_rate=" + std::to_string(fps) + "/1:pixel_aspect=1/1";
+
+    // The trailing format filter keeps the graph's output in the encoder's pixel format whatever the user chains.
+    std::string chain = description + ",format=" + (format == AV_PIX_FMT_YUV444P ? "yuv444p" : "yuv420p");
+
+    graph = avfilter_graph_alloc();
+
+    if (!graph || !inputs || !outputs
+        || avfilter_graph_create_filter(&source, avfilter_get_by_name("buffer"), "in", args.c_str(), nullptr, graph) < 0
+        || avfilter_graph_create_filter(&sink, avfilter_get_by_name("buffersink"), "out", nullptr, nullptr, graph) < 0)
+    {
+        avfilter_inout_free(&inputs);
+        avfilter_inout_free(&outputs);
+        throw std::runtime_error("Can't create the filter graph.");
+    }
+
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = source;
+    outputs->pad_idx = 0;
+    outputs->next = nullptr;
+
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = sink;
+    inputs->pad_idx = 0;
+    inputs->next = nullptr;
+
+    int ret = avfilter_graph_parse_ptr(graph, chain.c_str(), &inputs, &outputs, nullptr);
+
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+
+    if (ret < 0 || avfilter_graph_config(graph, nullptr) < 0)
+    {
+        throw std::runtime_error("Can't parse the filter graph \"" + description + "\".");
+    }
+
+    outputWidth = av_buffersink_get_w(sink);
+    outputHeight = av_buffersink_get_h(sink);
+}
+
+// The arena owns the memory; the reference only keeps av_frame_make_writable() working on the slots.
+static void KeepArenaMemory(void* opaque, uint8_t* data)
+{
+}
+
+size_t FilterStage::QueueBytes() const
+{
+    return slots.size() * FrameRing::Stride(av_image_get_buffer_size(format, width, height, FrameArena::Alignment));
+}
+
+void FilterStage::UseArena(FrameArena* arena)
+{
+    int size = av_image_get_buffer_size(format, width, height, FrameArena::Alignment);
+
+    for (AVFrame* frame : slots)
+    {
+        AVBufferRef* buffer = av_buffer_create(arena->Allocate(size), size, KeepArenaMemory, nullptr, 0);
+
+        if (!buffer)
+        {
+            throw std::runtime_error("Can't move the filter queue into the frame arena.");
+        }
+
+        av_frame_unref(frame);
+        frame->format = format;
+        frame->width = width;
+        frame->height = height;
+        frame->buf[0] = buffer;
+        av_image_fill_arrays(frame->data, frame->linesize, buffer->data, format, width, height, FrameArena::Alignment);
+    }
+}
+
+void FilterStage::Start(Sink sink, ThreadPlacement* placement)
+{
+    output = sink;
+    this->placement = placement;
+    running = true;
+    thread = std::thread(&FilterStage::ThreadProc, this);
+}
+
+void FilterStage::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lk(mutexQueue);
+
+        if (!running)
+        {
+            return;
+        }
+
+        running = false;
+    }
+
+    cvQueueNotEmpty.notify_all();
+    cvQueueNotFull.notify_all();
+    cvFlushed.notify_all();
+
+    if (thread.joinable())
+    {
+        thread.join();
+    }
+}
+
+void FilterStage::Flush(bool reopen)
+{
+    std::unique_lock<std::mutex> lk(mutexQueue);
+
+    if (!running)
+    {
+        return;
+    }
+
+    flushRequested = true;
+    reopenAfterFlush = reopen;
+    cvQueueNotEmpty.notify_one();
+    cvFlushed.wait(lk, [this] { return !flushRequested || !running; });
+}
+
+void FilterStage::Push(const AVFrame* frame)
+{
+    AVFrame* slot;
+
+    {
+        std::unique_lock<std::mutex> lk(mutexQueue);
+
+        if (freeSlots.empty())
+        {
+            queueStalls++;
+            cvQueueNotFull.wait(lk, [this] { return !freeSlots.empty() || !running; });
+        }
+
+        if (!running)
+        {
+            return;
+        }
+
+        slot = freeSlots.front();
+        freeSlots.pop_front();
+    }
+
+    // A filter may still hold a reference to this buffer from a previous frame.
+    av_frame_make_writable(slot);
+    av_frame_copy(slot, frame);
+    slot->pts = frame->pts;
+
+    {
+        std::lock_guard<std::mutex> lk(mutexQueue);
+        queuedSlots.push_back(slot);
+    }
+
+    cvQueueNotEmpty.notify_one();
+}
+
+void FilterStage::ThreadProc()
+{
+    AVFrame* filtered = av_frame_alloc();
+
+    if (placement)
+    {
+        placement->Enter("filter");
+    }
+
+    while (1)
+    {
+        AVFrame* frame;
+
+        {
+            std::unique_lock<std::mutex> lk(mutexQueue);
+            cvQueueNotEmpty.wait(lk, [this] { return !queuedSlots.empty() || flushRequested || !running; });
+
+            if (queuedSlots.empty() && flushRequested)
+            {
+                bool reopen = reopenAfterFlush;
+
+                lk.unlock();
+                Drain(filtered);
+
+                if (reopen)
+                {
+                    try
+                    {
+                        avfilter_graph_free(&graph);
+                        Open();
+                        ended = false;
+                        nextPts = 0;
+                    }
+                    catch (const std::exception& e)
+                    {
+                        std::cout << e.what() << std::endl;
+                    }
+                }
+
+                lk.lock();
+                flushRequested = false;
+                cvFlushed.notify_all();
+                continue;
+            }
+
+            if (queuedSlots.empty())
+            {
+                break;
+            }
+
+            frame = queuedSlots.front();
+            queuedSlots.pop_front();
+        }
+
+        auto begin = std::chrono::steady_clock::now();
+
+        // Untimed frames are stamped on the frame-rate grid.
+        if (frame->pts == AV_NOPTS_VALUE)
+        {
+            frame->pts = nextPts++ * 1000000 / fps;
+        }
+
+        if (av_buffersrc_add_frame_flags(source, frame, AV_BUFFERSRC_FLAG_KEEP_REF) < 0)
+        {
+            std::cout << "Can't feed the filter graph." << std::endl;
+        }
+
+        {
+            std::lock_guard<std::mutex> lk(mutexQueue);
+            freeSlots.push_back(frame);
+        }
+
+        cvQueueNotFull.notify_one();
+
+        while (av_buffersink_get_frame(sink, filtered) >= 0)
+        {
+            filterCost.Record(std::chrono::steady_clock::now() - begin);
+
+            // Back to microseconds if a filter (fps, for one) changed the time base.
+            if (filtered->pts != AV_NOPTS_VALUE)
+            {
+                filtered->pts = av_rescale_q(filtered->pts, av_buffersink_get_time_base(sink), AV_TIME_BASE_Q);
+            }
+
+            output(filtered);
+            av_frame_unref(filtered);
+            begin = std::chrono::steady_clock::now();
+        }
+    }
+
+    if (!ended)
+    {
+        Drain(filtered);
+    }
+
+    av_frame_free(&filtered);
+
+    if (placement)
+    {
+        placement->Leave("filter");
+    }
+}
+
+void FilterStage::Drain(AVFrame* filtered)
+{
+    auto begin = std::chrono::steady_clock::now();
+
+    ended = true;
+
+    if (av_buffersrc_add_frame(source, nullptr) < 0)
+    {
+        std::cout << "Can't signal the end of the stream to the filter graph." << std::endl;
+        return;
+    }
+
+    // Until the sink reports EOF: everything the graph held back comes out now.
+    while (av_buffersink_get_frame(sink, filtered) >= 0)
+    {
+        filterCost.Record(std::chrono::steady_clock::now() - begin);
+
+        if (filtered->pts != AV_NOPTS_VALUE)
+        {
+            filtered->pts = av_rescale_q(filtered->pts, av_buffersink_get_time_base(sink), AV_TIME_BASE_Q);
+        }
+
+        output(filtered);
+        av_frame_unref(filtered);
+        begin = std::chrono::steady_clock::now();
+    }
+}
+
+void FilterStage::PrintStats() const
+{
+    std::cout << "Filter \"" << description << "\": output " << outputWidth << "x" << outputHeight << ", capture blocked on a full filter queue " << queueStalls << " times." << std::endl;
+    filterCost.Print("Filter time per frame", "us");
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "ffmpeg.h"
+#include "FrameArena.h"
+#include "Stats.h"
+#include "ThreadPlacement.h"
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+// A user-supplied libavfilter graph between colour conversion and the video fifo. It runs on its
+// own thread behind a bounded frame queue, so filtering overlaps capture and encode instead of
+// adding to the capture thread's time per frame.
+class FilterStage
+{
+public:
+    typedef std::function<void(AVFrame*)> Sink;
+
+    FilterStage(const std::string& description, int width, int height, AVPixelFormat format, int fps, int queueDepth);
+    ~FilterStage();
+
+    // Builds the graph; the output keeps the input pixel format so the encoder setup doesn't change.
+    // Throws if the description can't be parsed or configured.
+    void            Open();
+    int             OutputWidth() const     { return outputWidth; }
+    int             OutputHeight() const    { return outputHeight; }
+
+    // Arena bytes for the queue's pictures, and moving them there (see FrameArena.h); before Start().
+    // The arena must outlive the stage.
+    size_t          QueueBytes() const;
+    void            UseArena(FrameArena* arena);
+
+    void            Start(Sink sink, ThreadPlacement* placement = nullptr);
+
+    // Sends EOF and passes on every frame the graph still holds (tpad, minterpolate, fps and deflicker
+    // keep some back), after the queued ones. Stop() does this too if nothing is pushed after a Flush().
+    void            Stop();
+
+    // Called by the producer, so it returns once everything it pushed has come out. With reopen the
+    // graph is rebuilt for the next session.
+    void            Flush(bool reopen);
+
+    // Copies the frame into a free queue slot, waiting while the queue is full. The frame's pts, in
+    // microseconds, goes through the graph with it and comes out on the filtered frames.
+    void            Push(const AVFrame* frame);
+    void            PrintStats() const;
+    const DurationStats& Cost() const       { return filterCost; }
+
+private:
+    void            ThreadProc();
+    void            Drain(AVFrame* filtered);
+
+    std::string                 description;
+    int                         width;
+    int                         height;
+    AVPixelFormat               format;
+    int                         fps;
+    int                         outputWidth;
+    int                         outputHeight;
+
+    AVFilterGraph*              graph;
+    AVFilterContext*            source;
+    AVFilterContext*            sink;
+    Sink                        output;
+    ThreadPlacement*            placement;
+
+    std::vector<AVFrame*>       slots;
+    std::deque<AVFrame*>        freeSlots;
+    std::deque<AVFrame*>        queuedSlots;
+    std::mutex                  mutexQueue;
+    std::condition_variable     cvQueueNotFull;
+    std::condition_variable     cvQueueNotEmpty;
+    bool                        running;
+    bool                        flushRequested;
+    bool                        reopenAfterFlush;
+    bool                        ended;              // EOF sent to the current graph
+    std::condition_variable     cvFlushed;
+    std::thread                 thread;
+
+    int64_t                     nextPts;
+    int64_t                     queueStalls;
+    DurationStats               filterCost;
+};
@@ -0,0 +1,97 @@
+#include "FrameArena.h"
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+FrameArena::FrameArena(size_t size) :
+  base(nullptr), capacity((size + HugePageSize - 1) / HugePageSize * HugePageSize), used(0)
+, backing(Backing::HugeTlb), prefaultMs(0), prefaultFaults(0)
+{
+    void* p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    // No reserved hugetlbfs pages: fall back to a regular mapping and ask for transparent huge pages.
+    if (p == MAP_FAILED)
+    {
+        p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (p == MAP_FAILED)
+        {
+            throw std::runtime_error("Can't map the frame arena.");
+        }
+
+        backing = madvise(p, capacity, MADV_HUGEPAGE) == 0 ? Backing::Transparent : Backing::Regular;
+    }
+
+    base = (uint8_t*)p;
+}
+
+FrameArena::~FrameArena()
+{
+    if (base)
+    {
+        munmap(base, capacity);
+    }
+}
+
+uint8_t* FrameArena::Allocate(size_t size)
+{
+    size_t offset = (used + Alignment - 1) & ~(Alignment - 1);
+
+    if (offset + size > capacity)
+    {
+        throw std::runtime_error("Frame arena exhausted.");
+    }
+
+    used = offset + size;
+
+    return base + offset;
+}
+
+void FrameArena::Prefault()
+{
+    rusage before, after;
+    auto begin = std::chrono::steady_clock::now();
+
+    getrusage(RUSAGE_THREAD, &before);
+
+    // One write per 4 KB page faults everything in, whichever page size ended up backing the mapping.
+    for (size_t offset = 0; offset < capacity; offset += 4096)
+    {
+        base[offset] = 0;
+    }
+
+    getrusage(RUSAGE_THREAD, &after);
+
+    prefaultMs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count() / 1000.0;
+    prefaultFaults = after.ru_minflt - before.ru_minflt + after.ru_majflt - before.ru_majflt;
+}
+
+void FrameArena::PrintStats() const
+{
+    const char* names[] = { "2 MB huge pages", "transparent huge pages", "4 KB pages" };
+
+    std::cout << "Frame arena: " << capacity / (1 << 20) << " MB (" << used / (1 << 20) << " MB used) on " << names[(int)backing]
+    << ", prefaulted in " << prefaultMs << " ms with " << prefaultFaults << " page faults." << std::endl;
+}
+
+FrameRing::FrameRing(uint8_t* buffer, int records, size_t recordSize) :
+  buffer(buffer), owned(!buffer), records(records), stride(Stride(recordSize)), readPos(0), writePos(0)
+{
+    if (owned)
+    {
+        this->buffer = (uint8_t*)av_malloc(records * stride);
+
+        if (!this->buffer)
+        {
+            throw std::runtime_error("Can't allocate the video queue.");
+        }
+    }
+}
+
+FrameRing::~FrameRing()
+{
+    if (owned)
+    {
+        av_free(buffer);
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "ffmpeg.h"
+
+// One contiguous mapping for the large pixel buffers (capture conversion output, video fifo, mux
+// frame). It is backed by explicit 2 MB huge pages when the kernel has some reserved, otherwise by
+// transparent huge pages (madvise), and prefaulted before recording so first touches don't fault.
+// Allocation is a bump pointer; buffers live as long as the arena.
+class FrameArena
+{
+public:
+    static const size_t Alignment = 64;
+    static const size_t HugePageSize = 2 << 20;
+
+    enum class Backing { HugeTlb, Transparent, Regular };
+
+    FrameArena(size_t capacity);
+    ~FrameArena();
+
+    // 64-byte aligned; throws when the arena is exhausted.
+    uint8_t*        Allocate(size_t size);
+    void            Prefault();
+    void            PrintStats() const;
+
+private:
+    uint8_t*        base;
+    size_t          capacity;
+    size_t          used;
+    Backing         backing;
+    double          prefaultMs;
+    long            prefaultFaults;
+};
+
+// The video queue: a ring of fixed-size records, each starting 64-byte aligned, over one buffer taken
+// from the arena, or from av_malloc when buffer is null. One producer and one consumer; the counters
+// are atomic, and the caller's lock and condition variables do the waiting.
+class FrameRing
+{
+public:
+    FrameRing(uint8_t* buffer, int records, size_t recordSize);
+    ~FrameRing();
+
+    // Bytes one record takes in the buffer.
+    static size_t   Stride(size_t recordSize)   { return (recordSize + FrameArena::Alignment - 1) & ~(FrameArena::Alignment - 1); }
+
+    int             Count() const               { return (int)(writePos - readPos); }
+    int             Free() const                { return records - Count(); }
+
+    // The next record to fill while Free() > 0, published by Commit().
+    uint8_t*        WriteSlot()                 { return buffer + (writePos % records) * stride; }
+    void            Commit()                    { writePos++; }
+
+    // The oldest record while Count() > 0, handed back by Consume().
+    const uint8_t*  ReadSlot() const            { return buffer + (readPos % records) * stride; }
+    void            Consume()                   { readPos++; }
+
+    void            Reset()                     { readPos = writePos.load(); }
+
+private:
+    uint8_t*                buffer;
+    bool                    owned;
+    int                     records;
+    size_t                  stride;
+    std::atomic<int64_t>    readPos;
+    std::atomic<int64_t>    writePos;
+};
@@ -0,0 +1,230 @@
+#include "FrameIngest.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct sr_ingest
+{
+    sr_ingest_header*   header;
+    size_t              size;
+    int                 fd;
+    char                path[64];
+    char                name[64];
+};
+
+static size_t SlotSize(int stride, int height)
+{
+    return (SR_INGEST_SLOT_HEADER + (size_t)stride * height + 63) & ~(size_t)63;
+}
+
+static uint8_t* SlotAt(sr_ingest_header* header, uint64_t sequence)
+{
+    return (uint8_t*)header + header->data_offset + (sequence % header->slots) * header->slot_size;
+}
+
+sr_ingest* sr_ingest_create(const char* name, int width, int height, int slots)
+{
+    int stride = width * 4;
+    size_t dataOffset = 4096;
+    size_t size = dataOffset + slots * SlotSize(stride, height);
+    int fd = name ? shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0600) : (int)syscall(SYS_memfd_create, "sr-ingest", 0);
+
+    if (fd < 0 || width <= 0 || height <= 0 || slots <= 0)
+    {
+        return nullptr;
+    }
+
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    sr_ingest* ingest = new sr_ingest();
+    sr_ingest_header* header = (sr_ingest_header*)map;
+
+    header->version = SR_INGEST_VERSION;
+    header->slots = slots;
+    header->width = width;
+    header->height = height;
+    header->stride = stride;
+    header->format = SR_INGEST_FORMAT_BGR0;
+    header->slot_size = SlotSize(stride, height);
+    header->data_offset = dataOffset;
+
+    // The magic goes last, so a recorder never accepts a half-initialised header.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, SR_INGEST_MAGIC, 8);
+
+    ingest->header = header;
+    ingest->size = size;
+    ingest->fd = fd;
+    ingest->name[0] = 0;
+
+    if (name)
+    {
+        snprintf(ingest->name, sizeof(ingest->name), "%s", name);
+        snprintf(ingest->path, sizeof(ingest->path), "/dev/shm%s", name);
+    }
+    else
+    {
+        snprintf(ingest->path, sizeof(ingest->path), "/proc/%d/fd/%d", (int)getpid(), fd);
+    }
+
+    return ingest;
+}
+
+const char* sr_ingest_path(const sr_ingest* ingest)
+{
+    return ingest->path;
+}
+
+int sr_ingest_fd(const sr_ingest* ingest)
+{
+    return ingest->fd;
+}
+
+uint8_t* sr_ingest_acquire(sr_ingest* ingest, int* stride)
+{
+    sr_ingest_header* header = ingest->header;
+    uint64_t written = __atomic_load_n(&header->write_seq, __ATOMIC_RELAXED);
+
+    if (written - __atomic_load_n(&header->read_seq, __ATOMIC_ACQUIRE) >= header->slots)
+    {
+        __atomic_fetch_add(&header->dropped, 1, __ATOMIC_RELAXED);
+        return nullptr;
+    }
+
+    *stride = header->stride;
+    return SlotAt(header, written) + SR_INGEST_SLOT_HEADER;
+}
+
+void sr_ingest_commit(sr_ingest* ingest, int64_t timestamp_us)
+{
+    sr_ingest_header* header = ingest->header;
+    uint64_t written = __atomic_load_n(&header->write_seq, __ATOMIC_RELAXED);
+    sr_ingest_slot* slot = (sr_ingest_slot*)SlotAt(header, written);
+
+    slot->sequence = written;
+    slot->timestamp_us = timestamp_us;
+
+    __atomic_store_n(&header->write_seq, written + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&header->futex, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &header->futex, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+}
+
+void sr_ingest_destroy(sr_ingest* ingest)
+{
+    if (!ingest)
+    {
+        return;
+    }
+
+    munmap(ingest->header, ingest->size);
+    close(ingest->fd);
+
+    if (ingest->name[0])
+    {
+        shm_unlink(ingest->name);
+    }
+
+    delete ingest;
+}
+
+IngestReader::IngestReader(const std::string& path) : header(nullptr), size(0), base(nullptr)
+{
+    int fd = open(path.c_str(), O_RDWR);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(sr_ingest_header))
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        throw std::runtime_error("Can't open the ingest ring " + path + ".");
+    }
+
+    // Writable only for read_seq; the recorder never touches the pixels.
+    void* map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        throw std::runtime_error("Can't map the ingest ring " + path + ".");
+    }
+
+    header = (sr_ingest_header*)map;
+    size = st.st_size;
+    base = (uint8_t*)map;
+
+    if (memcmp(header->magic, SR_INGEST_MAGIC, 8) != 0 || header->version != SR_INGEST_VERSION || header->format != SR_INGEST_FORMAT_BGR0
+        || header->data_offset + header->slots * header->slot_size > size)
+    {
+        munmap(map, size);
+        throw std::runtime_error(path + " isn't a BGR0 ingest ring of this version.");
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+IngestReader::~IngestReader()
+{
+    munmap(header, size);
+}
+
+bool IngestReader::Next(AVFrame* frame, int64_t* timestamp, int timeoutMs)
+{
+    uint64_t next = __atomic_load_n(&header->read_seq, __ATOMIC_RELAXED);
+    uint32_t word = __atomic_load_n(&header->futex, __ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&header->write_seq, __ATOMIC_ACQUIRE) <= next)
+    {
+        struct timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+
+        // Returns at once if a commit bumped the word since it was read above.
+        syscall(SYS_futex, &header->futex, FUTEX_WAIT, word, &timeout, nullptr, 0);
+
+        if (__atomic_load_n(&header->write_seq, __ATOMIC_ACQUIRE) <= next)
+        {
+            return false;
+        }
+    }
+
+    uint8_t* slotBase = base + header->data_offset + (next % header->slots) * header->slot_size;
+    const sr_ingest_slot* slot = (const sr_ingest_slot*)slotBase;
+
+    frame->data[0] = slotBase + SR_INGEST_SLOT_HEADER;
+    frame->linesize[0] = header->stride;
+    frame->width = header->width;
+    frame->height = header->height;
+    frame->format = AV_PIX_FMT_BGR0;
+    *timestamp = slot->sequence == next ? slot->timestamp_us : AV_NOPTS_VALUE;
+
+    return true;
+}
+
+void IngestReader::Release()
+{
+    __atomic_fetch_add(&header->read_seq, 1, __ATOMIC_RELEASE);
+}
+
+uint64_t IngestReader::Backlog() const
+{
+    return __atomic_load_n(&header->write_seq, __ATOMIC_ACQUIRE) - __atomic_load_n(&header->read_seq, __ATOMIC_RELAXED);
+}
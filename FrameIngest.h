@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdint.h>
+
+// Frame ingest for producers that already hold rendered frames (compositor plugins, headless
+// browsers): a ring of BGR0 frame slots in a shared-memory file, in place of x11grab. The recorder
+// maps it read-write because it advances read_seq in the header, but never writes to the slots.
+// Producers render straight into a slot and commit it with their own timestamp; the recorder
+// converts from the slot without copying and only then hands it back.
+//
+// Layout: sr_ingest_header at offset 0, slot i at data_offset + i * slot_size, each slot an
+// sr_ingest_slot followed by the pixels at SR_INGEST_SLOT_HEADER bytes. write_seq and read_seq only
+// grow; slot (seq % slots) belongs to the producer while write_seq - read_seq < slots and to the
+// recorder from its commit until read_seq passes it. Both are accessed with acquire/release atomics,
+// and every commit bumps `futex` and wakes a recorder waiting on it.
+
+#define SR_INGEST_MAGIC         "SRINGST1"
+#define SR_INGEST_VERSION       1
+#define SR_INGEST_SLOT_HEADER   64
+#define SR_INGEST_FORMAT_BGR0   0
+
+typedef struct sr_ingest_header
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    slots;
+    int32_t     width;
+    int32_t     height;
+    int32_t     stride;             // bytes per pixel row
+    int32_t     format;             // SR_INGEST_FORMAT_*
+    uint64_t    slot_size;
+    uint64_t    data_offset;
+    uint64_t    write_seq;          // frames committed by the producer
+    uint64_t    read_seq;           // frames released by the recorder
+    uint64_t    dropped;            // acquires refused because every slot was in use
+    uint32_t    futex;
+    uint32_t    reserved;
+} sr_ingest_header;
+
+typedef struct sr_ingest_slot
+{
+    uint64_t    sequence;           // write_seq value the slot was committed as
+    int64_t     timestamp_us;       // producer clock, drives the output pts
+} sr_ingest_slot;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sr_ingest sr_ingest;
+
+// Creates a ring of `slots` frames. name "/something" uses shm_open (visible as /dev/shm/something);
+// NULL uses an anonymous memfd. Returns NULL on failure.
+sr_ingest*  sr_ingest_create(const char* name, int width, int height, int slots);
+
+// What to pass to the recorder's --ingest= option: "/dev/shm/<name>" or "/proc/<pid>/fd/<fd>".
+const char* sr_ingest_path(const sr_ingest* ingest);
+int         sr_ingest_fd(const sr_ingest* ingest);
+
+// The next free slot to render into, or NULL when the recorder still holds every slot (the frame
+// should be skipped; it is counted in `dropped`). *stride receives the row pitch in bytes.
+uint8_t*    sr_ingest_acquire(sr_ingest* ingest, int* stride);
+
+// Publishes the slot returned by the last acquire.
+void        sr_ingest_commit(sr_ingest* ingest, int64_t timestamp_us);
+
+void        sr_ingest_destroy(sr_ingest* ingest);
+
+#ifdef __cplusplus
+}
+
+#include "ffmpeg.h"
+
+#include <string>
+
+// Recorder side of the ring. Throws if the file can't be mapped or isn't an ingest ring.
+class IngestReader
+{
+public:
+    explicit IngestReader(const std::string& path);
+    ~IngestReader();
+
+    int             Width() const       { return header->width; }
+    int             Height() const      { return header->height; }
+    uint64_t        Dropped() const     { return __atomic_load_n(&header->dropped, __ATOMIC_RELAXED); }
+
+    // Waits up to timeoutMs for the next committed frame and points frame at the slot's pixels
+    // (BGR0, no copy). The slot stays with the recorder until Release().
+    bool            Next(AVFrame* frame, int64_t* timestamp, int timeoutMs);
+    void            Release();
+
+    // Frames committed but not yet released.
+    uint64_t        Backlog() const;
+
+private:
+    sr_ingest_header*   header;
+    size_t              size;
+    uint8_t*            base;
+};
+#endif
@@ -0,0 +1,220 @@
+#include "MemoryBudget.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+static const double Megabyte = 1024.0 * 1024.0;
+
+// Reads a "VmRSS:    1234 kB" style line.
+static size_t StatusKilobytes(const char* field)
+{
+    FILE* status = fopen("/proc/self/status", "r");
+    char line[256];
+    size_t kilobytes = 0;
+
+    if (!status)
+    {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), status))
+    {
+        if (strncmp(line, field, strlen(field)) == 0)
+        {
+            sscanf(line + strlen(field), "%zu", &kilobytes);
+            break;
+        }
+    }
+
+    fclose(status);
+    return kilobytes * 1024;
+}
+
+MemoryBudget::MemoryBudget() : budget(0)
+{
+    for (int i = 0; i < (int)MemoryStage::Count; ++i)
+    {
+        reserved[i] = 0;
+        held[i] = 0;
+        peak[i] = 0;
+    }
+}
+
+void MemoryBudget::Reserve(MemoryStage stage, size_t bytes)
+{
+    reserved[(int)stage] = bytes;
+}
+
+void MemoryBudget::Add(MemoryStage stage, int64_t bytes)
+{
+    int64_t now = held[(int)stage].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    int64_t highest = peak[(int)stage].load(std::memory_order_relaxed);
+
+    while (now > highest && !peak[(int)stage].compare_exchange_weak(highest, now, std::memory_order_relaxed))
+    {
+    }
+}
+
+void MemoryBudget::Set(MemoryStage stage, int64_t bytes)
+{
+    Add(stage, bytes - held[(int)stage].load(std::memory_order_relaxed));
+}
+
+int64_t MemoryBudget::Held(MemoryStage stage) const
+{
+    return held[(int)stage].load(std::memory_order_relaxed);
+}
+
+size_t MemoryBudget::Footprint(MemoryStage stage) const
+{
+    int64_t live = Held(stage);
+
+    return live > 0 && (size_t)live > reserved[(int)stage] ? (size_t)live : reserved[(int)stage].load();
+}
+
+size_t MemoryBudget::Total() const
+{
+    size_t total = 0;
+
+    for (int i = 0; i < (int)MemoryStage::Count; ++i)
+    {
+        total += Footprint((MemoryStage)i);
+    }
+
+    return total;
+}
+
+size_t MemoryBudget::Available() const
+{
+    size_t total = 0;
+
+    if (!budget)
+    {
+        return SIZE_MAX;
+    }
+
+    for (int i = 0; i < (int)MemoryStage::Count; ++i)
+    {
+        total += reserved[i];
+    }
+
+    return total < budget ? budget - total : 0;
+}
+
+size_t MemoryBudget::ResidentBytes()
+{
+    return StatusKilobytes("VmRSS:");
+}
+
+size_t MemoryBudget::PeakResidentBytes()
+{
+    return StatusKilobytes("VmHWM:");
+}
+
+const char* MemoryBudget::StageName(MemoryStage stage)
+{
+    static const char* names[] = { "capture", "filter", "video queue", "encoder (estimated)", "audio queue", "muxer", "egress" };
+
+    return names[(int)stage];
+}
+
+void MemoryBudget::Print() const
+{
+    std::cout << "Pipeline memory";
+
+    if (budget)
+    {
+        std::cout << " (budget " << budget / Megabyte << " MB)";
+    }
+
+    std::cout << ":";
+
+    for (int i = 0; i < (int)MemoryStage::Count; ++i)
+    {
+        if (!reserved[i] && !peak[i])
+        {
+            continue;
+        }
+
+        std::cout << " " << StageName((MemoryStage)i) << " " << reserved[i] / Megabyte << " MB reserved, " << peak[i] / Megabyte << " MB peak;";
+    }
+
+    std::cout << " resident " << ResidentBytes() / Megabyte << " MB, peak " << PeakResidentBytes() / Megabyte << " MB." << std::endl;
+}
+
+InterleaveMeter::InterleaveMeter() : maxDelta(0), bytes(0)
+{
+}
+
+void InterleaveMeter::Reset(int streams, int64_t maxDeltaUs)
+{
+    rings.assign(streams, std::vector<Entry>(Capacity));
+    heads.assign(streams, 0);
+    counts.assign(streams, 0);
+    maxDelta = maxDeltaUs;
+    bytes = 0;
+}
+
+bool InterleaveMeter::Add(int stream, int64_t dtsUs, int size)
+{
+    if (stream < 0 || stream >= (int)rings.size() || counts[stream] == Capacity)
+    {
+        return false;
+    }
+
+    rings[stream][(heads[stream] + counts[stream]) % Capacity] = Entry{ dtsUs, size };
+    counts[stream]++;
+    bytes += size;
+
+    // Release the earliest packet while every stream has one queued or the queue spans too long.
+    for (;;)
+    {
+        int earliest = -1;
+        int64_t latest = INT64_MIN;
+        bool all = true;
+
+        for (size_t s = 0; s < rings.size(); ++s)
+        {
+            if (!counts[s])
+            {
+                all = false;
+                continue;
+            }
+
+            const Entry& front = rings[s][heads[s]];
+            const Entry& back = rings[s][(heads[s] + counts[s] - 1) % Capacity];
+
+            if (earliest < 0 || front.dts < rings[earliest][heads[earliest]].dts)
+            {
+                earliest = s;
+            }
+
+            latest = std::max(latest, back.dts);
+        }
+
+        if (earliest < 0 || !(all || (maxDelta > 0 && latest - rings[earliest][heads[earliest]].dts > maxDelta)))
+        {
+            break;
+        }
+
+        bytes -= rings[earliest][heads[earliest]].size;
+        heads[earliest] = (heads[earliest] + 1) % Capacity;
+        counts[earliest]--;
+    }
+
+    return true;
+}
+
+void InterleaveMeter::Clear()
+{
+    for (size_t s = 0; s < rings.size(); ++s)
+    {
+        heads[s] = 0;
+        counts[s] = 0;
+    }
+
+    bytes = 0;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Stages of the recording pipeline that hold frame, sample or packet data.
+enum class MemoryStage
+{
+    Capture,            // grab and conversion buffers
+    Filter,             // filter graph queue
+    VideoQueue,         // converted frames waiting for the encoder
+    Encoder,            // frames the encoder keeps for look-ahead, B-frames and threads (estimated)
+    AudioQueue,         // samples waiting for the encoder, mixer rings included
+    Muxer,              // packets held by the muxer's interleaving queue
+    Egress,             // shared-memory packet ring
+    Count,
+};
+
+// Bytes held per stage, against an optional budget. Preallocated buffers are reserved in full up front;
+// live contents are tracked as they change, with a peak per stage. A stage's footprint is the larger of
+// the two, and the buffers are sized so the footprints add up to no more than the budget. Updates are
+// lock-free, so the capture and mux threads account as they go and Status() can read them any time.
+class MemoryBudget
+{
+public:
+    MemoryBudget();
+
+    // 0: no budget, only accounting.
+    void            SetBudget(size_t bytes)     { budget = bytes; }
+    size_t          Budget() const              { return budget; }
+
+    // Sets the stage's preallocated bytes; called again when a stage is rebuilt.
+    void            Reserve(MemoryStage stage, size_t bytes);
+    void            Add(MemoryStage stage, int64_t bytes);
+    void            Set(MemoryStage stage, int64_t bytes);
+
+    int64_t         Held(MemoryStage stage) const;
+    size_t          Footprint(MemoryStage stage) const;
+    size_t          Total() const;
+
+    // Budget left after the reservations made so far; SIZE_MAX without a budget.
+    size_t          Available() const;
+
+    // From /proc/self/status, 0 if it can't be read.
+    static size_t   ResidentBytes();
+    static size_t   PeakResidentBytes();
+
+    static const char* StageName(MemoryStage stage);
+
+    void            Print() const;
+
+private:
+    size_t                      budget;
+    std::atomic<size_t>         reserved[(int)MemoryStage::Count];
+    std::atomic<int64_t>        held[(int)MemoryStage::Count];
+    std::atomic<int64_t>        peak[(int)MemoryStage::Count];
+};
+
+// Mirrors the muxer's interleaving by decode time, so the bytes it holds can be accounted without
+// reaching into it: a packet stays queued until every stream has one queued, or until the queue spans
+// more than the muxer's max_interleave_delta. Capacity is fixed, so accounting never allocates.
+class InterleaveMeter
+{
+public:
+    InterleaveMeter();
+
+    // maxDeltaUs as in AVFormatContext::max_interleave_delta, 0 for no limit.
+    void            Reset(int streams, int64_t maxDeltaUs);
+
+    // False if a stream's ring is full; the caller should flush the muxer and Clear().
+    bool            Add(int stream, int64_t dtsUs, int size);
+    void            Clear();
+
+    int64_t         Bytes() const               { return bytes; }
+
+private:
+    static const size_t Capacity = 4096;
+
+    struct Entry
+    {
+        int64_t     dts;
+        int         size;
+    };
+
+    std::vector<std::vector<Entry>>     rings;
+    std::vector<size_t>                 heads;
+    std::vector<size_t>                 counts;
+    int64_t                             maxDelta;
+    int64_t                             bytes;
+};
@@ -0,0 +1,435 @@
+#include "PacketEgress.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct sr_egress
+{
+    const sr_egress_header* header;
+    size_t                  size;
+    const uint8_t*          data;
+    uint64_t                position;
+    bool                    awaitingKeyframe;
+    uint64_t                lapped;
+};
+
+static uint64_t RecordSpan(uint32_t payload)
+{
+    return (sizeof(sr_egress_record) + (uint64_t)payload + SR_EGRESS_ALIGN - 1) & ~(uint64_t)(SR_EGRESS_ALIGN - 1);
+}
+
+// True while the record copied from position is still the one the writer put there, and the writer
+// hasn't started overwriting it since.
+static bool Intact(const sr_egress* egress, const sr_egress_record& record)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t reserved = __atomic_load_n(&egress->header->reserve_pos, __ATOMIC_RELAXED);
+
+    return record.position == egress->position && reserved - egress->position <= egress->header->capacity;
+}
+
+// Read under the streams_seq seqlock, like sr_egress_streams.
+static int32_t StreamType(const sr_egress_header* header, int index)
+{
+    for (;;)
+    {
+        uint32_t before = __atomic_load_n(&header->streams_seq, __ATOMIC_ACQUIRE);
+
+        if (before & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        int32_t type = header->streams[index % SR_EGRESS_MAX_STREAMS].codec_type;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&header->streams_seq, __ATOMIC_RELAXED) == before)
+        {
+            return type;
+        }
+    }
+}
+
+// Back to the latest keyframe if the ring still holds it, otherwise the next one to be written.
+static void Rejoin(sr_egress* egress)
+{
+    const sr_egress_header* header = egress->header;
+    uint64_t keyframe = __atomic_load_n(&header->keyframe_pos, __ATOMIC_ACQUIRE);
+    uint64_t reserved = __atomic_load_n(&header->reserve_pos, __ATOMIC_ACQUIRE);
+
+    if (keyframe != SR_EGRESS_NO_KEYFRAME && reserved - keyframe <= header->capacity)
+    {
+        egress->position = keyframe;
+        egress->awaitingKeyframe = false;
+    }
+    else
+    {
+        egress->position = __atomic_load_n(&header->write_pos, __ATOMIC_ACQUIRE);
+        egress->awaitingKeyframe = true;
+    }
+}
+
+sr_egress* sr_egress_open(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(sr_egress_header))
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    const sr_egress_header* header = (const sr_egress_header*)map;
+
+    if (memcmp(header->magic, SR_EGRESS_MAGIC, 8) != 0 || header->version != SR_EGRESS_VERSION || header->data_offset + header->capacity > (uint64_t)st.st_size)
+    {
+        munmap(map, st.st_size);
+        return nullptr;
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    sr_egress* egress = new sr_egress();
+    egress->header = header;
+    egress->size = st.st_size;
+    egress->data = (const uint8_t*)map + header->data_offset;
+    egress->lapped = 0;
+    Rejoin(egress);
+
+    return egress;
+}
+
+int sr_egress_streams(sr_egress* egress, sr_egress_stream* streams, int max)
+{
+    const sr_egress_header* header = egress->header;
+
+    for (;;)
+    {
+        uint32_t before = __atomic_load_n(&header->streams_seq, __ATOMIC_ACQUIRE);
+
+        if (before & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        int count = (int)header->stream_count;
+
+        if (count > SR_EGRESS_MAX_STREAMS)
+        {
+            count = SR_EGRESS_MAX_STREAMS;
+        }
+
+        if (count > max)
+        {
+            count = max;
+        }
+
+        memcpy(streams, header->streams, count * sizeof(sr_egress_stream));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&header->streams_seq, __ATOMIC_RELAXED) == before)
+        {
+            return count;
+        }
+    }
+}
+
+int sr_egress_next(sr_egress* egress, sr_egress_packet* packet, uint8_t* buffer, size_t capacity, int timeout_ms)
+{
+    const sr_egress_header* header = egress->header;
+    bool waited = false;
+
+    for (;;)
+    {
+        uint32_t word = __atomic_load_n(&header->futex, __ATOMIC_ACQUIRE);
+        uint64_t written = __atomic_load_n(&header->write_pos, __ATOMIC_ACQUIRE);
+
+        if (egress->position == written)
+        {
+            if (waited)
+            {
+                return 0;
+            }
+
+            struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+
+            // Returns at once if a publish bumped the word since it was read above.
+            syscall(SYS_futex, &header->futex, FUTEX_WAIT, word, &timeout, nullptr, 0);
+            waited = true;
+            continue;
+        }
+
+        if (egress->position > written || written - egress->position > header->capacity)
+        {
+            egress->lapped++;
+            Rejoin(egress);
+            continue;
+        }
+
+        uint64_t offset = egress->position % header->capacity;
+        const uint8_t* at = egress->data + offset;
+        sr_egress_record record;
+        memcpy(&record, at, sizeof(record));
+
+        // The header is trusted only once it is known not to be half overwritten; a record never wraps,
+        // so even then the payload can't reach past the end of the ring.
+        if (!Intact(egress, record) || (record.stream_index >= 0 && record.size > header->capacity - offset - sizeof(record)))
+        {
+            egress->lapped++;
+            Rejoin(egress);
+            continue;
+        }
+
+        bool fits = record.stream_index < 0 || record.size <= capacity;
+
+        if (fits && record.stream_index >= 0)
+        {
+            memcpy(buffer, at + sizeof(record), record.size);
+
+            // The writer may have lapped the reader while the payload was copied.
+            if (!Intact(egress, record))
+            {
+                egress->lapped++;
+                Rejoin(egress);
+                continue;
+            }
+        }
+
+        if (record.stream_index < 0)
+        {
+            egress->position += header->capacity - egress->position % header->capacity;
+            continue;
+        }
+
+        packet->stream_index = record.stream_index;
+        packet->flags = record.flags;
+        packet->size = record.size;
+        packet->pts = record.pts;
+        packet->dts = record.dts;
+        packet->duration = record.duration;
+
+        if (!fits)
+        {
+            return -1;
+        }
+
+        egress->position += RecordSpan(record.size);
+
+        if (egress->awaitingKeyframe)
+        {
+            if (!(record.flags & SR_EGRESS_FLAG_KEY) || StreamType(header, record.stream_index) != AVMEDIA_TYPE_VIDEO)
+            {
+                continue;
+            }
+
+            egress->awaitingKeyframe = false;
+        }
+
+        return 1;
+    }
+}
+
+uint64_t sr_egress_lapped(const sr_egress* egress)
+{
+    return egress->lapped;
+}
+
+void sr_egress_close(sr_egress* egress)
+{
+    if (!egress)
+    {
+        return;
+    }
+
+    munmap((void*)egress->header, egress->size);
+    delete egress;
+}
+
+PacketEgress::PacketEgress(const std::string& name, size_t capacityBytes)
+: header(nullptr), size(0), data(nullptr), name(name), videoIndex(-1), oversized(0)
+{
+    size_t capacity = (capacityBytes + SR_EGRESS_ALIGN - 1) & ~(size_t)(SR_EGRESS_ALIGN - 1);
+    size_t dataOffset = (sizeof(sr_egress_header) + 4095) & ~(size_t)4095;
+
+    // A fresh segment: readers still mapping a previous recording's ring see it go quiet instead of
+    // seeing positions restart at 0.
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+
+    if (fd < 0 || ftruncate(fd, dataOffset + capacity) != 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            shm_unlink(name.c_str());
+        }
+
+        throw std::runtime_error("Can't create the packet egress ring " + name + ".");
+    }
+
+    void* map = mmap(nullptr, dataOffset + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        shm_unlink(name.c_str());
+        throw std::runtime_error("Can't map the packet egress ring " + name + ".");
+    }
+
+    header = (sr_egress_header*)map;
+    size = dataOffset + capacity;
+    data = (uint8_t*)map + dataOffset;
+
+    header->version = SR_EGRESS_VERSION;
+    header->capacity = capacity;
+    header->data_offset = dataOffset;
+    header->keyframe_pos = SR_EGRESS_NO_KEYFRAME;
+
+    // The magic goes last, so a reader never accepts a half-initialised header.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, SR_EGRESS_MAGIC, 8);
+}
+
+PacketEgress::~PacketEgress()
+{
+    munmap(header, size);
+    shm_unlink(name.c_str());
+}
+
+void PacketEgress::SetStreams(const AVFormatContext* format)
+{
+    __atomic_store_n(&header->streams_seq, header->streams_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    unsigned count = format->nb_streams < SR_EGRESS_MAX_STREAMS ? format->nb_streams : SR_EGRESS_MAX_STREAMS;
+    videoIndex = -1;
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        const AVStream* stream = format->streams[i];
+        const AVCodecParameters* par = stream->codecpar;
+        sr_egress_stream& out = header->streams[i];
+
+        out.codec_type = par->codec_type;
+        out.codec_id = par->codec_id;
+        out.time_base_num = stream->time_base.num;
+        out.time_base_den = stream->time_base.den;
+        out.format = par->format;
+        out.width = par->width;
+        out.height = par->height;
+        out.sample_rate = par->sample_rate;
+        out.channels = par->channels;
+        out.extradata_size = par->extradata_size <= SR_EGRESS_EXTRADATA ? par->extradata_size : 0;
+        memcpy(out.extradata, par->extradata, out.extradata_size);
+
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO && videoIndex < 0)
+        {
+            videoIndex = i;
+        }
+    }
+
+    header->stream_count = count;
+
+    __atomic_store_n(&header->streams_seq, header->streams_seq + 1, __ATOMIC_RELEASE);
+}
+
+void PacketEgress::Publish(const AVPacket* packet)
+{
+    auto begin = std::chrono::steady_clock::now();
+    uint64_t capacity = header->capacity;
+    uint64_t span = RecordSpan(packet->size);
+
+    // Readers would lose their place on every such packet; they only get what the ring can hold twice.
+    if (packet->stream_index >= SR_EGRESS_MAX_STREAMS || span > capacity / 2)
+    {
+        oversized++;
+        return;
+    }
+
+    uint64_t position = header->write_pos;
+    uint64_t offset = position % capacity;
+
+    if (offset + span > capacity)
+    {
+        uint64_t end = position + capacity - offset;
+        sr_egress_record* pad = (sr_egress_record*)(data + offset);
+
+        __atomic_store_n(&header->reserve_pos, end, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        pad->position = position;
+        pad->stream_index = -1;
+        pad->size = 0;
+
+        __atomic_store_n(&header->write_pos, end, __ATOMIC_RELEASE);
+        position = end;
+        offset = 0;
+    }
+
+    __atomic_store_n(&header->reserve_pos, position + span, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    sr_egress_record* record = (sr_egress_record*)(data + offset);
+    bool keyframe = (packet->flags & AV_PKT_FLAG_KEY) && packet->stream_index == videoIndex;
+
+    record->position = position;
+    record->stream_index = packet->stream_index;
+    record->flags = (packet->flags & AV_PKT_FLAG_KEY) ? SR_EGRESS_FLAG_KEY : 0;
+    record->size = packet->size;
+    record->pts = packet->pts;
+    record->dts = packet->dts;
+    record->duration = packet->duration;
+    memcpy(record + 1, packet->data, packet->size);
+
+    __atomic_store_n(&header->write_pos, position + span, __ATOMIC_RELEASE);
+
+    if (keyframe)
+    {
+        __atomic_store_n(&header->keyframe_pos, position, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&header->packets, header->packets + 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&header->futex, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+
+    publishCost.Record(std::chrono::steady_clock::now() - begin);
+}
+
+void PacketEgress::PrintStats() const
+{
+    std::cout << "Packet egress " << name << ": " << header->packets << " packets published into a " << header->capacity / (1024 * 1024) << " MB ring";
+
+    if (oversized)
+    {
+        std::cout << ", " << oversized << " too large for the ring skipped";
+    }
+
+    std::cout << "." << std::endl;
+    publishCost.Print("Packet egress publish time", "us");
+}
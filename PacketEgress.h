@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Packet egress for local consumers (live viewers, uploaders) that would otherwise tail the MP4 while
+// it is written: every encoded packet the recorder muxes is also published, with its stream index,
+// timestamps and keyframe flag, into a shared-memory byte ring that any number of readers map
+// read-only. The recorder never waits for a reader; a reader that falls a whole ring behind notices
+// and rejoins at the latest video keyframe.
+//
+// Layout: sr_egress_header at offset 0, then `capacity` bytes of records at data_offset. A record is
+// an sr_egress_record followed by the payload, padded to SR_EGRESS_ALIGN; a record never wraps, the
+// rest of the ring is skipped with a padding record (stream_index -1) instead. Positions only grow
+// and the record at position p lives at data_offset + p % capacity.
+//
+// The writer raises reserve_pos before it overwrites anything and raises write_pos once the record is
+// complete, both behind release fences, then bumps `futex` and wakes waiting readers. A reader copies
+// a record below write_pos out, and the copy is good if the record still carries its own position and
+// reserve_pos hasn't passed it by a whole ring. keyframe_pos is the latest video keyframe record.
+// The stream table is rewritten for each recording session under the streams_seq seqlock (odd while
+// it is being written).
+
+#define SR_EGRESS_MAGIC         "SREGRS01"
+#define SR_EGRESS_VERSION       1
+#define SR_EGRESS_MAX_STREAMS   4
+#define SR_EGRESS_EXTRADATA     4096
+#define SR_EGRESS_ALIGN         64
+#define SR_EGRESS_NO_KEYFRAME   UINT64_MAX
+
+#define SR_EGRESS_FLAG_KEY      1
+
+typedef struct sr_egress_stream
+{
+    int32_t     codec_type;         // AVMediaType
+    int32_t     codec_id;           // AVCodecID
+    int32_t     time_base_num;      // unit of pts, dts and duration
+    int32_t     time_base_den;
+    int32_t     format;             // AVPixelFormat or AVSampleFormat
+    int32_t     width;
+    int32_t     height;
+    int32_t     sample_rate;
+    int32_t     channels;
+    int32_t     extradata_size;     // 0 when it didn't fit
+    uint8_t     extradata[SR_EGRESS_EXTRADATA];
+} sr_egress_stream;
+
+typedef struct sr_egress_header
+{
+    char                magic[8];
+    uint32_t            version;
+    uint32_t            stream_count;
+    uint64_t            capacity;           // bytes of records, a multiple of SR_EGRESS_ALIGN
+    uint64_t            data_offset;
+    uint64_t            reserve_pos;        // the writer may be overwriting up to here
+    uint64_t            write_pos;          // records are complete up to here
+    uint64_t            keyframe_pos;       // latest video keyframe record, or SR_EGRESS_NO_KEYFRAME
+    uint64_t            packets;            // published so far
+    uint32_t            streams_seq;
+    uint32_t            futex;
+    sr_egress_stream    streams[SR_EGRESS_MAX_STREAMS];
+} sr_egress_header;
+
+typedef struct sr_egress_record
+{
+    uint64_t    position;           // where the record was written, to detect overwrites
+    int32_t     stream_index;       // -1: padding up to the end of the ring
+    uint32_t    flags;              // SR_EGRESS_FLAG_*
+    uint32_t    size;               // payload bytes
+    uint32_t    reserved;
+    int64_t     pts;
+    int64_t     dts;
+    int64_t     duration;
+    uint8_t     padding[16];
+} sr_egress_record;
+
+typedef struct sr_egress_packet
+{
+    int32_t     stream_index;
+    uint32_t    flags;
+    uint32_t    size;
+    int64_t     pts;
+    int64_t     dts;
+    int64_t     duration;
+} sr_egress_packet;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sr_egress sr_egress;
+
+// Maps a ring read-only: "/dev/shm/<name>" for the recorder's --egress=/<name>. The reader starts at
+// the latest video keyframe, or at the next one if none is in the ring yet. Returns NULL on failure.
+sr_egress*  sr_egress_open(const char* path);
+
+// Copies the stream table into streams (up to max entries) and returns the number of streams, 0 while
+// the recorder hasn't opened its output yet.
+int         sr_egress_streams(sr_egress* egress, sr_egress_stream* streams, int max);
+
+// Waits up to timeout_ms for the next packet and copies its payload into buffer. Returns 1 for a
+// packet, 0 on timeout, and -1 if buffer is smaller than packet->size; the packet is then kept for
+// the next call with a larger buffer.
+int         sr_egress_next(sr_egress* egress, sr_egress_packet* packet, uint8_t* buffer, size_t capacity, int timeout_ms);
+
+// Times this reader fell a whole ring behind and rejoined at a keyframe.
+uint64_t    sr_egress_lapped(const sr_egress* egress);
+
+void        sr_egress_close(sr_egress* egress);
+
+#ifdef __cplusplus
+}
+
+#include "ffmpeg.h"
+#include "Stats.h"
+
+#include <string>
+
+// Recorder side of the ring. Only the mux thread publishes.
+class PacketEgress
+{
+public:
+    // name is a POSIX shared-memory name ("/recorder-packets"); an existing ring is replaced. Throws
+    // if the segment can't be created.
+    PacketEgress(const std::string& name, size_t capacityBytes);
+    ~PacketEgress();
+
+    // After avformat_write_header, so the stream time bases are the ones the packets are stamped in.
+    void            SetStreams(const AVFormatContext* format);
+
+    // Before the packet goes to the muxer, which takes its payload.
+    void            Publish(const AVPacket* packet);
+    void            PrintStats() const;
+
+private:
+    sr_egress_header*   header;
+    size_t              size;
+    uint8_t*            data;
+    std::string         name;
+    int                 videoIndex;
+    uint64_t            oversized;
+    DurationStats       publishCost;
+};
+#endif
@@ -0,0 +1,280 @@
+#include "Preview.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+PreviewPublisher::PreviewPublisher(int width, int height, AVPixelFormat format, double intervalSeconds, const std::string& shmName) :
+  width(width), height(height), format(format)
+, chromaShift(format == AV_PIX_FMT_YUV444P ? 0 : 1)
+, interval((int64_t)(intervalSeconds * 1000000)), shmName(shmName)
+, staged(false), running(false), nextOffer(0)
+, jpegContext(nullptr), jpegFrame(nullptr), jpegPacket(nullptr)
+, shm(nullptr), shmSize(0)
+, published(0), skipped(0), startTime(0), publisherCpu(0)
+{
+    step = std::max(1, width / PreviewWidth);
+    previewWidth = (width / step) & ~1;
+    previewHeight = (height / step) & ~1;
+
+    size_t frameSize = av_image_get_buffer_size(format, previewWidth, previewHeight, 1);
+
+    staging.resize(frameSize);
+    publishing.resize(frameSize);
+
+    AVCodec* encoder = const_cast<AVCodec*>(avcodec_find_encoder(AV_CODEC_ID_MJPEG));
+    jpegContext = encoder ? avcodec_alloc_context3(encoder) : nullptr;
+
+    if (jpegContext)
+    {
+        // The planes are limited-range YUV straight from the recording, not the full-range JPEG variant.
+        jpegContext->width = previewWidth;
+        jpegContext->height = previewHeight;
+        jpegContext->pix_fmt = format;
+        jpegContext->color_range = AVCOL_RANGE_MPEG;
+        jpegContext->strict_std_compliance = FF_COMPLIANCE_UNOFFICIAL;
+        jpegContext->time_base = AVRational{ 1, 25 };
+        jpegContext->flags |= AV_CODEC_FLAG_QSCALE;
+        jpegContext->global_quality = FF_QP2LAMBDA * 5;
+        jpegContext->thread_count = 1;
+
+        if (avcodec_open2(jpegContext, encoder, nullptr) < 0)
+        {
+            avcodec_free_context(&jpegContext);
+        }
+    }
+
+    if (!jpegContext)
+    {
+        std::cout << "Preview: no JPEG encoder, thumbnails go to shared memory only." << std::endl;
+    }
+
+    jpegFrame = av_frame_alloc();
+    jpegPacket = av_packet_alloc();
+
+    if (!shmName.empty())
+    {
+        int fd = shm_open(shmName.c_str(), O_CREAT | O_RDWR, 0644);
+        shmSize = sizeof(PreviewShmHeader) + frameSize;
+
+        if (fd < 0 || ftruncate(fd, shmSize) != 0)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+
+            throw std::runtime_error("Can't create the preview shared memory " + shmName + ".");
+        }
+
+        void* map = mmap(nullptr, shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (map == MAP_FAILED)
+        {
+            throw std::runtime_error("Can't map the preview shared memory " + shmName + ".");
+        }
+
+        shm = (PreviewShmHeader*)map;
+        memcpy(shm->magic, "SRPREV01", 8);
+        shm->width = previewWidth;
+        shm->height = previewHeight;
+        shm->format = format;
+        shm->sequence.store(0);
+        shm->timestamp = 0;
+    }
+}
+
+PreviewPublisher::~PreviewPublisher()
+{
+    Stop();
+
+    avcodec_free_context(&jpegContext);
+    av_frame_free(&jpegFrame);
+    av_packet_free(&jpegPacket);
+
+    if (shm)
+    {
+        munmap(shm, shmSize);
+        shm_unlink(shmName.c_str());
+    }
+}
+
+void PreviewPublisher::SetOutput(const std::string& path)
+{
+    std::lock_guard<std::mutex> lk(mutexOutput);
+    jpegPath = path;
+}
+
+void PreviewPublisher::Start()
+{
+    running = true;
+    startTime = av_gettime();
+    thread = std::thread(&PreviewPublisher::ThreadProc, this);
+}
+
+void PreviewPublisher::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lk(mutexStaging);
+
+        if (!running)
+        {
+            return;
+        }
+
+        running = false;
+    }
+
+    cvStaged.notify_one();
+    thread.join();
+}
+
+void PreviewPublisher::Offer(const AVFrame* frame)
+{
+    int64_t now = av_gettime();
+
+    if (now < nextOffer)
+    {
+        return;
+    }
+
+    // Never wait here: if the publisher still holds the previous thumbnail, this one is skipped.
+    std::unique_lock<std::mutex> lk(mutexStaging, std::try_to_lock);
+
+    if (!lk.owns_lock() || staged)
+    {
+        skipped++;
+        return;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    uint8_t* out = staging.data();
+
+    for (int plane = 0; plane < 3; ++plane)
+    {
+        int planeWidth = plane ? previewWidth >> chromaShift : previewWidth;
+        int planeHeight = plane ? previewHeight >> chromaShift : previewHeight;
+
+        for (int y = 0; y < planeHeight; ++y)
+        {
+            const uint8_t* row = frame->data[plane] + (size_t)y * step * frame->linesize[plane];
+
+            for (int x = 0; x < planeWidth; ++x)
+            {
+                *out++ = row[x * step];
+            }
+        }
+    }
+
+    staged = true;
+    nextOffer = now + interval;
+    lk.unlock();
+    cvStaged.notify_one();
+
+    offerCost.Record(std::chrono::steady_clock::now() - begin);
+}
+
+void PreviewPublisher::ThreadProc()
+{
+    // Only runs when a core would otherwise be idle, so it can't take time from capture or encode.
+    struct sched_param param = {};
+
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+    {
+        std::cout << "Preview: SCHED_IDLE refused, publishing at normal priority." << std::endl;
+    }
+
+    int64_t cpuBegin = ThreadCpuNanos();
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lk(mutexStaging);
+            cvStaged.wait(lk, [this] { return staged || !running; });
+
+            if (!staged)
+            {
+                break;
+            }
+
+            staging.swap(publishing);
+            staged = false;
+        }
+
+        int64_t before = ThreadCpuNanos();
+        std::string path;
+
+        {
+            std::lock_guard<std::mutex> lk(mutexOutput);
+            path = jpegPath;
+        }
+
+        if (!path.empty() && jpegContext && !WriteJpeg(path))
+        {
+            std::cout << "Preview: can't write " << path << "." << std::endl;
+        }
+
+        if (shm)
+        {
+            WriteShm();
+        }
+
+        publishCost.Record(ThreadCpuNanos() - before);
+        published++;
+        publisherCpu = ThreadCpuNanos() - cpuBegin;
+    }
+}
+
+// Written next to the target and renamed over it, so a reader never sees a partial JPEG.
+bool PreviewPublisher::WriteJpeg(const std::string& path)
+{
+    av_image_fill_arrays(jpegFrame->data, jpegFrame->linesize, publishing.data(), format, previewWidth, previewHeight, 1);
+    jpegFrame->width = previewWidth;
+    jpegFrame->height = previewHeight;
+    jpegFrame->format = format;
+    jpegFrame->quality = jpegContext->global_quality;
+    jpegFrame->pts = published;
+
+    if (avcodec_send_frame(jpegContext, jpegFrame) < 0 || avcodec_receive_packet(jpegContext, jpegPacket) < 0)
+    {
+        return false;
+    }
+
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    bool written = file && fwrite(jpegPacket->data, 1, jpegPacket->size, file) == (size_t)jpegPacket->size;
+
+    if (file)
+    {
+        written = fclose(file) == 0 && written;
+    }
+
+    av_packet_unref(jpegPacket);
+
+    return written && rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+void PreviewPublisher::WriteShm()
+{
+    uint32_t sequence = shm->sequence.load(std::memory_order_relaxed);
+
+    shm->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    memcpy((uint8_t*)shm + sizeof(PreviewShmHeader), publishing.data(), publishing.size());
+    shm->timestamp = av_gettime();
+
+    shm->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void PreviewPublisher::PrintStats() const
+{
+    double seconds = (av_gettime() - startTime) / 1e6;
+
+    std::cout << "Preview " << previewWidth << "x" << previewHeight << " every " << interval / 1e6 << " s: " << published << " published, " << skipped << " skipped while the publisher was busy." << std::endl
+    << "Preview publisher CPU: " << publisherCpu / 1e6 << " ms in " << seconds << " s (" << (seconds > 0 ? publisherCpu / 1e7 / seconds : 0) << "% of one core)." << std::endl;
+    offerCost.Print("Preview decimation on the capture thread", "us");
+    publishCost.Print("Preview publish CPU time", "us");
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "ffmpeg.h"
+#include "Stats.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Shared-memory preview layout: this header, then the Y, U and V planes packed tightly. sequence is
+// odd while the writer is updating the planes; readers retry if it is odd or changes across their copy.
+struct PreviewShmHeader
+{
+    char                    magic[8];           // "SRPREV01"
+    int32_t                 width;
+    int32_t                 height;
+    int32_t                 format;             // AVPixelFormat of the planes
+    std::atomic<uint32_t>   sequence;
+    int64_t                 timestamp;          // wall clock in microseconds
+};
+
+// Live thumbnails of a recording in progress. The capture thread offers every converted frame; once
+// per interval one is decimated to about PreviewWidth pixels across into a staging buffer, which
+// costs a few hundred kilobytes of reads and never waits on the publisher. A SCHED_IDLE thread then
+// writes it as a JPEG (replaced atomically) and, optionally, into a shared-memory segment.
+class PreviewPublisher
+{
+public:
+    static const int PreviewWidth = 320;
+
+    // shmName is a POSIX shared-memory name ("/recorder-preview"), empty for JPEG only. Throws if the
+    // segment can't be created.
+    PreviewPublisher(int width, int height, AVPixelFormat format, double intervalSeconds, const std::string& shmName);
+    ~PreviewPublisher();
+
+    // Where the JPEG goes from now on; empty pauses JPEG output.
+    void            SetOutput(const std::string& jpegPath);
+
+    void            Start();
+    void            Stop();
+
+    // Capture thread only. Returns at once unless a preview is due and the staging buffer is free.
+    void            Offer(const AVFrame* frame);
+    void            PrintStats() const;
+
+private:
+    void            ThreadProc();
+    bool            WriteJpeg(const std::string& path);
+    void            WriteShm();
+
+    int                         width;
+    int                         height;
+    AVPixelFormat               format;
+    int                         step;
+    int                         chromaShift;
+    int                         previewWidth;
+    int                         previewHeight;
+    int64_t                     interval;
+    std::string                 shmName;
+
+    std::vector<uint8_t>        staging;
+    std::vector<uint8_t>        publishing;
+    std::mutex                  mutexStaging;
+    std::condition_variable     cvStaged;
+    bool                        staged;
+    bool                        running;
+    int64_t                     nextOffer;
+    std::thread                 thread;
+
+    std::mutex                  mutexOutput;
+    std::string                 jpegPath;
+
+    AVCodecContext*             jpegContext;
+    AVFrame*                    jpegFrame;
+    AVPacket*                   jpegPacket;
+
+    PreviewShmHeader*           shm;
+    size_t                      shmSize;
+
+    int64_t                     published;
+    int64_t                     skipped;
+    int64_t                     startTime;
+    std::atomic<int64_t>        publisherCpu;
+    DurationStats               offerCost;
+    DurationStats               publishCost;
+};
@@ -0,0 +1,176 @@
+#include "RawSpool.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char SpoolMagic[8] = { 'S', 'R', 'S', 'P', 'O', 'O', 'L', '1' };
+
+RawSpoolWriter::RawSpoolWriter(const std::string& path, int width, int height, AVPixelFormat format, int fps, int slots) :
+  path(path), fd(-1), base(nullptr), fileSize(0), header(nullptr)
+, firstTimestamp(AV_NOPTS_VALUE), lastTimestamp(AV_NOPTS_VALUE), frameInterval(1000000 / fps)
+{
+    size_t frameSize = av_image_get_buffer_size(format, width, height, 1);
+    size_t slotSize = (SlotHeaderSize + frameSize + 4095) & ~(size_t)4095;
+
+    fileSize = HeaderSize + slotSize * slots;
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    // Blocks are reserved up front so the burst never waits on the filesystem's allocator.
+    if (fd < 0 || posix_fallocate(fd, 0, fileSize) != 0)
+    {
+        throw std::runtime_error("Can't allocate the burst spool " + path + ".");
+    }
+
+    base = (uint8_t*)mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+
+    if (base == MAP_FAILED)
+    {
+        base = nullptr;
+        throw std::runtime_error("Can't map the burst spool " + path + ".");
+    }
+
+    madvise(base, fileSize, MADV_SEQUENTIAL);
+
+    header = (RawSpoolHeader*)base;
+    memcpy(header->magic, SpoolMagic, sizeof(SpoolMagic));
+    header->version = 1;
+    header->width = width;
+    header->height = height;
+    header->format = format;
+    header->fps = fps;
+    header->slots = slots;
+    header->frameSize = frameSize;
+    header->slotSize = slotSize;
+    header->framesWritten = 0;
+    header->framesDropped = 0;
+}
+
+RawSpoolWriter::~RawSpoolWriter()
+{
+    if (base)
+    {
+        munmap(base, fileSize);
+    }
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+void RawSpoolWriter::Write(const AVFrame* frame, int64_t timestamp)
+{
+    auto begin = std::chrono::steady_clock::now();
+    uint8_t* slot = base + HeaderSize + (header->framesWritten % header->slots) * header->slotSize;
+    RawSpoolSlot* slotHeader = (RawSpoolSlot*)slot;
+
+    av_image_copy_to_buffer(slot + SlotHeaderSize, header->frameSize, (const uint8_t* const*)frame->data, frame->linesize, (AVPixelFormat)header->format, header->width, header->height, 1);
+
+    slotHeader->timestamp = timestamp;
+    slotHeader->sequence = header->framesWritten;
+
+    // A gap of more than half a frame period beyond the expected one means frames never made it here.
+    if (lastTimestamp != AV_NOPTS_VALUE && timestamp - lastTimestamp > frameInterval * 3 / 2)
+    {
+        header->framesDropped += (timestamp - lastTimestamp + frameInterval / 2) / frameInterval - 1;
+    }
+
+    if (firstTimestamp == AV_NOPTS_VALUE)
+    {
+        firstTimestamp = timestamp;
+    }
+
+    lastTimestamp = timestamp;
+    header->framesWritten++;
+    writeCost.Record(std::chrono::steady_clock::now() - begin);
+}
+
+void RawSpoolWriter::Close()
+{
+    auto begin = std::chrono::steady_clock::now();
+
+    msync(base, fileSize, MS_SYNC);
+
+    double flushSeconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count() / 1e6;
+    double burstSeconds = (lastTimestamp - firstTimestamp) / 1e6 + frameInterval / 1e6;
+    double megabytes = header->framesWritten * (double)header->frameSize / (1 << 20);
+
+    std::cout << "Burst spool " << path << ": " << header->framesWritten << " frames, " << header->framesDropped << " dropped, "
+    << megabytes << " MB";
+
+    if (header->framesWritten)
+    {
+        std::cout << ", " << megabytes / burstSeconds << " MB/s sustained into the mapping, "
+        << megabytes / (writeCost.Mean() * header->framesWritten / 1e9) << " MB/s while copying";
+    }
+
+    std::cout << ", final flush " << flushSeconds * 1000 << " ms";
+
+    if (header->framesWritten > header->slots)
+    {
+        std::cout << " (ring wrapped, the oldest " << header->framesWritten - header->slots << " frames were overwritten)";
+    }
+
+    std::cout << "." << std::endl;
+    writeCost.Print("Burst spool write time per frame", "us");
+}
+
+RawSpoolReader::RawSpoolReader(const std::string& path) : base(nullptr), fileSize(0), header(nullptr)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < RawSpoolWriter::HeaderSize)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+
+        throw std::runtime_error("Can't open the spool " + path + ".");
+    }
+
+    fileSize = st.st_size;
+    base = (uint8_t*)mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+    {
+        base = nullptr;
+        throw std::runtime_error("Can't map the spool " + path + ".");
+    }
+
+    madvise(base, fileSize, MADV_SEQUENTIAL);
+    header = (const RawSpoolHeader*)base;
+
+    if (memcmp(header->magic, SpoolMagic, sizeof(SpoolMagic)) != 0 || RawSpoolWriter::HeaderSize + header->slotSize * header->slots > fileSize)
+    {
+        munmap(base, fileSize);
+        base = nullptr;
+        throw std::runtime_error(path + " is not a burst spool.");
+    }
+}
+
+RawSpoolReader::~RawSpoolReader()
+{
+    if (base)
+    {
+        munmap(base, fileSize);
+    }
+}
+
+uint64_t RawSpoolReader::Count() const
+{
+    return std::min<uint64_t>(header->framesWritten, header->slots);
+}
+
+const uint8_t* RawSpoolReader::Frame(uint64_t i, int64_t* timestamp) const
+{
+    uint64_t first = header->framesWritten > header->slots ? header->framesWritten - header->slots : 0;
+    const uint8_t* slot = base + RawSpoolWriter::HeaderSize + ((first + i) % header->slots) * header->slotSize;
+
+    *timestamp = ((const RawSpoolSlot*)slot)->timestamp;
+
+    return slot + RawSpoolWriter::SlotHeaderSize;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "ffmpeg.h"
+#include "Stats.h"
+
+// Burst capture spool: a preallocated, memory-mapped ring file of converted frames. A 4 KB header
+// describes the geometry; each slot holds a capture timestamp, a sequence number and one frame with
+// its planes packed tightly. When the burst outlasts the ring, the oldest frames are overwritten.
+struct RawSpoolHeader
+{
+    char        magic[8];
+    uint32_t    version;
+    int32_t     width;
+    int32_t     height;
+    int32_t     format;
+    int32_t     fps;
+    uint32_t    slots;
+    uint64_t    frameSize;
+    uint64_t    slotSize;
+    uint64_t    framesWritten;
+    uint64_t    framesDropped;
+};
+
+struct RawSpoolSlot
+{
+    int64_t     timestamp;          // capture time in microseconds
+    uint64_t    sequence;
+};
+
+class RawSpoolWriter
+{
+public:
+    static const size_t HeaderSize = 4096;
+    static const size_t SlotHeaderSize = 64;
+
+    // Creates (or replaces) the spool and maps it; throws if the file can't be allocated.
+    RawSpoolWriter(const std::string& path, int width, int height, AVPixelFormat format, int fps, int slots);
+    ~RawSpoolWriter();
+
+    void            Write(const AVFrame* frame, int64_t timestamp);
+
+    // Flushes the mapping to disk and prints bandwidth and drop figures.
+    void            Close();
+
+private:
+    std::string         path;
+    int                 fd;
+    uint8_t*            base;
+    size_t              fileSize;
+    RawSpoolHeader*     header;
+    int64_t             firstTimestamp;
+    int64_t             lastTimestamp;
+    int64_t             frameInterval;
+    DurationStats       writeCost;
+};
+
+class RawSpoolReader
+{
+public:
+    // Throws if the file isn't a spool.
+    RawSpoolReader(const std::string& path);
+    ~RawSpoolReader();
+
+    const RawSpoolHeader&   Header() const  { return *header; }
+    uint64_t                Count() const;
+
+    // i-th frame in capture order (oldest surviving frame first), planes packed as written.
+    const uint8_t*          Frame(uint64_t i, int64_t* timestamp) const;
+
+private:
+    uint8_t*            base;
+    size_t              fileSize;
+    const RawSpoolHeader* header;
+};
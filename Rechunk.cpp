@@ -0,0 +1,613 @@
+#include "Rechunk.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace
+{
+    // Shortest chunk planned automatically: below this the fixed cost of an encoder's look-ahead
+    // and of the IDR frame each chunk starts with outweighs the parallelism.
+    const double MinChunkSeconds = 2.0;
+
+    // Encoded chunks go to "<output>.part<n>" as these records, each followed by the payload.
+    struct PartRecord
+    {
+        int64_t     pts;
+        int64_t     dts;
+        int64_t     duration;
+        int32_t     flags;
+        int32_t     size;
+    };
+
+    struct Chunk
+    {
+        int64_t                 start;              // first keyframe pts, video stream time base
+        int64_t                 end;                // next chunk's first keyframe, INT64_MAX for the last
+        std::string             path;
+        AVCodecParameters*      parameters;         // of the chunk's encoder, extradata included
+        int64_t                 frames;
+        int64_t                 bytes;
+        double                  seconds;
+        bool                    ok;
+    };
+
+    struct Source
+    {
+        int                     videoIndex;
+        AVRational              timeBase;
+        AVRational              frameRate;
+        std::vector<int64_t>    keyframes;
+        int64_t                 frames;
+        int64_t                 lastPts;
+    };
+
+    double Seconds(std::chrono::steady_clock::time_point begin)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count() / 1000.0;
+    }
+
+    AVFormatContext* OpenInput(const std::string& path)
+    {
+        AVFormatContext* in = nullptr;
+
+        if (avformat_open_input(&in, path.c_str(), nullptr, nullptr) != 0)
+        {
+            throw std::runtime_error("Can't open " + path + ".");
+        }
+
+        if (avformat_find_stream_info(in, nullptr) < 0)
+        {
+            avformat_close_input(&in);
+            throw std::runtime_error("Can't read the streams of " + path + ".");
+        }
+
+        return in;
+    }
+
+    // One pass over the video packets, without decoding, for the keyframes the chunks can start at.
+    Source ScanSource(const std::string& path)
+    {
+        AVFormatContext* in = OpenInput(path);
+        AVPacket* pkt = av_packet_alloc();
+        Source source;
+
+        source.videoIndex = av_find_best_stream(in, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        source.frames = 0;
+        source.lastPts = AV_NOPTS_VALUE;
+
+        if (source.videoIndex < 0)
+        {
+            av_packet_free(&pkt);
+            avformat_close_input(&in);
+            throw std::runtime_error(path + " has no video stream.");
+        }
+
+        source.timeBase = in->streams[source.videoIndex]->time_base;
+        source.frameRate = in->streams[source.videoIndex]->avg_frame_rate;
+
+        while (av_read_frame(in, pkt) >= 0)
+        {
+            if (pkt->stream_index == source.videoIndex)
+            {
+                int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+                if (pkt->flags & AV_PKT_FLAG_KEY)
+                {
+                    source.keyframes.push_back(pts);
+                }
+
+                source.lastPts = std::max(source.lastPts, pts);
+                source.frames++;
+            }
+
+            av_packet_unref(pkt);
+        }
+
+        std::sort(source.keyframes.begin(), source.keyframes.end());
+
+        av_packet_free(&pkt);
+        avformat_close_input(&in);
+
+        if (source.keyframes.empty())
+        {
+            throw std::runtime_error(path + " has no video keyframes.");
+        }
+
+        if (source.frameRate.num <= 0 || source.frameRate.den <= 0)
+        {
+            source.frameRate = AVRational{ 30, 1 };
+        }
+
+        return source;
+    }
+
+    std::vector<Chunk> PlanChunks(const Source& source, const RechunkOptions& options, int workers, const std::string& outputPath)
+    {
+        double duration = (source.lastPts - source.keyframes.front()) * av_q2d(source.timeBase);
+        double target = options.chunkSeconds > 0 ? options.chunkSeconds : std::max(MinChunkSeconds, duration / (workers * 4));
+        std::vector<Chunk> chunks;
+        int64_t chunkStart = 0;
+
+        for (int64_t keyframe : source.keyframes)
+        {
+            if (chunks.empty() || (keyframe - chunkStart) * av_q2d(source.timeBase) >= target)
+            {
+                if (!chunks.empty())
+                {
+                    chunks.back().end = keyframe;
+                }
+
+                // The first chunk starts at the beginning of the file, so it also keeps any frames the
+                // decoder recovers before the first keyframe.
+                Chunk chunk = Chunk();
+
+                chunk.start = chunks.empty() ? INT64_MIN : keyframe;
+                chunk.end = INT64_MAX;
+                chunk.path = outputPath + ".part" + std::to_string(chunks.size());
+                chunks.push_back(chunk);
+                chunkStart = keyframe;
+            }
+        }
+
+        return chunks;
+    }
+
+    AVCodecContext* OpenEncoder(const RechunkOptions& options, const AVCodecParameters* source, const Source& info, int threads)
+    {
+        AVCodec* encoder = FindVideoBackend(options.backend);
+        AVCodecContext* c = encoder ? avcodec_alloc_context3(encoder) : nullptr;
+        AVDictionary* encoderOptions = nullptr;
+
+        if (!c)
+        {
+            throw std::runtime_error("Video encoder " + options.backend + " isn't available in this FFmpeg build.");
+        }
+
+        c->width = source->width;
+        c->height = source->height;
+        c->pix_fmt = (AVPixelFormat)source->format;
+        c->sample_aspect_ratio = source->sample_aspect_ratio;
+        c->time_base = info.timeBase;
+        c->framerate = info.frameRate;
+        c->gop_size = (int)(av_q2d(info.frameRate) * 10);
+
+        // Every chunk's headers are the same, so they're written once, in the stitched file's global header.
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+        ApplyVideoPreset(options.backend, options.preset, c, &encoderOptions);
+
+        // Constant quality keeps the chunks consistent with each other; bit-rate targets would be met
+        // per chunk, each with its own rate control warm-up.
+        if (options.backend == "x264" || options.backend == "x265")
+        {
+            av_dict_set_int(&encoderOptions, "crf", options.crf, 0);
+        }
+        else
+        {
+            c->bit_rate = source->bit_rate > 0 ? source->bit_rate : 2000 * 1000;
+        }
+
+        c->thread_count = threads;
+
+        int ret = avcodec_open2(c, encoder, &encoderOptions);
+        av_dict_free(&encoderOptions);
+
+        if (ret < 0)
+        {
+            avcodec_free_context(&c);
+            throw std::runtime_error("Can't open the " + options.backend + " encoder.");
+        }
+
+        return c;
+    }
+
+    // Decodes from the keyframe at chunk.start and encodes every frame with a pts in [start, end).
+    // Decoding carries on past end until the decoder returns a frame beyond it, so leading pictures of
+    // an open GOP are still decoded here, where their references are.
+    void EncodeChunk(const RechunkOptions& options, const Source& info, Chunk& chunk, int threads)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        AVFormatContext* in = OpenInput(options.inputPath);
+        AVStream* stream = in->streams[info.videoIndex];
+        AVCodec* decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+        AVCodecContext* decodeContext = decoder ? avcodec_alloc_context3(decoder) : nullptr;
+        AVCodecContext* encodeContext = nullptr;
+        AVPacket* pkt = av_packet_alloc();
+        AVPacket* encoded = av_packet_alloc();
+        AVFrame* frame = av_frame_alloc();
+        FILE* part = fopen(chunk.path.c_str(), "wb");
+
+        try
+        {
+            if (!part)
+            {
+                throw std::runtime_error("Can't create " + chunk.path + ".");
+            }
+
+            if (!decodeContext || avcodec_parameters_to_context(decodeContext, stream->codecpar) < 0)
+            {
+                throw std::runtime_error("Can't decode the video of " + options.inputPath + ".");
+            }
+
+            decodeContext->thread_count = threads;
+
+            if (avcodec_open2(decodeContext, decoder, nullptr) < 0)
+            {
+                throw std::runtime_error("Can't decode the video of " + options.inputPath + ".");
+            }
+
+            encodeContext = OpenEncoder(options, stream->codecpar, info, threads);
+
+            if (chunk.start != INT64_MIN && av_seek_frame(in, info.videoIndex, chunk.start, AVSEEK_FLAG_BACKWARD) < 0)
+            {
+                throw std::runtime_error("Can't seek to a chunk start in " + options.inputPath + ".");
+            }
+
+            auto encode = [&](AVFrame* f)
+            {
+                avcodec_send_frame(encodeContext, f);
+
+                while (avcodec_receive_packet(encodeContext, encoded) == 0)
+                {
+                    PartRecord record = { encoded->pts, encoded->dts, encoded->duration, encoded->flags, encoded->size };
+
+                    if (fwrite(&record, sizeof(record), 1, part) != 1 || fwrite(encoded->data, 1, encoded->size, part) != (size_t)encoded->size)
+                    {
+                        throw std::runtime_error("Can't write " + chunk.path + ".");
+                    }
+
+                    chunk.bytes += encoded->size;
+                    av_packet_unref(encoded);
+                }
+            };
+
+            bool draining = false;
+            bool past = false;
+
+            while (!draining && !past)
+            {
+                if (av_read_frame(in, pkt) < 0)
+                {
+                    draining = true;
+                    avcodec_send_packet(decodeContext, nullptr);
+                }
+                else if (pkt->stream_index == info.videoIndex)
+                {
+                    avcodec_send_packet(decodeContext, pkt);
+                    av_packet_unref(pkt);
+                }
+                else
+                {
+                    av_packet_unref(pkt);
+                    continue;
+                }
+
+                while (!past && avcodec_receive_frame(decodeContext, frame) == 0)
+                {
+                    int64_t pts = frame->best_effort_timestamp;
+
+                    if (pts >= chunk.end)
+                    {
+                        past = true;
+                    }
+                    else if (pts >= chunk.start)
+                    {
+                        frame->pts = pts;
+                        frame->pict_type = AV_PICTURE_TYPE_NONE;
+                        encode(frame);
+                        chunk.frames++;
+                    }
+
+                    av_frame_unref(frame);
+                }
+            }
+
+            encode(nullptr);
+
+            chunk.parameters = avcodec_parameters_alloc();
+            avcodec_parameters_from_context(chunk.parameters, encodeContext);
+            chunk.ok = true;
+        }
+        catch (std::exception& e)
+        {
+            std::cout << "[ERROR]  " << e.what() << std::endl;
+        }
+
+        if (part)
+        {
+            fclose(part);
+        }
+
+        av_frame_free(&frame);
+        av_packet_free(&encoded);
+        av_packet_free(&pkt);
+        avcodec_free_context(&encodeContext);
+        avcodec_free_context(&decodeContext);
+        avformat_close_input(&in);
+
+        chunk.seconds = Seconds(begin);
+    }
+
+    // Reads the next record of the part files in order; false after the last one.
+    bool ReadPart(std::vector<Chunk>& chunks, size_t& current, FILE*& part, AVPacket* pkt)
+    {
+        PartRecord record;
+
+        while (current < chunks.size())
+        {
+            if (!part)
+            {
+                part = fopen(chunks[current].path.c_str(), "rb");
+
+                if (!part)
+                {
+                    throw std::runtime_error("Can't reopen " + chunks[current].path + ".");
+                }
+            }
+
+            if (fread(&record, sizeof(record), 1, part) == 1)
+            {
+                if (av_new_packet(pkt, record.size) < 0 || fread(pkt->data, 1, record.size, part) != (size_t)record.size)
+                {
+                    throw std::runtime_error(chunks[current].path + " is truncated.");
+                }
+
+                pkt->pts = record.pts;
+                pkt->dts = record.dts;
+                pkt->duration = record.duration;
+                pkt->flags = record.flags;
+                return true;
+            }
+
+            fclose(part);
+            part = nullptr;
+            current++;
+        }
+
+        return false;
+    }
+
+    // Concatenates the encoded chunks behind chunk 0's codec headers and copies the source audio in,
+    // merged by decode timestamp. Returns the number of decode timestamps moved to keep them rising.
+    int64_t Stitch(const RechunkOptions& options, const Source& info, std::vector<Chunk>& chunks)
+    {
+        const AVCodecParameters* headers = chunks.front().parameters;
+
+        for (const Chunk& chunk : chunks)
+        {
+            if (chunk.parameters->extradata_size != headers->extradata_size
+                || memcmp(chunk.parameters->extradata, headers->extradata, headers->extradata_size) != 0)
+            {
+                throw std::runtime_error("The chunk encoders produced different codec headers, so the chunks can't be joined as they are.");
+            }
+        }
+
+        AVFormatContext* in = OpenInput(options.inputPath);
+        AVFormatContext* out = nullptr;
+        int audioIn = av_find_best_stream(in, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+        int videoOut = -1, audioOut = -1;
+        int64_t fixups = 0;
+
+        if (avformat_alloc_output_context2(&out, nullptr, nullptr, options.outputPath.c_str()) < 0)
+        {
+            avformat_close_input(&in);
+            throw std::runtime_error("Can't create " + options.outputPath + ".");
+        }
+
+        AVStream* videoStream = avformat_new_stream(out, nullptr);
+
+        avcodec_parameters_copy(videoStream->codecpar, headers);
+        videoStream->time_base = info.timeBase;
+        videoOut = videoStream->index;
+
+        if (audioIn >= 0)
+        {
+            AVStream* audioStream = avformat_new_stream(out, nullptr);
+
+            avcodec_parameters_copy(audioStream->codecpar, in->streams[audioIn]->codecpar);
+            audioStream->codecpar->codec_tag = 0;
+            audioStream->time_base = in->streams[audioIn]->time_base;
+            audioOut = audioStream->index;
+        }
+
+        AVPacket* video = av_packet_alloc();
+        AVPacket* audio = av_packet_alloc();
+        FILE* part = nullptr;
+        size_t current = 0;
+        bool ok = false;
+
+        try
+        {
+            if (avio_open(&out->pb, options.outputPath.c_str(), AVIO_FLAG_WRITE) < 0 || avformat_write_header(out, nullptr) < 0)
+            {
+                throw std::runtime_error("Can't write " + options.outputPath + ".");
+            }
+
+            // Next audio packet of the source, false at its end.
+            auto readAudio = [&]()
+            {
+                while (audioIn >= 0 && av_read_frame(in, audio) >= 0)
+                {
+                    if (audio->stream_index == audioIn)
+                    {
+                        return true;
+                    }
+
+                    av_packet_unref(audio);
+                }
+
+                return false;
+            };
+
+            bool haveVideo = ReadPart(chunks, current, part, video);
+            bool haveAudio = readAudio();
+            int64_t lastDts = AV_NOPTS_VALUE;
+
+            while (haveVideo || haveAudio)
+            {
+                bool takeAudio = !haveVideo || (haveAudio && av_compare_ts(audio->dts, in->streams[audioIn]->time_base, video->dts, info.timeBase) <= 0);
+
+                if (takeAudio)
+                {
+                    audio->stream_index = audioOut;
+                    av_packet_rescale_ts(audio, in->streams[audioIn]->time_base, out->streams[audioOut]->time_base);
+                    av_interleaved_write_frame(out, audio);
+                    haveAudio = readAudio();
+                    continue;
+                }
+
+                // With a constant frame rate, every chunk's encoder delays decode timestamps by the same
+                // reordering depth and the joins line up; variable frame rate can make them overlap by a tick.
+                if (lastDts != AV_NOPTS_VALUE && video->dts <= lastDts)
+                {
+                    video->dts = lastDts + 1;
+                    fixups++;
+                }
+
+                lastDts = video->dts;
+                video->stream_index = videoOut;
+                av_packet_rescale_ts(video, info.timeBase, out->streams[videoOut]->time_base);
+                av_interleaved_write_frame(out, video);
+                haveVideo = ReadPart(chunks, current, part, video);
+            }
+
+            ok = av_write_trailer(out) == 0;
+        }
+        catch (std::exception& e)
+        {
+            std::cout << "[ERROR]  " << e.what() << std::endl;
+        }
+
+        if (part)
+        {
+            fclose(part);
+        }
+
+        av_packet_free(&audio);
+        av_packet_free(&video);
+        avio_closep(&out->pb);
+        avformat_free_context(out);
+        avformat_close_input(&in);
+
+        if (!ok)
+        {
+            throw std::runtime_error("Can't join the chunks into " + options.outputPath + ".");
+        }
+
+        return fixups;
+    }
+}
+
+int RechunkRecording(const RechunkOptions& options)
+{
+    int workers = options.workers > 0 ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<Chunk> chunks;
+    int result = 0;
+
+    try
+    {
+        auto begin = std::chrono::steady_clock::now();
+        Source info = ScanSource(options.inputPath);
+        double scanSeconds = Seconds(begin);
+
+        chunks = PlanChunks(info, options, workers, options.outputPath);
+
+        std::cout << "Re-encoding " << info.frames << " frames of " << options.inputPath << " as " << chunks.size() << " chunks on " << workers
+        << " workers with " << options.backend << " (" << EncoderPresetName(options.preset) << ")." << std::endl;
+
+        // Chunks are handed out in order, one encoder thread each, so a worker never waits on another.
+        auto encodeBegin = std::chrono::steady_clock::now();
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> threads;
+
+        for (int i = 0; i < std::min<int>(workers, chunks.size()); ++i)
+        {
+            threads.push_back(std::thread([&]
+            {
+                for (size_t c = next++; c < chunks.size(); c = next++)
+                {
+                    EncodeChunk(options, info, chunks[c], 1);
+                }
+            }));
+        }
+
+        for (std::thread& t : threads)
+        {
+            t.join();
+        }
+
+        double encodeSeconds = Seconds(encodeBegin);
+        double chunkSeconds = 0;
+        int64_t frames = 0;
+
+        for (const Chunk& chunk : chunks)
+        {
+            if (!chunk.ok)
+            {
+                throw std::runtime_error("A chunk failed to encode; the part files are kept for inspection.");
+            }
+
+            chunkSeconds += chunk.seconds;
+            frames += chunk.frames;
+        }
+
+        auto stitchBegin = std::chrono::steady_clock::now();
+        int64_t fixups = Stitch(options, info, chunks);
+        double stitchSeconds = Seconds(stitchBegin);
+        double totalSeconds = Seconds(begin);
+
+        for (const Chunk& chunk : chunks)
+        {
+            unlink(chunk.path.c_str());
+        }
+
+        std::cout << "Chunked re-encode: " << frames << " frames in " << totalSeconds << " s (scan " << scanSeconds << " s, encode " << encodeSeconds
+        << " s, join " << stitchSeconds << " s), " << frames / encodeSeconds << " fps; workers busy " << 100.0 * chunkSeconds / (encodeSeconds * threads.size()) << "% of the encode." << std::endl;
+
+        if (fixups)
+        {
+            std::cout << fixups << " decode timestamps nudged at the joins." << std::endl;
+        }
+
+        if (options.compare)
+        {
+            // The same decode and encode over the whole file in one encoder with its own frame threads.
+            Chunk whole = Chunk();
+
+            whole.start = INT64_MIN;
+            whole.end = INT64_MAX;
+            whole.path = options.outputPath + ".single";
+            EncodeChunk(options, info, whole, 0);
+            unlink(whole.path.c_str());
+            avcodec_parameters_free(&whole.parameters);
+
+            if (!whole.ok)
+            {
+                throw std::runtime_error("The single-pass comparison encode failed.");
+            }
+
+            std::cout << "Single-pass encode: " << whole.frames << " frames in " << whole.seconds << " s, " << whole.frames / whole.seconds << " fps. Speedup "
+            << whole.seconds / totalSeconds << "x overall, " << whole.seconds / encodeSeconds << "x for the encode alone." << std::endl;
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cout << "[ERROR]  " << e.what() << std::endl;
+        result = -1;
+    }
+
+    for (Chunk& chunk : chunks)
+    {
+        avcodec_parameters_free(&chunk.parameters);
+    }
+
+    return result;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "EncoderBackend.h"
+
+#include <string>
+
+// Re-encodes a finished recording on every core. The video is split at its keyframes into chunks that
+// are decoded and encoded independently, each by a single-threaded encoder with identical settings, so
+// the chunks share one set of codec headers and are concatenated as they are, with no re-encode at the
+// joins. Audio packets and all timestamps are copied from the source. Built as its own executable,
+// rechunk (see RechunkMain.cpp).
+struct RechunkOptions
+{
+    std::string     inputPath;
+    std::string     outputPath;
+    std::string     backend;            // a video backend from EncoderBackend.h
+    EncoderPreset   preset;
+    int             crf;                // x264 and x265; other backends reuse the source bit rate
+    int             workers;            // 0: one per hardware thread
+    double          chunkSeconds;       // 0: about four chunks per worker
+    bool            compare;            // also time a single-pass encode of the whole file
+};
+
+int RechunkRecording(const RechunkOptions& options);
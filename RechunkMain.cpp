@@ -0,0 +1,66 @@
+#include "Rechunk.h"
+
+// rechunk <input> <output> [--video-encoder=x264] [--preset=archival] [--crf=20] [--workers=N]
+//         [--chunk-seconds=S] [--compare]
+int main(int argc, char** argv)
+{
+    RechunkOptions options;
+
+    options.backend = "x264";
+    options.preset = EncoderPreset::Archival;
+    options.crf = 20;
+    options.workers = 0;
+    options.chunkSeconds = 0;
+    options.compare = false;
+
+    if (argc < 3)
+    {
+        std::cout << "Usage: " << argv[0] << " <input> <output> [--video-encoder=<backend>] [--preset=realtime|balanced|archival] [--crf=<n>]"
+        << " [--workers=<n>] [--chunk-seconds=<s>] [--compare]" << std::endl;
+        return 1;
+    }
+
+    av_log_set_level(AV_LOG_ERROR);
+    options.inputPath = argv[1];
+    options.outputPath = argv[2];
+
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        std::string value = option.substr(option.find('=') + 1);
+
+        if (option.rfind("--video-encoder=", 0) == 0)
+        {
+            options.backend = value;
+        }
+        else if (option.rfind("--preset=", 0) == 0)
+        {
+            if (!ParseEncoderPreset(value, &options.preset))
+            {
+                std::cout << "Preset must be realtime, balanced or archival, ignored." << std::endl;
+            }
+        }
+        else if (option.rfind("--crf=", 0) == 0)
+        {
+            options.crf = std::stoi(value);
+        }
+        else if (option.rfind("--workers=", 0) == 0)
+        {
+            options.workers = std::stoi(value);
+        }
+        else if (option.rfind("--chunk-seconds=", 0) == 0)
+        {
+            options.chunkSeconds = std::stod(value);
+        }
+        else if (option == "--compare")
+        {
+            options.compare = true;
+        }
+        else
+        {
+            std::cout << "Unknown option " << option << ", ignored." << std::endl;
+        }
+    }
+
+    return RechunkRecording(options) == 0 ? 0 : 1;
+}
@@ -0,0 +1,140 @@
+#include "RoiMap.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+int BlockSad16(const uint8_t* a, int strideA, const uint8_t* b, int strideB, int rows)
+{
+    int sad = 0;
+
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+
+    for (int r = 0; r < rows; ++r)
+    {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + r * strideA)), _mm_loadu_si128((const __m128i*)(b + r * strideB))));
+    }
+
+    sad = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#else
+    for (int r = 0; r < rows; ++r)
+    {
+        for (int x = 0; x < 16; ++x)
+        {
+            sad += std::abs(a[r * strideA + x] - b[r * strideB + x]);
+        }
+    }
+#endif
+
+    return sad;
+}
+
+int BlockEdges16(const uint8_t* p, int stride, int rows, int threshold)
+{
+    int edges = 0;
+
+    for (int r = 0; r < rows; ++r)
+    {
+        const uint8_t* row = p + r * stride;
+
+        for (int x = 0; x < 15; ++x)
+        {
+            edges += std::abs(row[x + 1] - row[x]) > threshold;
+        }
+    }
+
+    return edges;
+}
+
+RoiAnalyzer::RoiAnalyzer(int width, int height) :
+  width(width), height(height)
+, mbWidth((width + MbSize - 1) / MbSize), mbHeight((height + MbSize - 1) / MbSize)
+, havePrevious(false), previous(width * height)
+, changedMbs(0), textMbs(0), totalMbs(0)
+{
+}
+
+void RoiAnalyzer::Analyze(const uint8_t* luma, int stride, int8_t* map)
+{
+    auto begin = std::chrono::steady_clock::now();
+
+    for (int my = 0; my < mbHeight; ++my)
+    {
+        int y = my * MbSize;
+        int rows = std::min(MbSize, height - y);
+
+        for (int mx = 0; mx < mbWidth; ++mx)
+        {
+            int x = mx * MbSize;
+            int8_t value = Static;
+
+            // Edge macroblocks narrower than 16 pixels are always treated as changed.
+            if (!havePrevious || x + MbSize > width)
+            {
+                value = Changed;
+            }
+            else if (BlockSad16(luma + y * stride + x, stride, &previous[y * width + x], width, rows) > 2 * MbSize * rows)
+            {
+                // Anti-aliased glyphs give many strong horizontal steps; photos and gradients give few.
+                value = BlockEdges16(luma + y * stride + x, stride, rows, 48) > 15 * rows / 4 ? ChangedText : Changed;
+            }
+
+            map[my * mbWidth + mx] = value;
+            changedMbs += value != Static;
+            textMbs += value == ChangedText;
+        }
+    }
+
+    for (int y = 0; y < height; ++y)
+    {
+        memcpy(&previous[y * width], luma + y * stride, width);
+    }
+
+    havePrevious = true;
+    totalMbs += mbWidth * mbHeight;
+    analyzeCost.Record(std::chrono::steady_clock::now() - begin);
+}
+
+int RoiAnalyzer::BuildRegions(const int8_t* map, AVRegionOfInterest* regions, int maxRegions) const
+{
+    int n = 0;
+
+    for (int my = 0; my < mbHeight && n < maxRegions; ++my)
+    {
+        int mx = 0;
+
+        while (mx < mbWidth && n < maxRegions)
+        {
+            int8_t value = map[my * mbWidth + mx];
+            int start = mx;
+
+            while (mx < mbWidth && map[my * mbWidth + mx] == value)
+            {
+                mx++;
+            }
+
+            AVRegionOfInterest* roi = &regions[n++];
+
+            roi->self_size = sizeof(AVRegionOfInterest);
+            roi->top = my * MbSize;
+            roi->bottom = std::min(height, (my + 1) * MbSize);
+            roi->left = start * MbSize;
+            roi->right = std::min(width, mx * MbSize);
+            roi->qoffset = AVRational{ value, 10 };
+        }
+    }
+
+    return n;
+}
+
+void RoiAnalyzer::PrintStats() const
+{
+    if (!totalMbs)
+    {
+        return;
+    }
+
+    std::cout << "ROI map: " << 100.0 * changedMbs / totalMbs << "% of macroblocks changed, " << 100.0 * textMbs / totalMbs << "% changed text." << std::endl;
+    analyzeCost.Print("ROI analysis time per frame", "us");
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "ffmpeg.h"
+#include "Stats.h"
+
+#include <vector>
+
+// Per-macroblock screen-change and text-density analysis on the luma plane, turned into
+// AV_FRAME_DATA_REGIONS_OF_INTEREST so x264 moves quantizer budget from static areas to
+// areas that changed (and most of all to changed text).
+class RoiAnalyzer
+{
+public:
+    static const int    MbSize = 16;
+
+    // Map values, stored per macroblock as the quantizer offset in tenths of the qp range.
+    static const int8_t Static = 1;
+    static const int8_t Changed = -1;
+    static const int8_t ChangedText = -2;
+
+    RoiAnalyzer(int width, int height);
+
+    int                 MapSize() const     { return mbWidth * mbHeight; }
+
+    // Compares against the previous call's plane and writes one entry per macroblock.
+    void                Analyze(const uint8_t* luma, int stride, int8_t* map);
+
+    // Merges horizontal runs of equal non-zero entries into rectangles; returns how many were written.
+    int                 BuildRegions(const int8_t* map, AVRegionOfInterest* regions, int maxRegions) const;
+
+    void                PrintStats() const;
+
+private:
+    int                     width;
+    int                     height;
+    int                     mbWidth;
+    int                     mbHeight;
+    bool                    havePrevious;
+    std::vector<uint8_t>    previous;
+    int64_t                 changedMbs;
+    int64_t                 textMbs;
+    int64_t                 totalMbs;
+    DurationStats           analyzeCost;
+};
+
+// Sum of absolute differences of one 16-pixel-wide block of the given height.
+int     BlockSad16(const uint8_t* a, int strideA, const uint8_t* b, int strideB, int rows);
+
+// Number of horizontally adjacent pixel pairs in a 16-wide block that differ by more than threshold.
+int     BlockEdges16(const uint8_t* p, int stride, int rows, int threshold);
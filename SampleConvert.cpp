@@ -0,0 +1,67 @@
+#include "SampleConvert.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static const float S16Scale = 1.0f / 32768.0f;
+
+void DeinterleaveFloat(const float* src, float* const* dst, int channels, int count)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    // Stereo, four frames per iteration: even lanes are left, odd lanes are right.
+    if (channels == 2)
+    {
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 a = _mm_loadu_ps(src + 2 * i);
+            __m128 b = _mm_loadu_ps(src + 2 * i + 4);
+
+            _mm_storeu_ps(dst[0] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+            _mm_storeu_ps(dst[1] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        }
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        for (int c = 0; c < channels; ++c)
+        {
+            dst[c][i] = src[i * channels + c];
+        }
+    }
+}
+
+void DeinterleaveS16ToFloat(const int16_t* src, float* const* dst, int channels, int count)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    // Stereo, four frames (one 128-bit load) per iteration: each 32-bit lane holds left in its low
+    // half and right in its high half, split apart with sign-extending shifts.
+    if (channels == 2)
+    {
+        __m128 scale = _mm_set1_ps(S16Scale);
+
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i frames = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+            __m128i left = _mm_srai_epi32(_mm_slli_epi32(frames, 16), 16);
+            __m128i right = _mm_srai_epi32(frames, 16);
+
+            _mm_storeu_ps(dst[0] + i, _mm_mul_ps(_mm_cvtepi32_ps(left), scale));
+            _mm_storeu_ps(dst[1] + i, _mm_mul_ps(_mm_cvtepi32_ps(right), scale));
+        }
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        for (int c = 0; c < channels; ++c)
+        {
+            dst[c][i] = src[i * channels + c] * S16Scale;
+        }
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+// Packed to planar audio for sources that already run at the encoder's rate and channel count, so
+// the resampler can be skipped. dst holds one pointer per channel; count is in samples per channel.
+
+// Interleaved float to planar float.
+void DeinterleaveFloat(const float* src, float* const* dst, int channels, int count);
+
+// Interleaved signed 16-bit to planar float in [-1, 1), scaled by 1/32768 as libswresample does.
+void DeinterleaveS16ToFloat(const int16_t* src, float* const* dst, int channels, int count);
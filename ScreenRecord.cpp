@@ -1,18 +1,72 @@
 #include "ScreenRecord.h"
+#include "ColorConvert.h"
+#include "FastStart.h"
+#include "Transcode.h"
+#include "SampleConvert.h"
 
 #define FATAL(x)    { fatal = true; throw std::runtime_error(x); }
 #define LOG(x)      std::cout << x << std::endl
 
+void ScreenRecord::Start(const std::string& path)
+{
+    // A persistent recorder may still be finalising the previous file. Rather than hold up the control
+    // socket, queue the start; FinishSession() begins it as soon as the recorder has re-armed.
+    if (persistent && state == RecordState::Stopped)
+    {
+        std::lock_guard<std::mutex> lk(mutexSession);
+
+        if (state == RecordState::Stopped)
+        {
+            pendingPath = path;
+            startPending = true;
+            LOG("Previous recording still finalising, " << path << " starts when it is done.");
+            return;
+        }
+    }
+
+    if (state != RecordState::NotStarted && state != RecordState::Armed)
+    {
+        Start();
+        return;
+    }
+
+    filePath = path;
+
+    if (preview)
+    {
+        preview->SetOutput(filePath + ".preview.jpg");
+    }
+
+    Start();
+}
+
 void ScreenRecord::Start()
 {
     if (state == RecordState::NotStarted)
     {
+        startTime = std::chrono::steady_clock::now();
+        firstFramePending = true;
+        videoTailQueued = false;
+
         state = RecordState::Started;
         LOG("Launching the muxing thread...");
         
         std::thread muxThread(&ScreenRecord::MuxThreadProc, this);
         muxThread.detach();
     }
+    else if(state == RecordState::Armed)
+    {
+        // A persistent recorder's output is opened by the mux thread, off the caller's path.
+        startTime = std::chrono::steady_clock::now();
+        firstFramePending = true;
+        videoTailQueued = false;
+
+        state = RecordState::Started;
+        LOG("Starting the armed recording...");
+
+        std::thread muxThread(&ScreenRecord::MuxThreadProc, this);
+        muxThread.detach();
+    }
     else if(state == RecordState::Started)
     {
         throw std::runtime_error("Already recording. Maybe you meant 'pause' or 'stop'. Try again.");
@@ -31,17 +85,14 @@ void ScreenRecord::Resume()
 {
     if (state == RecordState::Paused)
     {
-        if(recordAudio)
-        {
-            avformat_open_input(&audioFormatContext, audioDevice.c_str(), audioInputFormat, nullptr);
-        }
+        resumeTime = std::chrono::steady_clock::now();
+        videoResumePending = true;
+        audioResumePending = recordAudio;
 
         state = RecordState::Started;
         LOG("Resuming the recording...");
-
-        cvNotPause.notify_all();
     }
-    else if(state == RecordState::NotStarted)
+    else if(state == RecordState::NotStarted || state == RecordState::Armed)
     {
         throw std::runtime_error("Nothing to resume, recording not started yet. Maybe you meant 'start' or 'stop'. Try again.");
     }
@@ -63,7 +114,7 @@ void ScreenRecord::Pause()
         {
             throw std::runtime_error("Already paused. Maybe you meant 'resume' or 'stop'. Try again.");
         }
-        else if(state == RecordState::NotStarted)
+        else if(state == RecordState::NotStarted || state == RecordState::Armed)
         {
             throw std::runtime_error("Nothing to pause, recording has not started yet. Maybe you meant 'start' or 'stop'. Try again.");
         }
@@ -73,21 +124,23 @@ void ScreenRecord::Pause()
         }
     }
 
-    if(recordAudio)
-    {
-        avformat_close_input(&audioFormatContext);
-    }
-
     state = RecordState::Paused;
     LOG("Pausing the recording...");
-
-    cvNotPause.notify_all();
 }
 
 void ScreenRecord::Stop()
 {
     if(state == RecordState::Stopped)
     {
+        std::lock_guard<std::mutex> lk(mutexSession);
+
+        if (startPending)
+        {
+            startPending = false;
+            LOG("Queued recording " << pendingPath << " cancelled.");
+            return;
+        }
+
         throw std::runtime_error("Recording has already been stopped.");
     }
     else if(state == RecordState::NotStarted)
@@ -96,19 +149,31 @@ void ScreenRecord::Stop()
         state = RecordState::Finished;
         return;
     }
-
-    if (state == RecordState::Paused)
+    else if(state == RecordState::Armed)
     {
-        if(recordAudio)
+        if (persistent)
         {
-            avformat_open_input(&audioFormatContext, audioDevice.c_str(), audioInputFormat, nullptr);
+            throw std::runtime_error("Nothing to stop, no recording in progress.");
         }
 
-        cvNotPause.notify_all();
+        // Armed but never started: the header is written, let the mux thread finalise an empty file.
+        LOG("Stopping the armed recording...");
+        stopTime = std::chrono::steady_clock::now();
+        state = RecordState::Stopped;
+
+        std::thread muxThread(&ScreenRecord::MuxThreadProc, this);
+        muxThread.detach();
+        return;
     }
 
     LOG("Stopping the recording...");
+    stopTime = std::chrono::steady_clock::now();
     state = RecordState::Stopped;
+
+    cvVideoBufferNotEmpty.notify_all();
+    cvVideoBufferNotFull.notify_all();
+    cvAudioBufferNotEmpty.notify_all();
+    cvAudioBufferNotFull.notify_all();
 }
 
 void ScreenRecord::LogStatus()
@@ -118,13 +183,16 @@ void ScreenRecord::LogStatus()
     << "Output file: " << filePath << std::endl;
     if(recordAudio)
     {
-        std::cout << "Audio device name: " << audioDevice << std::endl
-        << "Audio input format context bit rate: " << audioFormatContext->bit_rate << std::endl
-        << "Audio input codec context sample rate: " << audioDecodeContext->sample_rate << std::endl
-        << "Audio input codec context time base: AVRational { " << audioDecodeContext->time_base.num << ", " << audioDecodeContext->time_base.den << " }" << std::endl;
+        for (AudioSource* source : audioSources)
+        {
+            std::cout << "Audio device name: " << source->device << " (gain " << source->gain << ")" << std::endl
+            << "Audio input format context bit rate: " << source->formatContext->bit_rate << std::endl
+            << "Audio input codec context sample rate: " << source->decodeContext->sample_rate << std::endl
+            << "Audio input codec context time base: AVRational { " << source->decodeContext->time_base.num << ", " << source->decodeContext->time_base.den << " }" << std::endl;
+        }
     }
     
-    std::cout << "Video input codec context dimensions: " << videoDecodeContext->width << " - " << videoDecodeContext->height << std::endl
+    std::cout << "Video input codec context dimensions: " << width << " - " << height << (ingestReader ? " (ingest " + ingestPath + ")" : std::string()) << std::endl
     << "Output format context probe size: " << outFormatContext->probesize << std::endl;
 
     if(recordAudio)
@@ -139,21 +207,78 @@ void ScreenRecord::LogStatus()
     << std::endl << std::endl << std::endl;
 }
 
+// Achieved frame cadence against the target rate, and how much of the frame period each stage leaves
+// unused at p99; the stage with the least headroom is the one that breaks first as the rate goes up.
+void ScreenRecord::PrintCadence()
+{
+    double period = 1e9 / fps;
+
+    if (frameInterval.Count())
+    {
+        std::cout << "Frame cadence at " << fps << " fps: achieved " << 1e9 / frameInterval.Mean() << " fps, "
+        << lateFrames << " late frames (gap over 1.5 periods)." << std::endl;
+        frameInterval.Print("Frame interval", "ms", 1000000.0);
+        frameJitter.Print("Frame jitter", "ms", 1000000.0);
+    }
+
+    std::vector<std::pair<std::string, const DurationStats*>> stages = { { "capture", &captureCost }, { "encode", &encodeCost } };
+
+    if (filterStage)
+    {
+        stages.insert(stages.begin() + 1, { "filter", &filterStage->Cost() });
+    }
+
+    std::string weakest;
+    double weakestHeadroom = 2.0;
+
+    std::cout << "Stage headroom at p99 of the " << period / 1e3 << " us frame period:";
+
+    for (auto& stage : stages)
+    {
+        double headroom = 1.0 - stage.second->Percentile(99) / period;
+
+        std::cout << " " << stage.first << " " << (int)(headroom * 100) << "%";
+
+        if (headroom < weakestHeadroom)
+        {
+            weakestHeadroom = headroom;
+            weakest = stage.first;
+        }
+    }
+
+    std::cout << "; " << weakest << (weakestHeadroom < 0 ? " cannot sustain this rate." : " breaks first.") << std::endl;
+}
+
 void ScreenRecord::OpenVideo()
 {
     AVInputFormat *ifmt = const_cast<AVInputFormat*>(av_find_input_format("x11grab"));    
     AVDictionary *options = nullptr;
     AVCodec *decoder = nullptr;
 
+    // Ingested frames are already BGR0 in memory: there is no device to open, only the converter.
+    if (ingestReader)
+    {
+        swsContext = sws_getContext(width, height, AV_PIX_FMT_BGR0, outputWidth, outputHeight, screenContent ? AV_PIX_FMT_YUV444P : AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+        return;
+    }
+
     av_dict_set(&options, "framerate", std::to_string(fps).c_str(), 0);
     av_dict_set(&options, "video_size", std::to_string(width).append("x").append(std::to_string(height)).c_str(), 0);
 
-    if (avformat_open_input(&videoFormatContext, videoDevice.append(".0+").append(std::to_string(widthOffset)).append(",").append(std::to_string(heightOffset)).c_str(), ifmt, &options) != 0)
+    if (cursorTracker)
+    {
+        av_dict_set(&options, "draw_mouse", "0", 0);
+    }
+
+    std::string url = videoDevice + ".0+" + std::to_string(widthOffset) + "," + std::to_string(heightOffset);
+
+    if (avformat_open_input(&videoFormatContext, url.c_str(), ifmt, &options) != 0)
     {
         FATAL("Can't open video input format.");
     }
 
-    if (avformat_find_stream_info(videoFormatContext, nullptr) < 0)
+    // x11grab fills in the complete stream parameters when it opens, so fast start skips the probe.
+    if (!fastStart && avformat_find_stream_info(videoFormatContext, nullptr) < 0)
     {
         FATAL("Can't find video stream informations.");
     }
@@ -188,7 +313,8 @@ void ScreenRecord::OpenVideo()
         FATAL("Can't open video decode context.");
     }
 
-    swsContext = sws_getContext(videoDecodeContext->width, videoDecodeContext->height, videoDecodeContext->pix_fmt, width, height, AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+    // BGR0 input in screen-content mode goes through ConvertBgr0ToYuv444 instead; swscale stays as the fallback.
+    swsContext = sws_getContext(videoDecodeContext->width, videoDecodeContext->height, videoDecodeContext->pix_fmt, outputWidth, outputHeight, screenContent ? AV_PIX_FMT_YUV444P : AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
     return;
 }
 
@@ -208,25 +334,51 @@ static bool check_sample_fmt(const AVCodec *codec, enum AVSampleFormat sample_fm
     return false;
 }
 
-void ScreenRecord::OpenAudio()
+// Encoders that don't list their pixel formats accept anything.
+static bool check_pix_fmt(const AVCodec *codec, enum AVPixelFormat pix_fmt)
+{
+    const enum AVPixelFormat *p = codec->pix_fmts;
+
+    while (p && *p != AV_PIX_FMT_NONE) {
+        if (*p == pix_fmt)
+        {
+            return true;
+        }
+
+        p++;
+    }
+
+    return !codec->pix_fmts;
+}
+
+void ScreenRecord::OpenAudio(AudioSource* source)
 {
     AVCodec *decoder = nullptr;
+    AVDictionary *options = nullptr;
 
-    audioInputFormat = const_cast<AVInputFormat*>(av_find_input_format("pulse"));
+    if (audioFragmentSize > 0)
+    {
+        av_dict_set_int(&options, "fragment_size", audioFragmentSize, 0);
+        av_dict_set_int(&options, "frame_size", audioFragmentSize, 0);
+    }
 
-    if (avformat_open_input(&audioFormatContext, audioDevice.c_str(), audioInputFormat, nullptr) < 0)
+    if (avformat_open_input(&source->formatContext, source->device.c_str(), audioInputFormat, &options) < 0)
     {
+        av_dict_free(&options);
         FATAL("Can't open audio input.");
     }
 
-    if (avformat_find_stream_info(audioFormatContext, nullptr) < 0)
+    av_dict_free(&options);
+
+    // pulse reports sample rate, channels and codec on open as well.
+    if (!fastStart && avformat_find_stream_info(source->formatContext, nullptr) < 0)
     {
         FATAL("Can't find audio stream informations.");
     }
 
-    for (int i = 0; i < audioFormatContext->nb_streams; ++i)
+    for (int i = 0; i < source->formatContext->nb_streams; ++i)
     {
-        AVStream* stream = audioFormatContext->streams[i];
+        AVStream* stream = source->formatContext->streams[i];
 
         if (stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
         {
@@ -237,19 +389,19 @@ void ScreenRecord::OpenAudio()
                 FATAL("Can't find audio decoder.");
             }
             
-            audioDecodeContext = avcodec_alloc_context3(decoder);
+            source->decodeContext = avcodec_alloc_context3(decoder);
 
-            if (avcodec_parameters_to_context(audioDecodeContext, stream->codecpar) < 0)
+            if (avcodec_parameters_to_context(source->decodeContext, stream->codecpar) < 0)
             {
                 FATAL("Can't convert parameters to audio decode context.");
             }
             
-            audioIndex = i;
+            source->index = i;
             break;
         }
     }
 
-    if (avcodec_open2(audioDecodeContext, decoder, NULL) < 0)
+    if (avcodec_open2(source->decodeContext, decoder, NULL) < 0)
     {
         FATAL("Can't open audio decode context.");        
     }
@@ -257,966 +409,2613 @@ void ScreenRecord::OpenAudio()
     return;
 }
 
-void ScreenRecord::OpenOutput()
+void ScreenRecord::OpenVideoEncoder()
 {
-    AVStream* vStream = nullptr;
-    AVStream* aStream = nullptr;
+    // x264 creates its worker threads in avcodec_open2, and they inherit this thread's affinity.
+    placement.Enter("encoder");
 
-    if (avformat_alloc_output_context2(&outFormatContext, nullptr, nullptr, filePath.c_str()) < 0)
-    {
-        FATAL("Can't allocate output format context.");
-    }
+    videoEncodeContext = avcodec_alloc_context3(NULL);
 
-    if (videoFormatContext->streams[videoIndex]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+    if (videoEncodeContext == nullptr)
     {
-        vStream = avformat_new_stream(outFormatContext, nullptr);
-
-        if (!vStream)
-        {
-            FATAL("Can't istantiate a new video stream.");
-        }
+        FATAL("Can't allocate video encode context.");
+    }
 
-        videoOutIndex = vStream->index;
-        vStream->time_base = AVRational{ 1, fps };
+    videoEncodeContext->width = encodeWidth;
+    videoEncodeContext->height = encodeHeight;
+    videoEncodeContext->codec_type = AVMEDIA_TYPE_VIDEO;
+    videoEncodeContext->time_base.num = 1;
+    videoEncodeContext->time_base.den = fps;
+    videoEncodeContext->pix_fmt = screenContent ? AV_PIX_FMT_YUV444P : AV_PIX_FMT_YUV420P;
+    ApplyVideoRateControl(videoEncodeContext, fps);
 
-        videoEncodeContext = avcodec_alloc_context3(NULL);
+    // Ingest pts come from the producer's clock, so they need a finer grid than one tick per frame.
+    if (!ingestPath.empty())
+    {
+        videoEncodeContext->time_base = AVRational{ 1, 1000 };
+        videoEncodeContext->framerate = AVRational{ fps, 1 };
+    }
 
-        if (videoEncodeContext == nullptr)
-        {
-            FATAL("Can't allocate video encode context.");
-        }
+    // Whatever the core budget leaves after the pipeline's own threads goes to x264; 0 lets it decide.
+    if (coreBudget > 0)
+    {
+        int pipelineThreads = 2 + (recordAudio ? audioSources.size() : 0) + (IsMixing() ? 1 : 0) + (filterDescription.empty() ? 0 : 1);
 
-        videoEncodeContext->width = width;
-        videoEncodeContext->height = height;
-        videoEncodeContext->codec_type = AVMEDIA_TYPE_VIDEO;
-        videoEncodeContext->time_base.num = 1;
-        videoEncodeContext->time_base.den = fps;
-        videoEncodeContext->pix_fmt = AV_PIX_FMT_YUV420P;
-        videoEncodeContext->codec_id = AV_CODEC_ID_H264;
-        videoEncodeContext->bit_rate = 800 * 1000;
-        videoEncodeContext->rc_max_rate = 800 * 1000;
-        videoEncodeContext->rc_buffer_size = 500 * 1000;
-        videoEncodeContext->gop_size = 30;
-        videoEncodeContext->max_b_frames = 3;
-        videoEncodeContext->qmin = 10;	
-        videoEncodeContext->qmax = 31;	
-        videoEncodeContext->max_qdiff = 4;
-        videoEncodeContext->me_range = 16;	
-        videoEncodeContext->max_qdiff = 4;	
-        videoEncodeContext->qcompress = 0.6;	
+        videoEncodeContext->thread_count = std::max(1, coreBudget - pipelineThreads);
+        LOG("Core budget " << coreBudget << ": " << pipelineThreads << " pipeline threads, " << videoEncodeContext->thread_count << " encoder threads.");
+    }
 
-        AVCodec *encoder;
-        encoder = const_cast<AVCodec*>(avcodec_find_encoder(videoEncodeContext->codec_id));
+    if (workPool)
+    {
+        videoEncodeContext->thread_count = 1;
+    }
 
-        if (!encoder)
-        {
-            FATAL("Can't find video encoder.");
-        }
+    AVDictionary *options = nullptr;
+    AVCodec *encoder = const_cast<AVCodec*>(spool ? avcodec_find_encoder(AV_CODEC_ID_FFV1) : FindVideoBackend(videoBackend));
 
-        videoEncodeContext->codec_tag = 0;
-        videoEncodeContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (!encoder)
+    {
+        FATAL("Video encoder backend " + videoBackend + " isn't available in this FFmpeg build.");
+    }
 
-        if (avcodec_open2(videoEncodeContext, encoder, nullptr) < 0)
-        {
-            FATAL("Can't open video encode context.");
-        }
+    videoEncodeContext->codec_id = encoder->id;
 
-        if (avcodec_parameters_from_context(vStream->codecpar, videoEncodeContext) < 0)
-        {
-            FATAL("Can't convert parameters from video encode context.");
-        }
+    if (lossless && videoBackend != "x264")
+    {
+        FATAL("Lossless capture needs the x264 backend.");
     }
 
-    if(recordAudio)
+    if (!spool)
     {
-        if (audioFormatContext->streams[audioIndex]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-        {
-            aStream = avformat_new_stream(outFormatContext, NULL);
+        ApplyVideoPreset(videoBackend, encoderPreset, videoEncodeContext, &options);
+    }
 
-            if (!aStream)
-            {
-                FATAL("Can't istantiate a new audio stream.");
-            }
+    // Spool capture: intra-only lossless FFV1, slice-threaded, cheap enough to hold the frame rate;
+    // the H.264 encode happens later in the background transcode.
+    if (spool)
+    {
+        videoEncodeContext->codec_id = AV_CODEC_ID_FFV1;
+        videoEncodeContext->gop_size = 1;
+        videoEncodeContext->max_b_frames = 0;
+        videoEncodeContext->bit_rate = 0;
+        videoEncodeContext->rc_max_rate = 0;
+        videoEncodeContext->rc_buffer_size = 0;
+        videoEncodeContext->thread_type = FF_THREAD_SLICE;
+    }
 
-            audioOutIndex = aStream->index;
+    if (!check_pix_fmt(encoder, videoEncodeContext->pix_fmt))
+    {
+        av_dict_free(&options);
+        FATAL(std::string("Video encoder ") + encoder->name + " doesn't take " + av_get_pix_fmt_name(videoEncodeContext->pix_fmt) + ".");
+    }
 
-            AVCodec *encoder = const_cast<AVCodec*>(avcodec_find_encoder(outFormatContext->oformat->audio_codec));
+    videoEncodeContext->codec_tag = 0;
+    videoEncodeContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    chromaShift = screenContent ? 0 : 1;
 
-            if (!encoder)
-            {
-                FATAL("Can't find audio encoder.");
-            }
+    // x264 treats qp 0 as lossless (High 4:4:4 Predictive); the bitrate caps would only get in the way.
+    if (lossless)
+    {
+        videoEncodeContext->bit_rate = 0;
+        videoEncodeContext->rc_max_rate = 0;
+        videoEncodeContext->rc_buffer_size = 0;
+        videoEncodeContext->qmin = 0;
+        av_dict_set(&options, "qp", "0", 0);
+    }
 
-            audioEncodeContext = avcodec_alloc_context3(encoder);
+    if (spool)
+    {
+        av_dict_set(&options, "level", "3", 0);
+    }
 
-            if (videoEncodeContext == nullptr)
-            {
-                FATAL("Can't allocate audio encode context.");
-            }
+    // x264 holds its look-ahead, B-frames and one frame per thread as whole pictures. Under a budget
+    // they share a quarter of it: automatic threading is capped to fit first, then the look-ahead gets
+    // what is left, within the latency target.
+    if (memory.Budget() && !spool)
+    {
+        size_t frameBytes = av_image_get_buffer_size(videoEncodeContext->pix_fmt, encodeWidth, encodeHeight, 1);
+        int64_t quarter = memory.Budget() / 4 / frameBytes;
+        int threads = videoEncodeContext->thread_count;
+        int lookahead = 0;
 
-            audioEncodeContext->sample_fmt = encoder->sample_fmts ? encoder->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
-            audioEncodeContext->bit_rate = audioBitrate;
-            audioEncodeContext->sample_rate = 44100;
+        if (threads <= 0)
+        {
+            threads = (int)std::max<int64_t>(1, std::min<int64_t>(std::thread::hardware_concurrency() * 3 / 2, quarter - videoEncodeContext->max_b_frames - 1));
+            videoEncodeContext->thread_count = threads;
+        }
 
-            if (encoder->supported_samplerates)
-            {
-                audioEncodeContext->sample_rate = encoder->supported_samplerates[0];
+        if (videoBackend == "x264" && encoderPreset != EncoderPreset::Realtime)
+        {
+            int64_t fit = quarter - videoEncodeContext->max_b_frames - threads - 1;
 
-                for (int i = 0; encoder->supported_samplerates[i]; ++i)
-                {
-                    if (encoder->supported_samplerates[i] == 44100)
-                    {
-                        audioEncodeContext->sample_rate = 44100;
-                    }
-                }
-            }
+            lookahead = (int)std::max<int64_t>(0, std::min<int64_t>({ 40, fit, (int64_t)fps * latencyTarget / 1000 }));
+            av_dict_set_int(&options, "rc-lookahead", lookahead, 0);
+        }
 
-            audioEncodeContext->channels = av_get_channel_layout_nb_channels(audioEncodeContext->channel_layout);
-            audioEncodeContext->channel_layout = AV_CH_LAYOUT_STEREO;
+        memory.Reserve(MemoryStage::Encoder, (lookahead + videoEncodeContext->max_b_frames + threads + 1) * frameBytes);
+    }
 
-            if (encoder->channel_layouts)
-            {
-                audioEncodeContext->channel_layout = encoder->channel_layouts[0];
+    if (avcodec_open2(videoEncodeContext, encoder, &options) < 0)
+    {
+        av_dict_free(&options);
+        FATAL("Can't open video encode context.");
+    }
 
-                for (int i = 0; encoder->channel_layouts[i]; ++i)
-                {
-                    if (encoder->channel_layouts[i] == AV_CH_LAYOUT_STEREO)
-                    {
-                        audioEncodeContext->channel_layout = AV_CH_LAYOUT_STEREO;
-                    }
-                }
-            }
+    av_dict_free(&options);
+    placement.Leave("encoder");
+}
 
-            audioEncodeContext->channels = av_get_channel_layout_nb_channels(audioEncodeContext->channel_layout);
-            aStream->time_base = AVRational{ 1, audioEncodeContext->sample_rate };
+void ScreenRecord::OpenAudioEncoder()
+{
+    AVOutputFormat *oformat = const_cast<AVOutputFormat*>(av_guess_format(nullptr, filePath.c_str(), nullptr));
 
-            audioEncodeContext->codec_tag = 0;
-            audioEncodeContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (!oformat)
+    {
+        FATAL("Can't guess output format from the file name.");
+    }
 
-            if (!check_sample_fmt(encoder, audioEncodeContext->sample_fmt))
-            {
-                FATAL("Audio encoder sample format not supported by the audio encode context.");
-            }
+    AVCodec *encoder = const_cast<AVCodec*>(audioBackend.empty() ? avcodec_find_encoder(oformat->audio_codec) : FindAudioBackend(audioBackend));
 
-            if (avcodec_open2(audioEncodeContext, encoder, 0) < 0)
-            {
-                FATAL("Can't open audio encode context");
-            }
+    if (!encoder)
+    {
+        FATAL(audioBackend.empty() ? "Can't find audio encoder." : "Audio encoder backend " + audioBackend + " isn't available in this FFmpeg build.");
+    }
 
-            if (avcodec_parameters_from_context(aStream->codecpar, audioEncodeContext) < 0)
-            {
-                FATAL("Can't convert parameters from audio encode context.");
-            }
+    audioEncodeContext = avcodec_alloc_context3(encoder);
 
-            swrContext = swr_alloc();
-            if (!swrContext)
-            {
-                FATAL("Can't allocate swr context.");
-            }
+    if (audioEncodeContext == nullptr)
+    {
+        FATAL("Can't allocate audio encode context.");
+    }
 
-            av_opt_set_int(swrContext, "in_channel_count", audioDecodeContext->channels, 0);	
-            av_opt_set_int(swrContext, "in_sample_rate", audioDecodeContext->sample_rate, 0);	
-            av_opt_set_sample_fmt(swrContext, "in_sample_fmt", audioDecodeContext->sample_fmt, 0);
+    audioEncodeContext->sample_fmt = encoder->sample_fmts ? encoder->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+    audioEncodeContext->bit_rate = audioBitrate;
+    audioEncodeContext->sample_rate = 44100;
 
-            av_opt_set_int(swrContext, "out_channel_count", audioEncodeContext->channels, 0);	
-            av_opt_set_int(swrContext, "out_sample_rate", audioEncodeContext->sample_rate, 0);
-            av_opt_set_sample_fmt(swrContext, "out_sample_fmt", audioEncodeContext->sample_fmt, 0);	
+    if (encoder->supported_samplerates)
+    {
+        audioEncodeContext->sample_rate = encoder->supported_samplerates[0];
 
-            if (swr_init(swrContext) < 0)
+        for (int i = 0; encoder->supported_samplerates[i]; ++i)
+        {
+            if (encoder->supported_samplerates[i] == 44100)
             {
-                FATAL("Can't initialise swr context.");
+                audioEncodeContext->sample_rate = 44100;
             }
         }
     }
-    
 
-    if (!(outFormatContext->oformat->flags & AVFMT_NOFILE))
+    audioEncodeContext->channel_layout = AV_CH_LAYOUT_STEREO;
+
+    if (encoder->channel_layouts)
     {
-        if (avio_open(&outFormatContext->pb, filePath.c_str(), AVIO_FLAG_WRITE) < 0)
+        audioEncodeContext->channel_layout = encoder->channel_layouts[0];
+
+        for (int i = 0; encoder->channel_layouts[i]; ++i)
         {
-            FATAL("Can't open given file path.");
+            if (encoder->channel_layouts[i] == AV_CH_LAYOUT_STEREO)
+            {
+                audioEncodeContext->channel_layout = AV_CH_LAYOUT_STEREO;
+            }
         }
     }
 
-    if (avformat_write_header(outFormatContext, nullptr) < 0)
+    audioEncodeContext->channels = av_get_channel_layout_nb_channels(audioEncodeContext->channel_layout);
+    audioEncodeContext->time_base = AVRational{ 1, audioEncodeContext->sample_rate };
+
+    audioEncodeContext->codec_tag = 0;
+    audioEncodeContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if (!check_sample_fmt(encoder, audioEncodeContext->sample_fmt))
     {
-        FATAL("Can't write header to output format context.");
+        FATAL("Audio encoder sample format not supported by the audio encode context.");
     }
 
-    return;
-}
+    AVDictionary *options = nullptr;
 
-AVFrame* ScreenRecord::AllocAudioFrame(AVCodecContext* c, int nbSamples)
-{
-    AVFrame *frame = av_frame_alloc();
+    ApplyAudioPreset(audioBackend, encoderPreset, audioEncodeContext, &options);
 
-    frame->format = c->sample_fmt;
-    frame->channel_layout = c->channel_layout ? c->channel_layout : AV_CH_LAYOUT_STEREO;
-    frame->sample_rate = c->sample_rate;
-    frame->nb_samples = nbSamples;
+    // Opus in MP4 is still flagged experimental in this FFmpeg.
+    if (encoder->id == AV_CODEC_ID_OPUS)
+    {
+        audioEncodeContext->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+    }
 
-    if (nbSamples)
+    if (avcodec_open2(audioEncodeContext, encoder, &options) < 0)
     {
-        if (av_frame_get_buffer(frame, 0) < 0)
-        {
-            return nullptr;
-        }
+        av_dict_free(&options);
+        FATAL("Can't open audio encode context");
     }
 
-    return frame;
+    av_dict_free(&options);
 }
 
-void ScreenRecord::InitVideoBuffer()
+void ScreenRecord::OpenOutput()
 {
-    videoOutFrameSize = av_image_get_buffer_size(videoEncodeContext->pix_fmt, width, height, 1);
-    videoOutFrameBuffer = (uint8_t *)av_malloc(videoOutFrameSize);
-    videoOutFrame = av_frame_alloc();
+    // Nothing is muxed during a burst; frames go to the raw spool and are encoded afterwards.
+    if (burstSeconds > 0)
+    {
+        return;
+    }
 
-    av_image_fill_arrays(videoOutFrame->data, videoOutFrame->linesize, videoOutFrameBuffer, videoEncodeContext->pix_fmt, width, height, 1);
-    videoFifoBuffer = av_fifo_alloc_array(30, videoOutFrameSize);
+    AVStream* vStream = nullptr;
+    AVStream* aStream = nullptr;
 
-    if (!videoFifoBuffer)
+    if (avformat_alloc_output_context2(&outFormatContext, nullptr, nullptr, OutputPath().c_str()) < 0)
     {
-        LOG("Can't allocate video fifo buffer.");
-        return;
+        FATAL("Can't allocate output format context.");
     }
-}
 
-void ScreenRecord::InitAudioBuffer()
-{
-    numberOfSamples = audioEncodeContext->frame_size;
+    vStream = avformat_new_stream(outFormatContext, nullptr);
 
-    if (!numberOfSamples)
+    if (!vStream)
     {
-        numberOfSamples = 1024;
+        FATAL("Can't istantiate a new video stream.");
     }
 
-    audioFifoBuffer = av_audio_fifo_alloc(audioEncodeContext->sample_fmt, audioEncodeContext->channels, 30 * numberOfSamples);
+    if (recordAudio && audioEncodeContext->codec_id == AV_CODEC_ID_OPUS)
+    {
+        outFormatContext->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+    }
 
-    if (!audioFifoBuffer)
+    // By default the muxer waits up to 10 s for a lagging stream; under a budget, up to the latency target.
+    if (memory.Budget())
     {
-        LOG("Can't allocate audio fifo buffer.");
-        return;
+        outFormatContext->max_interleave_delta = (int64_t)latencyTarget * 1000;
     }
-}
 
-void ScreenRecord::FlushVideoDecoder()
-{
-    int ret = -1;
-    int size = width * height;
-    AVFrame	*oldFrame = av_frame_alloc();
-    AVFrame *newFrame = av_frame_alloc();
+    videoOutIndex = vStream->index;
+    vStream->time_base = videoEncodeContext->time_base;
 
-    ret = avcodec_send_packet(videoDecodeContext, nullptr);
-    
-    if (ret != 0)
+    if (avcodec_parameters_from_context(vStream->codecpar, videoEncodeContext) < 0)
     {
-        FATAL("Can't send packet to the video decode context.");
-        return;
+        FATAL("Can't convert parameters from video encode context.");
     }
 
-    while (ret >= 0)
+    if(recordAudio)
     {
-        ret = avcodec_receive_frame(videoDecodeContext, oldFrame);
-        
-        if (ret < 0)
-        {
-            if (ret == AVERROR_EOF)
-            {
-                LOG("AVERROR_EOF");
-                break;
-            }
+        aStream = avformat_new_stream(outFormatContext, NULL);
 
-            FATAL("Can't receive fram from the video decode context.")
-            return;
+        if (!aStream)
+        {
+            FATAL("Can't istantiate a new audio stream.");
         }
 
-        sws_scale(swsContext, (const uint8_t* const*)oldFrame->data, oldFrame->linesize, 0, videoEncodeContext->height, newFrame->data, newFrame->linesize);
+        audioOutIndex = aStream->index;
+        aStream->time_base = AVRational{ 1, audioEncodeContext->sample_rate };
 
+        if (avcodec_parameters_from_context(aStream->codecpar, audioEncodeContext) < 0)
         {
-            std::unique_lock<std::mutex> lk(mutexVideoBuffer);
-            cvVideoBufferNotFull.wait(lk, [this] { return av_fifo_space(this->videoFifoBuffer) >= this->videoOutFrameSize; });
+            FATAL("Can't convert parameters from audio encode context.");
         }
+    }
 
-        av_fifo_generic_write(videoFifoBuffer, newFrame->data[0], size, NULL);
-        av_fifo_generic_write(videoFifoBuffer, newFrame->data[1], size / 4, NULL);
-        av_fifo_generic_write(videoFifoBuffer, newFrame->data[2], size / 4, NULL);
-        cvVideoBufferNotEmpty.notify_one();
+    if (!(outFormatContext->oformat->flags & AVFMT_NOFILE))
+    {
+        if (avio_open(&outFormatContext->pb, OutputPath().c_str(), AVIO_FLAG_WRITE) < 0)
+        {
+            FATAL("Can't open given file path.");
+        }
     }
 
-    av_frame_free(&oldFrame);
-    av_frame_free(&newFrame);
-}
+    if (avformat_write_header(outFormatContext, nullptr) < 0)
+    {
+        FATAL("Can't write header to output format context.");
+    }
 
-void ScreenRecord::FlushAudioDecoder()
-{
-    int ret = -1;
-    int dstNbSamples, maxDstNbSamples;
-    AVFrame *rawFrame = av_frame_alloc();
-    AVFrame *newFrame = AllocAudioFrame(audioEncodeContext, numberOfSamples);
-    AVPacket *pkt = av_packet_alloc();
+    if (egress)
+    {
+        egress->SetStreams(outFormatContext);
+    }
 
-    av_init_packet(pkt);
-    
-    maxDstNbSamples = dstNbSamples = av_rescale_rnd(numberOfSamples, audioEncodeContext->sample_rate, audioDecodeContext->sample_rate, AV_ROUND_UP);
+    muxMeter.Reset(outFormatContext->nb_streams, outFormatContext->max_interleave_delta);
+    memory.Set(MemoryStage::Muxer, 0);
 
-    ret = avcodec_send_packet(audioDecodeContext, nullptr);
+    return;
+}
 
-    if (ret != 0)
+// Indexed by ScreenRecord::AudioConversion.
+static const char* AudioConversionNames[] = { "resampler", "direct", "float deinterleave", "s16 to float deinterleave" };
+
+static SwrContext* AllocResampler(AVCodecContext* in, AVCodecContext* out, AVSampleFormat outFormat)
+{
+    SwrContext* swr = swr_alloc();
+
+    if (!swr)
     {
-        FATAL("Can't send packet to the audio decode context.");
-        return;
+        return nullptr;
     }
-    while (ret >= 0)
-    {
-        ret = avcodec_receive_frame(audioDecodeContext, rawFrame);
 
-        if (ret < 0)
-        {
-            if (ret == AVERROR_EOF)
-            {
-                LOG("AVERROR_EOF");
-                break;
-            }
+    av_opt_set_int(swr, "in_channel_count", in->channels, 0);	
+    av_opt_set_int(swr, "in_sample_rate", in->sample_rate, 0);	
+    av_opt_set_sample_fmt(swr, "in_sample_fmt", in->sample_fmt, 0);
 
-            FATAL("Can't receive frame from the audio decode context.");
-            return;
-        }
+    av_opt_set_int(swr, "out_channel_count", out->channels, 0);	
+    av_opt_set_int(swr, "out_sample_rate", out->sample_rate, 0);
+    av_opt_set_sample_fmt(swr, "out_sample_fmt", outFormat, 0);	
 
-        dstNbSamples = av_rescale_rnd(swr_get_delay(swrContext, audioDecodeContext->sample_rate) + rawFrame->nb_samples, audioEncodeContext->sample_rate, audioDecodeContext->sample_rate, AV_ROUND_UP);
+    if (swr_init(swr) < 0)
+    {
+        swr_free(&swr);
+    }
 
-        if (dstNbSamples > maxDstNbSamples)
-        {
-            av_freep(&newFrame->data[0]);
-            ret = av_samples_alloc(newFrame->data, newFrame->linesize, audioEncodeContext->channels, dstNbSamples, audioEncodeContext->sample_fmt, 1);
+    return swr;
+}
 
-            if (ret < 0)
-            {
-                FATAL("Can't allocate audio samples.");
-                return;
-            }
+// Mean time per 1024-sample packet of silence through a fresh resampler and through the bypass kernel,
+// so the saving is reported at start even though only one of the two runs afterwards.
+static void CompareAudioPaths(AVCodecContext* in, AVCodecContext* out, AVSampleFormat outFormat, bool s16, double* swrUs, double* bypassUs)
+{
+    const int Samples = 1024, Rounds = 200;
+    int channels = in->channels;
+    SwrContext* swr = AllocResampler(in, out, outFormat);
+    std::vector<uint8_t> packed(Samples * channels * av_get_bytes_per_sample(in->sample_fmt));
+    std::vector<float> planar(Samples * channels);
+    std::vector<float*> planes(channels);
+    const uint8_t* input = packed.data();
+
+    for (int c = 0; c < channels; ++c)
+    {
+        planes[c] = &planar[c * Samples];
+    }
 
-            maxDstNbSamples = dstNbSamples;
-            audioEncodeContext->frame_size = dstNbSamples;
-            numberOfSamples = newFrame->nb_samples;
-        }
+    auto begin = std::chrono::steady_clock::now();
 
-        newFrame->nb_samples = swr_convert(swrContext, newFrame->data, dstNbSamples, (const uint8_t **)rawFrame->data, rawFrame->nb_samples);
+    for (int i = 0; swr && i < Rounds; ++i)
+    {
+        swr_convert(swr, (uint8_t**)planes.data(), Samples, &input, Samples);
+    }
 
-        if (newFrame->nb_samples < 0)
-        {
-            FATAL("Can't convert raw audio frame to new audio frame.");
-            return;
-        }
+    auto middle = std::chrono::steady_clock::now();
 
+    for (int i = 0; i < Rounds; ++i)
+    {
+        if (s16)
         {
-            std::unique_lock<std::mutex> lk(mutexAudioBuffer);
-            cvAudioBufferNotFull.wait(lk, [newFrame, this] { return av_audio_fifo_space(this->audioFifoBuffer) >= newFrame->nb_samples; });
+            DeinterleaveS16ToFloat((const int16_t*)input, planes.data(), channels, Samples);
         }
-
-        if (av_audio_fifo_write(audioFifoBuffer, (void **)newFrame->data, newFrame->nb_samples) < newFrame->nb_samples)
+        else
         {
-            FATAL("Can't write the new frame to the audio fifo buffer.");
-            return;
+            DeinterleaveFloat((const float*)input, planes.data(), channels, Samples);
         }
-
-        cvAudioBufferNotEmpty.notify_one();
     }
 
-    av_frame_free(&rawFrame);
-    av_frame_free(&newFrame);
+    auto end = std::chrono::steady_clock::now();
+
+    *swrUs = std::chrono::duration_cast<std::chrono::nanoseconds>(middle - begin).count() / 1000.0 / Rounds;
+    *bypassUs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - middle).count() / 1000.0 / Rounds;
+    swr_free(&swr);
 }
 
-int* ScreenRecord::FlushEncoders()
+// Times the BGR0 kernel for this capture and swscale on the same synthetic frame, so the report has
+// figures for both paths whichever one the recording took. In us per frame.
+static void CompareVideoPaths(int width, int height, int outWidth, int outHeight, bool screenContent, int shift, double* swsUs, double* kernelUs)
 {
-    int ret = -1;
-    int nFlush = 2;
-    bool vBeginFlush = false;
-    bool aBeginFlush = false;
-    int flushedAudioCount = 0;
-    int flushedVideoCount = 0;
-    int totalFrameWritten = 0;
-    
-    videoCurrentPts = 0;
-    audioCurrentPts = 0;
+    const int Rounds = 10;
+    AVPixelFormat outFormat = screenContent ? AV_PIX_FMT_YUV444P : AV_PIX_FMT_YUV420P;
+    SwsContext* sws = sws_getContext(width, height, AV_PIX_FMT_BGR0, outWidth, outHeight, outFormat, SWS_FAST_BILINEAR, nullptr, nullptr, nullptr);
+    uint8_t* in[4] = { nullptr };
+    uint8_t* out[4] = { nullptr };
+    int inStride[4], outStride[4];
 
-    while (1)
+    *swsUs = 0;
+    *kernelUs = 0;
+
+    if (!sws || av_image_alloc(in, inStride, width, height, AV_PIX_FMT_BGR0, 64) < 0 || av_image_alloc(out, outStride, outWidth, outHeight, outFormat, 64) < 0)
     {
-        AVPacket* pkt = av_packet_alloc();
-        av_init_packet(pkt);
+        av_freep(&in[0]);
+        sws_freeContext(sws);
+        return;
+    }
 
-        if (recordAudio && av_compare_ts(audioCurrentPts, outFormatContext->streams[audioOutIndex]->time_base, videoCurrentPts, outFormatContext->streams[videoOutIndex]->time_base) <= 0)
-        {
-            if (!aBeginFlush)
-            {
-                aBeginFlush = true;
-                ret = avcodec_send_frame(audioEncodeContext, NULL);
+    memset(in[0], 0x80, (size_t)inStride[0] * height);
 
-                if (ret != 0)
-                {
-                    FATAL("Can't send frame to the audio encode context.");
-                    return nullptr;
-                }
-            }
-            ret = avcodec_receive_packet(audioEncodeContext, pkt);
+    auto begin = std::chrono::steady_clock::now();
 
-            if (ret < 0)
-            {
-                av_packet_unref(pkt);
-                if (ret == AVERROR(EAGAIN))
-                {
-                    LOG("AVERROR(EAGAIN)");
-                    continue;
-                }
-                else if (ret == AVERROR_EOF)
-                {
-                    if (!(--nFlush)) 
-                    {
-                        break;
-                    }
+    for (int i = 0; i < Rounds; ++i)
+    {
+        sws_scale(sws, (const uint8_t* const*)in, inStride, 0, height, out, outStride);
+    }
 
-                    audioCurrentPts = INT_MAX;
+    auto middle = std::chrono::steady_clock::now();
 
-                    LOG("AVERROR_EOF");
-                    continue;
-                }
+    for (int i = 0; i < Rounds; ++i)
+    {
+        if (screenContent)
+        {
+            ConvertBgr0ToYuv444(in[0], inStride[0], out, outStride, outWidth, outHeight);
+        }
+        else
+        {
+            ConvertBgr0ToI420Downscale(in[0], inStride[0], out, outStride, outWidth, outHeight, shift);
+        }
+    }
 
-                FATAL("Can't receive packet from the audio encode context.");
-                return nullptr;
-            }
+    auto end = std::chrono::steady_clock::now();
 
-            pkt->stream_index = audioOutIndex;
+    *swsUs = std::chrono::duration_cast<std::chrono::nanoseconds>(middle - begin).count() / 1000.0 / Rounds;
+    *kernelUs = std::chrono::duration_cast<std::chrono::nanoseconds>(end - middle).count() / 1000.0 / Rounds;
+    av_freep(&in[0]);
+    av_freep(&out[0]);
+    sws_freeContext(sws);
+}
 
-            av_packet_rescale_ts(pkt, audioEncodeContext->time_base, outFormatContext->streams[audioOutIndex]->time_base);
-            audioCurrentPts = pkt->pts;
+void ScreenRecord::InitResampler(AudioSource* source)
+{
+    // When mixing, every source is resampled to planar float and summed by the mixer before the fifo.
+    AVSampleFormat outFormat = IsMixing() ? AV_SAMPLE_FMT_FLTP : audioEncodeContext->sample_fmt;
+    AVCodecContext* in = source->decodeContext;
 
-            av_interleaved_write_frame(outFormatContext, pkt);
+    // Still needed for the decoder flush at stop, whichever path the live packets take.
+    source->swrContext = AllocResampler(in, audioEncodeContext, outFormat);
 
-            totalFrameWritten++;
-            flushedAudioCount++;
-            
-            av_packet_free(&pkt);
-        }
-        else
-        {
-            if (!vBeginFlush)
-            {
-                vBeginFlush = true;
-                ret = avcodec_send_frame(videoEncodeContext, NULL);
+    if (!source->swrContext)
+    {
+        FATAL("Can't initialise swr context.");
+    }
 
-                if (ret != 0)
-                {
-                    FATAL("Can't send frame to the video encode context.");
-                    return nullptr;
-                }
-            }
+    // Mixed sources other than the master need the resampler's drift compensation.
+    bool sameClock = in->sample_rate == audioEncodeContext->sample_rate && in->channels == audioEncodeContext->channels;
+    bool samePacking = in->sample_fmt == outFormat || (in->channels == 1 && av_get_packed_sample_fmt(in->sample_fmt) == av_get_packed_sample_fmt(outFormat));
 
-            ret = avcodec_receive_packet(videoEncodeContext, pkt);
+    source->conversion = AudioConversion::Resample;
 
-            if (ret < 0)
-            {
-                av_packet_unref(pkt);
-                if (ret == AVERROR(EAGAIN))
-                {
-                    LOG("AVERROR(EAGAIN)");
-                    continue;
-                }
-                else if (ret == AVERROR_EOF)
-                {
-                    if (!(--nFlush)) 
-                    {
-                        break;
-                    }
+    if (resamplerBypass && sameClock && !(IsMixing() && source->id > 0))
+    {
+        if (samePacking)
+        {
+            source->conversion = AudioConversion::Direct;
+        }
+        else if (in->sample_fmt == AV_SAMPLE_FMT_FLT && outFormat == AV_SAMPLE_FMT_FLTP)
+        {
+            source->conversion = AudioConversion::DeinterleaveFloat;
+        }
+        else if (in->sample_fmt == AV_SAMPLE_FMT_S16 && outFormat == AV_SAMPLE_FMT_FLTP)
+        {
+            source->conversion = AudioConversion::DeinterleaveS16;
+        }
+    }
 
-                    videoCurrentPts = INT_MAX;
+    if (source->conversion == AudioConversion::DeinterleaveFloat || source->conversion == AudioConversion::DeinterleaveS16)
+    {
+        double swrUs, bypassUs;
 
-                    LOG("AVERROR_EOF");
-                    continue;
-                }
+        CompareAudioPaths(in, audioEncodeContext, outFormat, source->conversion == AudioConversion::DeinterleaveS16, &swrUs, &bypassUs);
+        LOG("Audio source " << source->id << ": " << AudioConversionNames[(int)source->conversion] << " instead of the resampler, " << bypassUs << " us against " << swrUs << " us per 1024 samples.");
+    }
+    else
+    {
+        LOG("Audio source " << source->id << ": " << AudioConversionNames[(int)source->conversion] << ".");
+    }
+}
 
-                FATAL("Can't receive packet from the video encode context.");
-                return nullptr; 
-            }
+AVFrame* ScreenRecord::AllocAudioFrame(AVSampleFormat format, int nbSamples)
+{
+    AVFrame *frame = av_frame_alloc();
 
-            pkt->stream_index = videoOutIndex;
-            
-            av_packet_rescale_ts(pkt, videoEncodeContext->time_base, outFormatContext->streams[videoOutIndex]->time_base);
+    frame->format = format;
+    frame->channel_layout = captureFormat.channelLayout ? captureFormat.channelLayout : AV_CH_LAYOUT_STEREO;
+    frame->sample_rate = captureFormat.sampleRate;
+    frame->nb_samples = nbSamples;
 
-            videoCurrentPts = pkt->pts;
+    if (nbSamples)
+    {
+        if (av_frame_get_buffer(frame, 0) < 0)
+        {
+            return nullptr;
+        }
+    }
 
-            av_interleaved_write_frame(outFormatContext, pkt);
+    return frame;
+}
 
-            totalFrameWritten++;
-            flushedVideoCount++;
+AVFrame* ScreenRecord::AcquireAudioFrame()
+{
+    AVFrame *frame = audioFramePool->Acquire();
 
-            av_packet_free(&pkt);
+    // Pooled frames keep their sample buffer between iterations; only a change in frame size reallocates it.
+    if (frame->buf[0] && frame->nb_samples == numberOfSamples)
+    {
+        if (av_frame_make_writable(frame) < 0)
+        {
+            audioFramePool->Release(frame);
+            return nullptr;
         }
+
+        return frame;
     }
 
-    std::cout << "Finished flushing encoders." << std::endl;
+    av_frame_unref(frame);
 
-    int* flushed = new int[3];
-    flushed[0] = flushedAudioCount;
-    flushed[1] = flushedVideoCount;
-    flushed[2] = totalFrameWritten;
+    frame->nb_samples = numberOfSamples;
+    frame->channel_layout = audioEncodeContext->channel_layout;
+    frame->format = audioEncodeContext->sample_fmt;
+    frame->sample_rate = audioEncodeContext->sample_rate;
 
-    return flushed;
+    if (av_frame_get_buffer(frame, 0) < 0)
+    {
+        audioFramePool->Release(frame);
+        return nullptr;
+    }
+
+    return frame;
 }
 
-void ScreenRecord::Release()
+void ScreenRecord::InitVideoBuffer()
 {
-    if (videoOutFrame)
+    // Rows and planes 64-byte aligned, in the queue records as in the capture and mux frames.
+    videoImageSize = av_image_get_buffer_size(videoEncodeContext->pix_fmt, encodeWidth, encodeHeight, FrameArena::Alignment);
+    videoOutFrameSize = videoImageSize;
+
+    // The macroblock map travels in the same fifo record, right behind the picture it describes.
+    if (roiEnabled)
     {
-        av_frame_free(&videoOutFrame);
-        videoOutFrame = nullptr;
+        roiAnalyzer = new RoiAnalyzer(encodeWidth, encodeHeight);
+        roiMap.resize(roiAnalyzer->MapSize());
+        roiRegions.resize(roiAnalyzer->MapSize());
+        videoOutFrameSize += roiAnalyzer->MapSize();
     }
-    
-    if (videoOutFrameBuffer)
+
+    // An ingested frame's timestamp travels last in the record, so frames a filter adds or drops, or
+    // a budget cap drops, take their own timestamps with them.
+    if (ingestReader)
     {
-        av_free(videoOutFrameBuffer);
-        videoOutFrameBuffer = nullptr;
+        videoOutFrameSize += sizeof(int64_t);
     }
-    
-    if (outFormatContext)
+
+    int captureFrameSize = av_image_get_buffer_size(videoEncodeContext->pix_fmt, outputWidth, outputHeight, FrameArena::Alignment);
+
+    memory.Reserve(MemoryStage::Capture, (size_t)captureFrameSize + videoOutFrameSize);
+
+    if (memory.Budget())
     {
-        avio_close(outFormatContext->pb);
-        avformat_free_context(outFormatContext);
-        outFormatContext = nullptr;
+        // The latency target in frames, as far as the budget left by every other stage allows.
+        size_t fit = memory.Available() / FrameRing::Stride(videoOutFrameSize);
+
+        videoFifoFrames = (int)std::min<size_t>(std::max(2, fps * latencyTarget / 1000), fit);
+
+        if (videoFifoFrames < 2)
+        {
+            FATAL("A memory budget of " + std::to_string(memory.Budget() >> 20) + " MB leaves no room for two " + std::to_string(encodeWidth) + "x"
+                + std::to_string(encodeHeight) + " frames (" + std::to_string(videoOutFrameSize >> 20) + " MB each) after the other stages.");
+        }
+
+        LOG("Memory budget " << (memory.Budget() >> 20) << " MB, latency target " << latencyTarget << " ms: video queue of " << videoFifoFrames << " frames.");
+    }
+    else
+    {
+        // 30 frames is a second at the default rate; high frame rates keep at least half a second of slack.
+        videoFifoFrames = std::max(30, fps / 2);
     }
 
-    if (recordAudio && audioDecodeContext)
+    memory.Reserve(MemoryStage::VideoQueue, (size_t)videoFifoFrames * FrameRing::Stride(videoOutFrameSize));
+
+    if (hugePages)
     {
-        avcodec_free_context(&audioDecodeContext);
-        audioDecodeContext = nullptr;
+        size_t ringSize = videoFifoFrames * FrameRing::Stride(videoOutFrameSize);
+
+        size_t filterSize = filterStage ? filterStage->QueueBytes() : 0;
+
+        frameArena = new FrameArena(ringSize + videoOutFrameSize + captureFrameSize + filterSize + 3 * FrameArena::Alignment);
+        videoOutFrameBuffer = frameArena->Allocate(videoOutFrameSize);
+        captureFrameBuffer = frameArena->Allocate(captureFrameSize);
+        videoRing = new FrameRing(frameArena->Allocate(ringSize), videoFifoFrames, videoOutFrameSize);
+
+        if (filterStage)
+        {
+            filterStage->UseArena(frameArena);
+        }
+
+        // Runs from Arm() or the first Start(), before the capture threads touch any of it.
+        frameArena->Prefault();
     }
-    
-    if (videoEncodeContext)
+    else
     {
-        avcodec_free_context(&videoEncodeContext);
-        videoEncodeContext = nullptr;
+        videoOutFrameBuffer = (uint8_t *)av_malloc(videoOutFrameSize);
+        captureFrameBuffer = (uint8_t *)av_malloc(captureFrameSize);
+        videoRing = new FrameRing(nullptr, videoFifoFrames, videoOutFrameSize);
     }
 
-    if (recordAudio && audioEncodeContext)
+    videoOutFrame = av_frame_alloc();
+
+    av_image_fill_arrays(videoOutFrame->data, videoOutFrame->linesize, videoOutFrameBuffer, videoEncodeContext->pix_fmt, encodeWidth, encodeHeight, FrameArena::Alignment);
+    packetPool = new PacketPool(4);
+
+    // Grabbed packets waiting for a pool slice; x11grab hands out refcounted buffers, so a queued packet is only a reference.
+    if (workPool)
     {
-        avcodec_free_context(&audioEncodeContext);
-        audioEncodeContext = nullptr;
+        for (int i = 0; i < 8; ++i)
+        {
+            sliceQueue.push_back(av_packet_alloc());
+        }
+
+        slicePacket = av_packet_alloc();
+        sliceFrame = av_frame_alloc();
+        sliceHead = sliceCount = 0;
+        sliceFrameIndex = 0;
     }
+}
+
+void ScreenRecord::InitAudioBuffer()
+{
+    numberOfSamples = audioEncodeContext->frame_size;
 
-    if (videoFifoBuffer)
+    if (!numberOfSamples)
     {
-        av_fifo_freep(&videoFifoBuffer);
-        videoFifoBuffer = nullptr;
+        numberOfSamples = 1024;
     }
 
-    if (recordAudio && audioFifoBuffer)
+    // Under a budget the queue holds the latency target, rounded up to whole encoder frames.
+    if (memory.Budget())
     {
-        av_audio_fifo_free(audioFifoBuffer);
-        audioFifoBuffer = nullptr;
+        audioBufferDepth = std::max(2, (int)(((int64_t)latencyTarget * audioEncodeContext->sample_rate / 1000 + numberOfSamples - 1) / numberOfSamples));
     }
 
-    if (videoFormatContext)
+    audioFrameBytes = av_samples_get_buffer_size(nullptr, audioEncodeContext->channels, 1, audioEncodeContext->sample_fmt, 1);
+    audioFifoBuffer = av_audio_fifo_alloc(audioEncodeContext->sample_fmt, audioEncodeContext->channels, audioBufferDepth * numberOfSamples);
+    audioFramePool = new FramePool(2);
+
+    if (IsMixing())
     {
-        avformat_close_input(&videoFormatContext);
-        videoFormatContext = nullptr;
+        audioMixer = new AudioMixer(audioEncodeContext->channels, numberOfSamples, audioEncodeContext->sample_rate);
+
+        for (AudioSource* source : audioSources)
+        {
+            source->ring = new SampleRing(audioEncodeContext->channels, 16 * numberOfSamples);
+            audioMixer->AddSource(source->ring, source->gain);
+        }
     }
 
-    if (recordAudio && audioFormatContext)
+    memory.Reserve(MemoryStage::AudioQueue, ((size_t)audioBufferDepth + (IsMixing() ? 16 * audioSources.size() : 0)) * numberOfSamples * audioFrameBytes);
+
+    if (!audioFifoBuffer)
     {
-        avformat_close_input(&audioFormatContext);
-        audioFormatContext = nullptr;
+        LOG("Can't allocate audio fifo buffer.");
+        return;
     }
 }
 
-void ScreenRecord::MuxThreadProc()
+void ScreenRecord::FlushVideoDecoder()
 {
     int ret = -1;
-    bool done = false;
-    int vFrameIndex = 0, aFrameIndex = 0;
-
-    avdevice_register_all();
+    AVFrame	*oldFrame = av_frame_alloc();
+    AVFrame *newFrame = av_frame_alloc();
 
-    OpenVideo();
+    av_image_fill_arrays(newFrame->data, newFrame->linesize, captureFrameBuffer, captureFormat.pixelFormat, outputWidth, outputHeight, FrameArena::Alignment);
+    newFrame->width = outputWidth;
+    newFrame->height = outputHeight;
+    newFrame->format = captureFormat.pixelFormat;
 
-    if(recordAudio) 
+    ret = avcodec_send_packet(videoDecodeContext, nullptr);
+    
+    if (ret != 0)
     {
-        OpenAudio();
+        FATAL("Can't send packet to the video decode context.");
+        return;
     }
 
-    OpenOutput();
-    InitVideoBuffer();
-    if(recordAudio)
+    while (ret >= 0)
     {
-        InitAudioBuffer();
-    }
-
-    LogStatus();
-
-    std::thread screenRecord(&ScreenRecord::ScreenRecordThreadProc, this);
-    screenRecord.detach();
-    
+        ret = avcodec_receive_frame(videoDecodeContext, oldFrame);
+        
+        if (ret < 0)
+        {
+            if (ret == AVERROR_EOF)
+            {
+                LOG("AVERROR_EOF");
+                break;
+            }
+
+            FATAL("Can't receive fram from the video decode context.")
+            return;
+        }
+
+        ConvertVideo(oldFrame, newFrame);
+
+        if (filterStage)
+        {
+            filterStage->Push(newFrame);
+        }
+        else
+        {
+            PushVideo(newFrame);
+        }
+    }
+
+    av_frame_free(&oldFrame);
+    av_frame_free(&newFrame);
+}
+
+void ScreenRecord::FlushAudioDecoder(AudioSource* source)
+{
+    int ret = -1;
+    int dstNbSamples;
+    AVCodecContext *audioDecodeContext = source->decodeContext;
+    AVSampleFormat format = IsMixing() ? AV_SAMPLE_FMT_FLTP : captureFormat.sampleFormat;
+    AVFrame *rawFrame = av_frame_alloc();
+    AVFrame *newFrame = AllocAudioFrame(format, source->frameSize);
+    AVPacket *pkt = av_packet_alloc();
+
+    av_init_packet(pkt);
+
+    ret = avcodec_send_packet(audioDecodeContext, nullptr);
+
+    if (ret != 0)
+    {
+        FATAL("Can't send packet to the audio decode context.");
+        return;
+    }
+    while (ret >= 0)
+    {
+        ret = avcodec_receive_frame(audioDecodeContext, rawFrame);
+
+        if (ret < 0)
+        {
+            if (ret == AVERROR_EOF)
+            {
+                LOG("AVERROR_EOF");
+                break;
+            }
+
+            FATAL("Can't receive frame from the audio decode context.");
+            return;
+        }
+
+        dstNbSamples = av_rescale_rnd(swr_get_delay(source->swrContext, audioDecodeContext->sample_rate) + rawFrame->nb_samples, captureFormat.sampleRate, audioDecodeContext->sample_rate, AV_ROUND_UP);
+
+        if (dstNbSamples > source->frameSize)
+        {
+            av_frame_free(&newFrame);
+            newFrame = AllocAudioFrame(format, dstNbSamples);
+
+            if (!newFrame)
+            {
+                FATAL("Can't allocate audio samples.");
+                return;
+            }
+
+            source->frameSize = dstNbSamples;
+        }
+
+        newFrame->nb_samples = swr_convert(source->swrContext, newFrame->data, dstNbSamples, (const uint8_t **)rawFrame->data, rawFrame->nb_samples);
+
+        if (newFrame->nb_samples < 0)
+        {
+            FATAL("Can't convert raw audio frame to new audio frame.");
+            return;
+        }
+
+        if (!PushAudio(source, newFrame->data, newFrame->nb_samples))
+        {
+            FATAL("Can't write the new frame to the audio fifo buffer.");
+            return;
+        }
+    }
+
+    av_frame_free(&rawFrame);
+    av_frame_free(&newFrame);
+}
+
+// Signals EOF to one encoder and collects everything it still holds, rescaled to the stream time base.
+// Runs on its own thread per encoder; nothing here touches the muxer.
+static int DrainEncoder(AVCodecContext* encodeContext, AVStream* stream, std::vector<AVPacket*>& packets)
+{
+    int ret = avcodec_send_frame(encodeContext, NULL);
+
+    while (ret >= 0)
+    {
+        AVPacket* pkt = av_packet_alloc();
+
+        ret = avcodec_receive_packet(encodeContext, pkt);
+
+        if (ret < 0)
+        {
+            av_packet_free(&pkt);
+            break;
+        }
+
+        pkt->stream_index = stream->index;
+        av_packet_rescale_ts(pkt, encodeContext->time_base, stream->time_base);
+        packets.push_back(pkt);
+    }
+
+    // After a NULL frame the encoder must end with EOF; EAGAIN here would mean it can't be drained.
+    return ret == AVERROR_EOF ? 0 : ret;
+}
+
+int* ScreenRecord::FlushEncoders()
+{
+    std::vector<AVPacket*> videoPackets, audioPackets;
+    std::future<int> videoDrained = std::async(std::launch::async, DrainEncoder, videoEncodeContext, outFormatContext->streams[videoOutIndex], std::ref(videoPackets));
+    int audioRet = 0;
+
+    if (recordAudio)
+    {
+        audioRet = DrainEncoder(audioEncodeContext, outFormatContext->streams[audioOutIndex], audioPackets);
+    }
+
+    int videoRet = videoDrained.get();
+
+    // Both tails are merged by decode timestamp so the interleaver doesn't have to buffer a whole stream.
+    size_t v = 0, a = 0;
+
+    while (v < videoPackets.size() || a < audioPackets.size())
+    {
+        bool takeAudio = v == videoPackets.size() || (a < audioPackets.size() &&
+            av_compare_ts(audioPackets[a]->dts, outFormatContext->streams[audioOutIndex]->time_base, videoPackets[v]->dts, outFormatContext->streams[videoOutIndex]->time_base) <= 0);
+        AVPacket* pkt = takeAudio ? audioPackets[a++] : videoPackets[v++];
+
+        WritePacket(pkt);
+        av_packet_free(&pkt);
+    }
+
+    if (videoRet < 0 || audioRet < 0)
+    {
+        FATAL("Can't drain the encoders.");
+        return nullptr;
+    }
+
+    std::cout << "Finished flushing encoders." << std::endl;
+
+    int* flushed = new int[3];
+    flushed[0] = audioPackets.size();
+    flushed[1] = videoPackets.size();
+    flushed[2] = audioPackets.size() + videoPackets.size();
+
+    return flushed;
+}
+
+void ScreenRecord::Release()
+{
+    if (videoOutFrame)
+    {
+        av_frame_free(&videoOutFrame);
+        videoOutFrame = nullptr;
+    }
+    
+    if (videoOutFrameBuffer && !frameArena)
+    {
+        av_free(videoOutFrameBuffer);
+    }
+
+    videoOutFrameBuffer = nullptr;
+    
+    if (outFormatContext)
+    {
+        avio_close(outFormatContext->pb);
+        avformat_free_context(outFormatContext);
+        outFormatContext = nullptr;
+    }
+
+    if (videoEncodeContext)
+    {
+        avcodec_free_context(&videoEncodeContext);
+        videoEncodeContext = nullptr;
+    }
+
+    if (recordAudio && audioEncodeContext)
+    {
+        avcodec_free_context(&audioEncodeContext);
+        audioEncodeContext = nullptr;
+    }
+
+    delete videoRing;
+    videoRing = nullptr;
+
+    if (captureFrameBuffer && !frameArena)
+    {
+        av_free(captureFrameBuffer);
+    }
+
+    captureFrameBuffer = nullptr;
+
+    if (packetPool)
+    {
+        delete packetPool;
+        packetPool = nullptr;
+    }
+
+    if (audioFramePool)
+    {
+        delete audioFramePool;
+        audioFramePool = nullptr;
+    }
+
+    if (recordAudio && audioFifoBuffer)
+    {
+        av_audio_fifo_free(audioFifoBuffer);
+        audioFifoBuffer = nullptr;
+    }
+
+    if (videoFormatContext)
+    {
+        avformat_close_input(&videoFormatContext);
+        videoFormatContext = nullptr;
+    }
+
+    if (audioMixer)
+    {
+        delete audioMixer;
+        audioMixer = nullptr;
+    }
+
+    if (encodeCost.Count())
+    {
+        std::cout << "Video " << (lossless ? "lossless 4:4:4" : screenContent ? "4:4:4" : "4:2:0") << ": " << videoBytes / (int64_t)encodeCost.Count() << " bytes per frame on average." << std::endl;
+        convertCost.Print("Colour conversion time per frame", "us");
+
+        if (convertCost.Mean() > 0)
+        {
+            double mbPerFrame = convertBytes / (double)convertCost.Count() / (1 << 20);
+
+            std::cout << "Colour conversion (" << (videoConversion == VideoConversion::FusedDownscale ? "fused " + std::to_string(1 << scaleShift) + "x downscale"
+                : videoConversion == VideoConversion::Direct444 ? "direct 4:4:4" : "swscale")
+            << "): " << mbPerFrame << " MB per frame, " << mbPerFrame / (convertCost.Mean() / 1e9) / 1024 << " GB/s." << std::endl;
+
+            // Where a BGR0 kernel covers this size and mode, both it and swscale are timed once on a test frame.
+            if ((screenContent && scaleShift == 0) || (!screenContent && scaleShift > 0))
+            {
+                double swsUs, kernelUs;
+                double mb = ((int64_t)width * 4 * height + videoImageSize) / (double)(1 << 20);
+
+                CompareVideoPaths(width, height, outputWidth, outputHeight, screenContent, scaleShift, &swsUs, &kernelUs);
+
+                if (swsUs > 0 && kernelUs > 0)
+                {
+                    std::cout << "Colour conversion on a BGR0 test frame: " << (screenContent ? "direct 4:4:4 " : "fused " + std::to_string(1 << scaleShift) + "x downscale ")
+                    << kernelUs << " us (" << mb / (kernelUs / 1e6) / 1024 << " GB/s), swscale " << swsUs << " us (" << mb / (swsUs / 1e6) / 1024 << " GB/s)." << std::endl;
+                }
+            }
+        }
+        encodeCost.Print("Video encode time per frame", "us");
+        PrintCadence();
+    }
+
+    if (rawSpool)
+    {
+        delete rawSpool;
+        rawSpool = nullptr;
+    }
+
+    if (ingestReader)
+    {
+        LOG("Ingest " << ingestPath << ": producer skipped " << ingestReader->Dropped() << " frames with every slot held.");
+        delete ingestReader;
+        ingestReader = nullptr;
+    }
+
+    memory.Print();
+
+    if (framesDroppedAtCap || muxFlushes)
+    {
+        LOG("Memory cap: " << framesDroppedAtCap << " frames dropped with the video queue full, " << muxFlushes << " early muxer flushes.");
+    }
+
+    if (egress)
+    {
+        egress->PrintStats();
+        delete egress;
+        egress = nullptr;
+    }
+
+    if (preview)
+    {
+        preview->Stop();
+        preview->PrintStats();
+        delete preview;
+        preview = nullptr;
+    }
+
+    if (workPool)
+    {
+        std::cout << "Farm session " << sessionIndex << " (" << filePath << "): " << sliceFrameIndex << " frames, " << slicesDropped << " dropped behind the pool." << std::endl;
+        sliceLagStats.Print("Capture-to-encoded lag", "ms", 1000000.0);
+
+        for (AVPacket*& pkt : sliceQueue)
+        {
+            av_packet_free(&pkt);
+        }
+
+        sliceQueue.clear();
+        av_packet_free(&slicePacket);
+        av_frame_free(&sliceFrame);
+    }
+
+    if (filterStage)
+    {
+        filterStage->Stop();
+        filterStage->PrintStats();
+        delete filterStage;
+        filterStage = nullptr;
+    }
+
+    // After the filter stage: its queue frames point into the arena.
+    if (frameArena)
+    {
+        frameArena->PrintStats();
+        delete frameArena;
+        frameArena = nullptr;
+    }
+
+    // Always printed: its page-fault and dTLB counts are how the huge-page arena is compared with av_malloc.
+    placement.Print();
+
+    if (roiAnalyzer)
+    {
+        roiAnalyzer->PrintStats();
+        delete roiAnalyzer;
+        roiAnalyzer = nullptr;
+    }
+
+    if (cursorTracker)
+    {
+        cursorTracker->Stop();
+        cursorTracker->PrintStats();
+        delete cursorTracker;
+        cursorTracker = nullptr;
+    }
+
+    for (AudioSource* source : audioSources)
+    {
+        if (source->formatContext)
+        {
+            avformat_close_input(&source->formatContext);
+        }
+
+        if (source->decodeContext)
+        {
+            avcodec_free_context(&source->decodeContext);
+        }
+
+        if (source->swrContext)
+        {
+            swr_free(&source->swrContext);
+        }
+
+        if (source->convertCost.Count())
+        {
+            source->convertCost.Print("Audio source " + std::to_string(source->id) + " conversion per packet (" + AudioConversionNames[(int)source->conversion] + ")", "us");
+        }
+
+        delete source->ring;
+        delete source;
+    }
+
+    audioSources.clear();
+}
+
+void ScreenRecord::Initialise()
+{
+    auto begin = std::chrono::steady_clock::now();
+
+    audioInputFormat = const_cast<AVInputFormat*>(av_find_input_format("pulse"));
+
+    // The ring fixes the captured size; the output follows it unless an output size was given.
+    if (!ingestPath.empty() && !ingestReader)
+    {
+        try
+        {
+            ingestReader = new IngestReader(ingestPath);
+        }
+        catch (std::exception& e)
+        {
+            FATAL(e.what());
+        }
+
+        width = ingestReader->Width();
+        height = ingestReader->Height();
+        widthOffset = heightOffset = 0;
+
+        if (!outputSizeSet)
+        {
+            outputWidth = width & ~1;
+            outputHeight = height & ~1;
+        }
+    }
+
+    // 0: same size, 1 or 2: exact 2x or 4x reduction for the fused kernel, -1: any other ratio (swscale).
+    scaleShift = -1;
+
+    for (int shift = 0; shift <= 2; ++shift)
+    {
+        if (outputWidth << shift == width && outputHeight << shift == height)
+        {
+            scaleShift = shift;
+        }
+    }
+
+    encodeWidth = outputWidth;
+    encodeHeight = outputHeight;
+
+    if (burstSeconds > 0)
+    {
+        if (persistent)
+        {
+            FATAL("Burst capture is not available in daemon mode.");
+        }
+
+        rawSpool = new RawSpoolWriter(filePath + ".burst", outputWidth, outputHeight, screenContent ? AV_PIX_FMT_YUV444P : AV_PIX_FMT_YUV420P, fps, burstSeconds * fps);
+    }
+
+    if (!egressName.empty() && burstSeconds == 0)
+    {
+        egress = new PacketEgress(egressName, (size_t)egressMegabytes * 1024 * 1024);
+        memory.Reserve(MemoryStage::Egress, (size_t)egressMegabytes * 1024 * 1024);
+    }
+
+    if (previewInterval > 0)
+    {
+        preview = new PreviewPublisher(outputWidth, outputHeight, screenContent ? AV_PIX_FMT_YUV444P : AV_PIX_FMT_YUV420P, previewInterval, previewShm);
+        preview->SetOutput(filePath.empty() ? "" : filePath + ".preview.jpg");
+        preview->Start();
+    }
+
+    if (!filterDescription.empty())
+    {
+        size_t frameBytes = av_image_get_buffer_size(screenContent ? AV_PIX_FMT_YUV444P : AV_PIX_FMT_YUV420P, outputWidth, outputHeight, 1);
+        int depth = 4;
+
+        // Under a budget the filter queue takes at most an eighth of it, and never less than two frames.
+        if (memory.Budget())
+        {
+            depth = (int)std::max<size_t>(2, std::min<size_t>(4, memory.Budget() / 8 / frameBytes));
+        }
+
+        filterStage = new FilterStage(filterDescription, outputWidth, outputHeight, screenContent ? AV_PIX_FMT_YUV444P : AV_PIX_FMT_YUV420P, fps, depth);
+        memory.Reserve(MemoryStage::Filter, depth * frameBytes);
+        filterStage->Open();
+        encodeWidth = filterStage->OutputWidth();
+        encodeHeight = filterStage->OutputHeight();
+    }
+
+    if (cursorOverlay)
+    {
+        cursorTracker = new CursorTracker(videoDevice, fps);
+
+        // Without XFixes x11grab keeps drawing the pointer itself.
+        if (!cursorTracker->Start())
+        {
+            LOG("XFixes not available, the pointer will be drawn by x11grab.");
+            delete cursorTracker;
+            cursorTracker = nullptr;
+        }
+    }
+
+    // Devices and then encoders are independent of each other, so they are opened concurrently;
+    // get() rethrows a FATAL from any of them on this thread.
+    std::vector<std::future<void>> pending;
+
+    pending.push_back(std::async(std::launch::async, &ScreenRecord::OpenVideo, this));
+
     if(recordAudio) 
     {
-        std::thread soundRecord(&ScreenRecord::SoundRecordThreadProc, this);
-        soundRecord.detach();
+        for (AudioSource* source : audioSources)
+        {
+            pending.push_back(std::async(std::launch::async, &ScreenRecord::OpenAudio, this, source));
+        }
+    }
+
+    for (auto& p : pending)
+    {
+        p.get();
+    }
+
+    auto devicesOpen = std::chrono::steady_clock::now();
+
+    OpenEncoders();
+
+    captureFormat.pixelFormat = videoEncodeContext->pix_fmt;
+
+    if (recordAudio)
+    {
+        captureFormat.sampleFormat = audioEncodeContext->sample_fmt;
+        captureFormat.sampleRate = audioEncodeContext->sample_rate;
+        captureFormat.channels = audioEncodeContext->channels;
+        captureFormat.channelLayout = audioEncodeContext->channel_layout;
+    }
+
+    auto encodersOpen = std::chrono::steady_clock::now();
+
+    if(recordAudio)
+    {
+        if (IsMixing() && audioEncodeContext->sample_fmt != AV_SAMPLE_FMT_FLTP && audioEncodeContext->sample_fmt != AV_SAMPLE_FMT_FLT)
+        {
+            FATAL("Mixing several audio sources needs a float audio encoder.");
+        }
+
+        for (AudioSource* source : audioSources)
+        {
+            InitResampler(source);
+        }
+    }
+
+    // The muxer's share of a budget: its interleaving window at the peak bit rate, twice over.
+    if (memory.Budget())
+    {
+        int64_t rate = videoEncodeContext->rc_max_rate > 0 ? videoEncodeContext->rc_max_rate : videoEncodeContext->bit_rate;
+
+        if (recordAudio)
+        {
+            rate += audioEncodeContext->bit_rate;
+        }
+
+        muxCap = std::max<int64_t>(1024 * 1024, 2 * rate / 8 * latencyTarget / 1000);
+        memory.Reserve(MemoryStage::Muxer, muxCap);
+    }
+
+    // Audio first: under a budget the video queue gets whatever the other stages leave.
+    if(recordAudio)
+    {
+        InitAudioBuffer();
+    }
+    InitVideoBuffer();
+
+    auto ms = [](std::chrono::steady_clock::duration d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count() / 1000.0; };
+
+    LogStatus();
+    LOG("Initialisation" << (fastStart ? " (fast start)" : "") << ": devices " << ms(devicesOpen - begin) << " ms, encoders " << ms(encodersOpen - devicesOpen)
+        << " ms, resamplers and buffers " << ms(std::chrono::steady_clock::now() - encodersOpen) << " ms.");
+
+    if (filterStage)
+    {
+        filterStage->Start([this](AVFrame* frame) { PushVideo(frame); }, &placement);
+    }
+
+    // Capture threads drop everything until the state becomes Started, so starting them early is harmless.
+    captureThreads.push_back(std::thread(ingestReader ? &ScreenRecord::IngestThreadProc : &ScreenRecord::ScreenRecordThreadProc, this));
+
+    if(recordAudio) 
+    {
+        for (AudioSource* source : audioSources)
+        {
+            captureThreads.push_back(std::thread(&ScreenRecord::SoundRecordThreadProc, this, source));
+        }
+    }
+
+    initialised = true;
+}
+
+void ScreenRecord::OpenEncoders()
+{
+    std::vector<std::future<void>> pending;
+
+    pending.push_back(std::async(std::launch::async, &ScreenRecord::OpenVideoEncoder, this));
+
+    if(recordAudio)
+    {
+        pending.push_back(std::async(std::launch::async, &ScreenRecord::OpenAudioEncoder, this));
+    }
+
+    for (auto& p : pending)
+    {
+        p.get();
+    }
+}
+
+void ScreenRecord::Arm()
+{
+    if (state != RecordState::NotStarted)
+    {
+        throw std::runtime_error("Recording already armed or started.");
+    }
+
+    LOG("Arming the recording...");
+    Initialise();
+
+    // A persistent recorder opens its output file per session, in Start(path).
+    if (!persistent)
+    {
+        OpenOutput();
+    }
+
+    state = RecordState::Armed;
+}
+
+void ScreenRecord::FinishSession()
+{
+    auto begin = std::chrono::steady_clock::now();
+
+    avio_closep(&outFormatContext->pb);
+    avformat_free_context(outFormatContext);
+    outFormatContext = nullptr;
+
+    // Drained encoders can't be restarted, so fresh ones are opened now, off the next session's start path.
+    avcodec_free_context(&videoEncodeContext);
+
+    if (recordAudio)
+    {
+        avcodec_free_context(&audioEncodeContext);
+    }
+
+    OpenEncoders();
+
+    {
+        std::lock_guard<std::mutex> lk(mutexVideoBuffer);
+        videoRing->Reset();
+        memory.Set(MemoryStage::VideoQueue, 0);
+    }
+
+    if (recordAudio)
+    {
+        std::lock_guard<std::mutex> lk(mutexAudioBuffer);
+        av_audio_fifo_reset(audioFifoBuffer);
+        memory.Set(MemoryStage::AudioQueue, 0);
+        audioCaptureTimes.Reset();
+        audioSamplesCaptured = 0;
+        audioSamplesRead = 0;
+        audioLatency = DurationStats();
+    }
+
+    videoCurrentPts = 0;
+    audioCurrentPts = 0;
+    sessionsCompleted++;
+
+    LOG("Session " << sessionsCompleted << " finished, encoders re-armed in " << std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count() / 1000.0 << " ms.");
+
+    std::string next;
+
+    {
+        std::lock_guard<std::mutex> lk(mutexSession);
+        state = RecordState::Armed;
+
+        if (startPending)
+        {
+            next = pendingPath;
+            startPending = false;
+        }
+    }
+
+    cvSessionEnded.notify_all();
+
+    if (!next.empty())
+    {
+        try
+        {
+            Start(next);
+        }
+        catch (const std::exception& e)
+        {
+            LOG("Can't start the queued recording " << next << ": " << e.what());
+        }
+    }
+}
+
+void ScreenRecord::Shutdown()
+{
+    if (state == RecordState::Started || state == RecordState::Paused)
+    {
+        Stop();
+    }
+
+    if (state == RecordState::Stopped)
+    {
+        std::unique_lock<std::mutex> lk(mutexSession);
+        startPending = false;
+        cvSessionEnded.wait(lk, [this] { return state != RecordState::Stopped; });
+    }
+
+    persistent = false;
+    state = RecordState::Stopped;
+
+    for (std::thread& t : captureThreads)
+    {
+        t.join();
+    }
+
+    captureThreads.clear();
+
+    Release();
+    state = RecordState::Finished;
+}
+
+std::string ScreenRecord::Status()
+{
+    static const char* names[] = { "not-started", "armed", "recording", "paused", "stopping", "finished" };
+    std::stringstream status;
+
+    status << names[state] << " file=" << (state == RecordState::Started || state == RecordState::Paused ? filePath : "-")
+    << " frames=" << framesEncoded << " sessions=" << sessionsCompleted
+    << " memory=" << (memory.Total() >> 20) << "MB rss=" << (MemoryBudget::ResidentBytes() >> 20) << "MB";
+
+    return status.str();
+}
+
+void ScreenRecord::MuxThreadProc()
+{
+    int ret = -1;
+    bool done = false;
+    int vFrameIndex = 0, aFrameIndex = 0;
+    bool warm = false;
+    uint64_t warmAllocations = 0, lastAllocations = 0;
+    int64_t steadyIterations = 0, allocatingIterations = 0;
+
+    if (!initialised)
+    {
+        Initialise();
+    }
+
+    if (!outFormatContext)
+    {
+        OpenOutput();
+    }
+
+    framesEncoded = 0;
+    firstIngestTimestamp = AV_NOPTS_VALUE;
+    lastIngestPts = -1;
+
+    // Burst: the capture thread writes straight into the spool, this thread only waits for stop and finalises it.
+    if (rawSpool)
+    {
+        {
+            std::unique_lock<std::mutex> lk(mutexVideoBuffer);
+            cvVideoBufferNotEmpty.wait(lk, [this] { return state == RecordState::Stopped; });
+        }
+
+        for (std::thread& t : captureThreads)
+        {
+            t.join();
+        }
+
+        captureThreads.clear();
+        rawSpool->Close();
+        std::cout << "Encode the burst with: ./main --encode-spool=" << filePath << ".burst " << filePath << std::endl;
+
+        Release();
+        state = RecordState::Finished;
+        return;
+    }
+
+    // Farm session: slices on the shared pool do the conversion and encoding. This thread waits for stop and
+    // for the queued slices, then falls through to the normal drain and trailer with nothing left to mux.
+    if (workPool)
+    {
+        {
+            std::unique_lock<std::mutex> lk(mutexVideoBuffer);
+            cvVideoBufferNotEmpty.wait(lk, [this] { return state == RecordState::Stopped; });
+        }
+
+        for (std::thread& t : captureThreads)
+        {
+            t.join();
+        }
+
+        captureThreads.clear();
+
+        {
+            std::unique_lock<std::mutex> lk(mutexVideoBuffer);
+            cvVideoBufferNotFull.wait(lk, [this] { return sliceCount == 0 && !sliceScheduled; });
+        }
+
+        vFrameIndex = sliceFrameIndex;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(mutexAudioBuffer);
+        audioReadDone = false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(mutexVideoBuffer);
+        videoReadDone = false;
+    }
+
+    if (audioMixer)
+    {
+        mixing = true;
+        mixThread = std::thread(&ScreenRecord::MixThreadProc, this);
+    }
+
+    // After the other pipeline threads are spawned, so they don't inherit the mux thread's cores.
+    placement.Enter("mux");
+
+    while (1)
+    {
+        // Once warm, every pass through the loop that allocated on this thread is counted.
+        if (warm)
+        {
+            uint64_t allocations = HeapAllocations();
+
+            allocatingIterations += allocations != lastAllocations;
+            steadyIterations++;
+            lastAllocations = allocations;
+        }
+
+        if (state == RecordState::Stopped && !done)
+        {
+            done = true;
+        }
+
+        // Bounded stop: whatever is still queued once the deadline has passed is dropped.
+        if (done && stopDeadline > 0 && std::chrono::steady_clock::now() - stopTime > std::chrono::milliseconds(stopDeadline))
+        {
+            LOG("Stop deadline of " << stopDeadline << " ms reached, dropping the rest of the queued frames.");
+            break;
+        }
+
+        if (recordAudio && done)
+        {
+            std::unique_lock<std::mutex> vBufLock(mutexVideoBuffer, std::defer_lock);
+            std::unique_lock<std::mutex> aBufLock(mutexAudioBuffer, std::defer_lock);
+
+            std::lock(vBufLock, aBufLock);
+
+            if (!videoRing->Count() && videoTailQueued && av_audio_fifo_size(audioFifoBuffer) < numberOfSamples && SourcesFlushed() && !mixing)
+            {
+                LOG("Video fifo buffer and audio fifo buffer with size smaller than expected.");
+                break;
+            }
+        } 
+        else if (done && !videoRing->Count() && videoTailQueued)
+        {
+            break;
+        }
+
+        if (recordAudio && av_compare_ts(audioCurrentPts, outFormatContext->streams[audioOutIndex]->time_base, videoCurrentPts, outFormatContext->streams[videoOutIndex]->time_base) <= 0)
+        {
+            if (done)
+            {
+                std::unique_lock<std::mutex> lk(mutexAudioBuffer);
+                if (av_audio_fifo_size(audioFifoBuffer) < numberOfSamples)
+                { 
+                    // The decoders' tails may still be on their way through the mixer.
+                    if (!SourcesFlushed() || mixing)
+                    {
+                        cvAudioBufferNotEmpty.wait_for(lk, std::chrono::milliseconds(5));
+                        continue;
+                    }
+
+                    audioCurrentPts = INT_MAX;
+                    continue;
+                }
+            }
+            else
+            {
+                std::unique_lock<std::mutex> lk(mutexAudioBuffer);
+                cvAudioBufferNotEmpty.wait(lk, [this] { return av_audio_fifo_size(this->audioFifoBuffer) >= this->numberOfSamples || state == RecordState::Stopped; });
+
+                if (av_audio_fifo_size(audioFifoBuffer) < numberOfSamples)
+                {
+                    continue;
+                }
+            }
+
+            AVFrame *aFrame = AcquireAudioFrame();
+
+            if (!aFrame)
+            {
+                FATAL("Can't allocate audio frame.");
+            }
+
+            aFrame->pts = numberOfSamples * aFrameIndex++;
+
+            int64_t captureTime;
+
+            av_audio_fifo_read(audioFifoBuffer, (void **)aFrame->data, numberOfSamples);
+            memory.Add(MemoryStage::AudioQueue, -(int64_t)numberOfSamples * audioFrameBytes);
+            {
+                std::lock_guard<std::mutex> lk(mutexAudioBuffer);
+                captureTime = audioCaptureTimes.TimeOf(audioSamplesRead);
+            }
+            audioSamplesRead += numberOfSamples;
+            cvAudioBufferNotFull.notify_one();
+
+            AVPacket* pkt = packetPool->Acquire();
+
+            ret = avcodec_send_frame(audioEncodeContext, aFrame);
+            audioFramePool->Release(aFrame);
+
+            if (ret == 0 && captureTime != AV_NOPTS_VALUE)
+            {
+                audioLatency.Record((av_gettime() - captureTime) * 1000);
+            }
+
+            if (ret == 0)
+            {
+                ret = avcodec_receive_packet(audioEncodeContext, pkt);
+            }
+
+            if (ret == 0)
+            {
+                pkt->stream_index = audioOutIndex;
+
+                av_packet_rescale_ts(pkt, audioEncodeContext->time_base, outFormatContext->streams[audioOutIndex]->time_base);
+
+                audioCurrentPts = pkt->pts;
+
+                WritePacket(pkt);
+            }
+
+            av_packet_unref(pkt);
+            packetPool->Release(pkt);
+        }
+        else
+        {
+            if (done)
+            {
+                std::unique_lock<std::mutex> lk(mutexVideoBuffer);
+
+                if (!videoRing->Count())
+                {
+                    // The capture thread may still be passing on what the filter graph held back.
+                    if (!videoTailQueued)
+                    {
+                        cvVideoBufferNotEmpty.wait_for(lk, std::chrono::milliseconds(5));
+                        continue;
+                    }
+
+                    videoCurrentPts = INT_MAX;
+                    continue;
+                }
+            }
+            else
+            {
+                std::unique_lock<std::mutex> lk(mutexVideoBuffer);
+                cvVideoBufferNotEmpty.wait(lk, [this] { return videoRing->Count() > 0 || state == RecordState::Stopped; });
+
+                if (!videoRing->Count())
+                {
+                    continue;
+                }
+            }
+
+            memcpy(videoOutFrameBuffer, videoRing->ReadSlot(), videoOutFrameSize);
+            videoRing->Consume();
+            memory.Add(MemoryStage::VideoQueue, -videoOutFrameSize);
+            cvVideoBufferNotFull.notify_one();
+
+            if (ingestReader)
+            {
+                int64_t timestamp;
+
+                memcpy(&timestamp, videoOutFrameBuffer + videoOutFrameSize - sizeof(timestamp), sizeof(timestamp));
+                videoOutFrame->pts = NextIngestPts(timestamp);
+            }
+            else
+            {
+                videoOutFrame->pts = vFrameIndex;
+            }
+
+            vFrameIndex++;
+            framesEncoded = vFrameIndex;
+            videoOutFrame->format = videoEncodeContext->pix_fmt;
+            videoOutFrame->width = videoEncodeContext->width;
+            videoOutFrame->height = videoEncodeContext->height;
+
+            if (roiAnalyzer)
+            {
+                AttachRoi();
+            }
+
+            AVPacket* pkt = packetPool->Acquire();
+            auto encodeBegin = std::chrono::steady_clock::now();
+
+            ret = avcodec_send_frame(videoEncodeContext, videoOutFrame);
+            av_frame_remove_side_data(videoOutFrame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+
+            if (ret == 0)
+            {
+                ret = avcodec_receive_packet(videoEncodeContext, pkt);
+            }
+
+            encodeCost.Record(std::chrono::steady_clock::now() - encodeBegin);
+
+            if (ret == 0)
+            {
+                videoBytes += pkt->size;
+                pkt->stream_index = videoOutIndex;
+
+                av_packet_rescale_ts(pkt, videoEncodeContext->time_base, outFormatContext->streams[videoOutIndex]->time_base);
+                videoCurrentPts = pkt->pts;
+
+                WritePacket(pkt);
+            }
+
+            av_packet_unref(pkt);
+            packetPool->Release(pkt);
+        }
+
+        if (vFrameIndex == fps && !warm)
+        {
+            warm = true;
+            warmAllocations = lastAllocations = HeapAllocations();
+        }
+    }
+
+    if (warm)
+    {
+        uint64_t allocations = lastAllocations - warmAllocations;
+
+        LOG("Heap allocations on the mux thread after warm-up: " << allocations << " in " << allocatingIterations << " of " << steadyIterations << " loop iterations.");
+
+        if (allocationCheck && allocations)
+        {
+            LOG("Allocation check failed: the steady-state mux loop allocated.");
+            allocationCheckFailed = true;
+        }
+    }
+    else if (allocationCheck)
+    {
+        LOG("Allocation check failed: the recording stopped before the mux loop warmed up.");
+        allocationCheckFailed = true;
+    }
+
+    if (recordAudio)
+    {
+        audioLatency.Print("Audio capture-to-encoder latency", "ms", 1000000.0);
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(mutexAudioBuffer);
+        audioReadDone = true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(mutexVideoBuffer);
+        videoReadDone = true;
+    }
+
+    cvAudioBufferNotFull.notify_all();
+    cvVideoBufferNotFull.notify_all();
+
+    if (mixThread.joinable())
+    {
+        mixThread.join();
+        audioMixer->PrintStats();
+    }
+
+    auto drainBegin = std::chrono::steady_clock::now();
+    int* flushed = FlushEncoders();
+    auto drainEnd = std::chrono::steady_clock::now();
+    
+    if(flushed)
+    {
+        if(recordAudio) 
+        {
+            std::cout << "Total audio frames encoded: " << aFrameIndex + flushed[0] << " (" << flushed[0] << " flushed)." << std::endl;
+        }
+
+        std::cout << "Total video frames encoded: " << vFrameIndex + flushed[1] << " (" << flushed[1] << " flushed)." << std::endl;
+
+        delete[] flushed;
+    }
+
+    av_write_trailer(outFormatContext);
+    avio_closep(&outFormatContext->pb);
+
+    auto trailerEnd = std::chrono::steady_clock::now();
+    bool relocated = fastStartIndex && !spool && MoveIndexToFront(filePath);
+    auto ms = [](std::chrono::steady_clock::duration d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count() / 1000.0; };
+
+    LOG("Stop to playable file: " << ms(std::chrono::steady_clock::now() - stopTime) << " ms (queued frames " << ms(drainBegin - stopTime)
+        << " ms, encoder drain " << ms(drainEnd - drainBegin) << " ms, trailer " << ms(trailerEnd - drainEnd) << " ms"
+        << (relocated ? ", index moved to front in " + std::to_string(ms(std::chrono::steady_clock::now() - trailerEnd)) + " ms" : std::string()) << ").");
+
+    placement.Leave("mux");
+
+    if (spool)
+    {
+        if (LaunchTranscode(OutputPath(), filePath, TranscodeSettings{ videoBackend, encoderPreset, fps }, fastStartIndex))
+        {
+            LOG("Spool " << OutputPath() << " handed to a background transcode into " << filePath << ".");
+        }
+        else
+        {
+            LOG("Can't start the background transcode, the spool " << OutputPath() << " is kept.");
+        }
+    }
+
+    if (persistent)
+    {
+        FinishSession();
+        return;
     }
 
-    while (1)
+    for (std::thread& t : captureThreads)
     {
-        if (state == RecordState::Stopped && !done)
+        t.join();
+    }
+
+    captureThreads.clear();
+
+    Release();
+
+    if(recordAudio)
+    {
+        std::cout << "Done muxing audio and video and relative cleaning." << std::endl << std::endl;
+    }
+    else
+    {
+        std::cout << "Done muxing video and relative cleaning." << std::endl << std::endl;
+    }
+    state = RecordState::Finished;
+}
+
+void ScreenRecord::ScreenRecordThreadProc()
+{
+    int ret = -1;
+    int frameWritten = 0;
+    int frameDiscarded = 0;
+    int64_t lastCaptureTime = AV_NOPTS_VALUE;
+    int64_t period = 1000000 / fps;
+    AVFrame	*oldFrame = av_frame_alloc();
+    AVFrame *newFrame = av_frame_alloc();
+
+    AVPacket* pkt = av_packet_alloc();
+    av_init_packet(pkt);
+
+    placement.Enter("video", true);
+
+    av_image_fill_arrays(newFrame->data, newFrame->linesize, captureFrameBuffer, captureFormat.pixelFormat, outputWidth, outputHeight, FrameArena::Alignment);
+    newFrame->width = outputWidth;
+    newFrame->height = outputHeight;
+    newFrame->format = captureFormat.pixelFormat;
+
+    while (CaptureRunning())
+    {
+        if(frameWritten % 100 == 0 && frameWritten != 0)
         {
-            done = true;
+            LOG(std::string("Video frame written: ").append(std::to_string(frameWritten)));
         }
 
-        if (recordAudio && done)
+        if (av_read_frame(videoFormatContext, pkt) < 0)
         {
-            std::unique_lock<std::mutex> vBufLock(mutexVideoBuffer, std::defer_lock);
-            std::unique_lock<std::mutex> aBufLock(mutexAudioBuffer, std::defer_lock);
+            LOG("Can't read frame from the video format context.");
+            continue;
+        }
+
+        // The grabber keeps running while paused or armed: frames are dropped here so the device never has to be reopened.
+        if (state != RecordState::Started)
+        {
+            if (state == RecordState::Stopped && !videoTailQueued)
+            {
+                QueueVideoTail();
+            }
+
+            frameDiscarded++;
+            lastCaptureTime = AV_NOPTS_VALUE;
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        if (pkt->stream_index != videoIndex)
+        {
+            av_packet_unref(pkt);
+        }
+
+        if (workPool)
+        {
+            QueueSlice(pkt);
+            frameWritten++;
+            continue;
+        }
+
+        auto captureBegin = std::chrono::steady_clock::now();
+        ret = avcodec_send_packet(videoDecodeContext, pkt);
+
+        if (ret != 0)
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        ret = avcodec_receive_frame(videoDecodeContext, oldFrame);
+
+        if (ret != 0)
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        int64_t captureTime = oldFrame->pts != AV_NOPTS_VALUE ? av_rescale_q(oldFrame->pts, videoFormatContext->streams[videoIndex]->time_base, AV_TIME_BASE_Q) : av_gettime();
+
+        // Cadence against the target period, from the grabber's own timestamps; a gap over 1.5 periods is a late frame.
+        if (lastCaptureTime != AV_NOPTS_VALUE)
+        {
+            int64_t interval = captureTime - lastCaptureTime;
+
+            frameInterval.Record(interval * 1000);
+            frameJitter.Record(std::abs(interval - period) * 1000);
+
+            if (interval * 2 > period * 3)
+            {
+                lateFrames++;
+            }
+        }
+
+        lastCaptureTime = captureTime;
+
+        ConvertVideo(oldFrame, newFrame);
+
+        if (cursorTracker)
+        {
+            cursorTracker->Blend(newFrame, widthOffset, heightOffset, chromaShift, (double)outputWidth / width);
+        }
+
+        // Decode, conversion and cursor only: the hand-off below can block on a full queue, which is the next stage's cost.
+        captureCost.Record(std::chrono::steady_clock::now() - captureBegin);
+
+        if (preview)
+        {
+            preview->Offer(newFrame);
+        }
+
+        if (rawSpool)
+        {
+            rawSpool->Write(newFrame, captureTime);
+        }
+        else if (filterStage)
+        {
+            filterStage->Push(newFrame);
+        }
+        else
+        {
+            PushVideo(newFrame);
+        }
+
+        if (firstFramePending.exchange(false))
+        {
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+            LOG("Time to first frame: " << latency.count() / 1000.0 << " ms after start.");
+            frameDiscarded = 0;
+        }
+
+        if (videoResumePending.exchange(false))
+        {
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - resumeTime);
+            LOG("Video resumed: first frame " << latency.count() / 1000.0 << " ms after resume (" << frameDiscarded << " frames discarded while paused).");
+            frameDiscarded = 0;
+        }
+
+        frameWritten++;
+
+        av_packet_unref(pkt);
+    }
+
+    // A farm session's decoder belongs to its slices, which have nothing buffered in it for raw video.
+    if (!workPool)
+    {
+        FlushVideoDecoder();
+    }
+
+    if (!videoTailQueued)
+    {
+        QueueVideoTail();
+    }
+
+    av_frame_free(&oldFrame);
+    av_frame_free(&newFrame);
+    placement.Leave("video");
+}
+
+// Ingest counterpart of ScreenRecordThreadProc. Each slot is converted where the producer rendered it
+// and handed back right after, so the ring only has to cover the conversion time. Time spent paused
+// is taken out of the producer's clock, as the frame counter does for x11grab.
+void ScreenRecord::IngestThreadProc()
+{
+    AVFrame *shared = av_frame_alloc();
+    AVFrame *newFrame = av_frame_alloc();
+    int64_t timestamp, lastTimestamp = AV_NOPTS_VALUE, pausedTime = 0;
+    bool discarding = false;
+    int64_t frameDiscarded = 0;
+
+    placement.Enter("video", true);
+
+    av_image_fill_arrays(newFrame->data, newFrame->linesize, captureFrameBuffer, captureFormat.pixelFormat, outputWidth, outputHeight, FrameArena::Alignment);
+    newFrame->width = outputWidth;
+    newFrame->height = outputHeight;
+    newFrame->format = captureFormat.pixelFormat;
+
+    while (CaptureRunning())
+    {
+        if (!ingestReader->Next(shared, &timestamp, 100))
+        {
+            continue;
+        }
+
+        if (timestamp == AV_NOPTS_VALUE)
+        {
+            timestamp = av_gettime();
+        }
+
+        if (state != RecordState::Started)
+        {
+            if (state == RecordState::Stopped && !videoTailQueued)
+            {
+                QueueVideoTail();
+            }
+
+            ingestReader->Release();
+            discarding = true;
+            frameDiscarded++;
+            continue;
+        }
+
+        if (discarding && lastTimestamp != AV_NOPTS_VALUE)
+        {
+            pausedTime += timestamp - lastTimestamp - 1000000 / fps;
+        }
+
+        discarding = false;
+        lastTimestamp = timestamp;
+
+        auto captureBegin = std::chrono::steady_clock::now();
+
+        ConvertVideo(shared, newFrame);
+        ingestReader->Release();
+        captureCost.Record(std::chrono::steady_clock::now() - captureBegin);
+
+        if (preview)
+        {
+            preview->Offer(newFrame);
+        }
+
+        if (rawSpool)
+        {
+            rawSpool->Write(newFrame, timestamp - pausedTime);
+        }
+        else
+        {
+            newFrame->pts = timestamp - pausedTime;
+
+            if (filterStage)
+            {
+                filterStage->Push(newFrame);
+            }
+            else
+            {
+                PushVideo(newFrame);
+            }
+        }
+
+        if (firstFramePending.exchange(false))
+        {
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+            LOG("Time to first frame: " << latency.count() / 1000.0 << " ms after start.");
+            frameDiscarded = 0;
+        }
+
+        if (videoResumePending.exchange(false))
+        {
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - resumeTime);
+            LOG("Video resumed: first frame " << latency.count() / 1000.0 << " ms after resume (" << frameDiscarded << " frames discarded while paused).");
+            frameDiscarded = 0;
+        }
+    }
+
+    if (!videoTailQueued)
+    {
+        QueueVideoTail();
+    }
+
+    av_frame_free(&shared);
+    av_frame_free(&newFrame);
+    placement.Leave("video");
+}
+
+// Milliseconds since the session's first ingested frame, kept strictly increasing for the encoder.
+// timestamp is the one carried in the frame's fifo record.
+int64_t ScreenRecord::NextIngestPts(int64_t timestamp)
+{
+    int64_t pts = lastIngestPts + 1;
+
+    if (timestamp != AV_NOPTS_VALUE)
+    {
+        if (firstIngestTimestamp == AV_NOPTS_VALUE)
+        {
+            firstIngestTimestamp = timestamp;
+        }
+
+        pts = std::max(pts, (timestamp - firstIngestTimestamp) / 1000);
+    }
+
+    lastIngestPts = pts;
+    return pts;
+}
+
+// Every muxed packet goes through here; the egress copy is taken first because the muxer takes the payload.
+void ScreenRecord::WritePacket(AVPacket* pkt)
+{
+    if (egress)
+    {
+        egress->Publish(pkt);
+    }
+
+    bool metered = muxMeter.Add(pkt->stream_index, av_rescale_q(pkt->dts, outFormatContext->streams[pkt->stream_index]->time_base, AV_TIME_BASE_Q), pkt->size);
+
+    av_interleaved_write_frame(outFormatContext, pkt);
+
+    // At the cap, or past what the meter can follow, the interleaving queue is written out as it stands.
+    if (!metered || (memory.Budget() && muxMeter.Bytes() > muxCap))
+    {
+        av_interleaved_write_frame(outFormatContext, nullptr);
+        muxMeter.Clear();
+        muxFlushes++;
+    }
+
+    memory.Set(MemoryStage::Muxer, muxMeter.Bytes());
+}
+
+void ScreenRecord::SoundRecordThreadProc(AudioSource* source)
+{
+    int ret = -1;
+    int dstNbSamples;
+    int frameWritten = 0;
+    int packetDiscarded = 0;
+    AVFormatContext *audioFormatContext = source->formatContext;
+    AVCodecContext *audioDecodeContext = source->decodeContext;
+    AVSampleFormat format = IsMixing() ? AV_SAMPLE_FMT_FLTP : captureFormat.sampleFormat;
+
+    // One encoder frame's worth at the encoder's rate; grows if the resampler ever holds back more.
+    source->frameSize = av_rescale_rnd(numberOfSamples, captureFormat.sampleRate, audioDecodeContext->sample_rate, AV_ROUND_UP);
+
+    AVFrame *rawFrame = av_frame_alloc();
+    AVFrame *newFrame = AllocAudioFrame(format, source->frameSize);
+
+    AVPacket* pkt = av_packet_alloc();
+    av_init_packet(pkt);
+
+    // Scratch planes for the deinterleaving paths; grown to the largest packet seen, then reused.
+    std::vector<float> planar;
+    std::vector<float*> planes(captureFormat.channels);
+
+    placement.Enter("audio", true);
+
+    while (CaptureRunning())
+    {
+        if(frameWritten % 100 == 0 && frameWritten != 0)
+        {
+            LOG(std::string("Audio frame written: ").append(std::to_string(frameWritten)));
+        }
+
+        if (av_read_frame(audioFormatContext, pkt) < 0)
+        {
+            LOG("Can't read frame from the audio format context.");
+            continue;
+        }
+
+        // Keep draining the pulse source while paused or armed so no stale audio is queued up at (re)start.
+        if (state != RecordState::Started)
+        {
+            packetDiscarded++;
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        // pulse stamps packets with the wall clock minus the current device latency.
+        int64_t captureTime = pkt->pts != AV_NOPTS_VALUE ? av_rescale_q(pkt->pts, audioFormatContext->streams[pkt->stream_index]->time_base, AV_TIME_BASE_Q) : av_gettime();
+
+        if (pkt->stream_index != source->index)
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        ret = avcodec_send_packet(audioDecodeContext, pkt);
+
+        if (ret != 0)
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        ret = avcodec_receive_frame(audioDecodeContext, rawFrame);
+
+        if (ret != 0)
+        {
+            av_packet_unref(pkt);
+            continue;
+        }
 
-            std::lock(vBufLock, aBufLock);
+        auto convertBegin = std::chrono::steady_clock::now();
+        uint8_t** samples = newFrame->data;
+        int converted = rawFrame->nb_samples;
 
-            if (av_fifo_size(videoFifoBuffer) < videoOutFrameSize && av_audio_fifo_size(audioFifoBuffer) < numberOfSamples)
-            {
-                LOG("Video fifo buffer and audio fifo buffer with size smaller than expected.");
-                break;
-            }
-        } 
-        else if(done)
+        if (source->conversion == AudioConversion::Direct)
         {
-            break;
+            // Already in the encoder's format: the decoded frame goes into the fifo as it is.
+            samples = rawFrame->data;
         }
-
-        if (recordAudio && av_compare_ts(audioCurrentPts, outFormatContext->streams[audioOutIndex]->time_base, videoCurrentPts, outFormatContext->streams[videoOutIndex]->time_base) <= 0)
+        else if (source->conversion != AudioConversion::Resample)
         {
-            if (done)
-            {
-                std::lock_guard<std::mutex> lk(mutexAudioBuffer);
-                if (av_audio_fifo_size(audioFifoBuffer) < numberOfSamples)
-                { 
-                    audioCurrentPts = INT_MAX;
-                    continue;
-                }
-            }
-            else
+            if ((int)planar.size() < converted * captureFormat.channels)
             {
-                std::unique_lock<std::mutex> lk(mutexAudioBuffer);
-                cvAudioBufferNotEmpty.wait(lk, [this] { return av_audio_fifo_size(this->audioFifoBuffer) >= this->numberOfSamples; });
+                planar.resize(converted * captureFormat.channels);
             }
 
-            AVFrame *aFrame = av_frame_alloc();
-
-            aFrame->nb_samples = numberOfSamples;
-            aFrame->channel_layout = audioEncodeContext->channel_layout;
-            aFrame->format = audioEncodeContext->sample_fmt;
-            aFrame->sample_rate = audioEncodeContext->sample_rate;
-            aFrame->pts = numberOfSamples * aFrameIndex++;
-
-            av_frame_get_buffer(aFrame, 0);
-            av_audio_fifo_read(audioFifoBuffer, (void **)aFrame->data, numberOfSamples);
-            cvAudioBufferNotFull.notify_one();
-
-            AVPacket* pkt = av_packet_alloc();
-            av_init_packet(pkt);
-
-            ret = avcodec_send_frame(audioEncodeContext, aFrame);
-
-            if (ret != 0)
+            for (int c = 0; c < captureFormat.channels; ++c)
             {
-                av_frame_free(&aFrame);
-                av_packet_unref(pkt);
-                continue;
+                planes[c] = &planar[c * converted];
             }
-            ret = avcodec_receive_packet(audioEncodeContext, pkt);
 
-            if (ret != 0)
+            if (source->conversion == AudioConversion::DeinterleaveFloat)
             {
-                av_frame_free(&aFrame);
-                av_packet_unref(pkt);
-                continue;
+                DeinterleaveFloat((const float*)rawFrame->data[0], planes.data(), captureFormat.channels, converted);
             }
-
-            pkt->stream_index = audioOutIndex;
-
-            av_packet_rescale_ts(pkt, audioEncodeContext->time_base, outFormatContext->streams[audioOutIndex]->time_base);
-
-            audioCurrentPts = pkt->pts;
-
-            if(!av_interleaved_write_frame(outFormatContext, pkt))
+            else
             {
-                continue;
+                DeinterleaveS16ToFloat((const int16_t*)rawFrame->data[0], planes.data(), captureFormat.channels, converted);
             }
 
-            av_frame_free(&aFrame);
-            av_packet_free(&pkt);
+            samples = (uint8_t**)planes.data();
         }
         else
         {
-            if (done)
+            dstNbSamples = av_rescale_rnd(swr_get_delay(source->swrContext, audioDecodeContext->sample_rate) + rawFrame->nb_samples, captureFormat.sampleRate, audioDecodeContext->sample_rate, AV_ROUND_UP);
+
+            if (dstNbSamples > source->frameSize)
             {
-                std::lock_guard<std::mutex> lk(mutexVideoBuffer);
+                av_frame_free(&newFrame);
+                newFrame = AllocAudioFrame(format, dstNbSamples);
 
-                if (av_fifo_size(videoFifoBuffer) < videoOutFrameSize)
+                if (!newFrame)
                 {
-                    videoCurrentPts = INT_MAX;
-                    continue;
+                    FATAL("Can't allocate audio samples.");
+                    return;
                 }
-            }
-            else
-            {
-                std::unique_lock<std::mutex> lk(mutexVideoBuffer);
-                cvVideoBufferNotEmpty.wait(lk, [this] { return av_fifo_size(this->videoFifoBuffer) >= this->videoOutFrameSize; });
-            }
-
-            av_fifo_generic_read(videoFifoBuffer, videoOutFrameBuffer, videoOutFrameSize, nullptr);
-            cvVideoBufferNotFull.notify_one();
-
-            videoOutFrame->pts = vFrameIndex++;
-            videoOutFrame->format = videoEncodeContext->pix_fmt;
-            videoOutFrame->width = videoEncodeContext->width;
-            videoOutFrame->height = videoEncodeContext->height;
-
-            AVPacket* pkt = av_packet_alloc();
-            av_init_packet(pkt);
 
-            ret = avcodec_send_frame(videoEncodeContext, videoOutFrame);
-
-            if (ret != 0)
-            {
-                av_packet_unref(pkt);
-                continue;
+                source->frameSize = dstNbSamples;
             }
 
-            ret = avcodec_receive_packet(videoEncodeContext, pkt);
-            
-            if (ret != 0)
+            if (audioMixer && source->id > 0)
             {
-                av_packet_unref(pkt);
-                continue;
-            }
+                int delta = audioMixer->TakeCompensation(source->id);
 
-            pkt->stream_index = videoOutIndex;
+                if (delta)
+                {
+                    swr_set_compensation(source->swrContext, delta, audioMixer->CompensationDistance());
+                }
+            }
 
-            av_packet_rescale_ts(pkt, videoEncodeContext->time_base, outFormatContext->streams[videoOutIndex]->time_base);
-            videoCurrentPts = pkt->pts;
+            converted = swr_convert(source->swrContext, newFrame->data, dstNbSamples, (const uint8_t **)rawFrame->data, rawFrame->nb_samples);
 
-            if(!av_interleaved_write_frame(outFormatContext, pkt))
+            if (converted < 0)
             {
-                continue;
+                FATAL("Can't convert raw audio frame to a new frame.");
+                return;
             }
+        }
 
-            av_packet_free(&pkt);
+        source->convertCost.Record(std::chrono::steady_clock::now() - convertBegin);
+
+        // Source 0 feeds the fifo sample for sample (directly or as the mixer's master), so its
+        // positions line up with what the mux thread reads. Stamped before the samples become
+        // readable, so the mux thread always finds their capture time.
+        if (source->id == 0)
+        {
+            std::lock_guard<std::mutex> lk(mutexAudioBuffer);
+            audioSamplesCaptured += converted;
+            audioCaptureTimes.Push(audioSamplesCaptured, captureTime);
         }
-    }
 
-    int* flushed = FlushEncoders();
-    
-    if(flushed)
-    {
-        if(recordAudio) 
+        if (!PushAudio(source, samples, converted))
         {
-            std::cout << "Total audio frames encoded: " << aFrameIndex + flushed[0] << " (" << flushed[0] << " flushed)." << std::endl;
+            FATAL("Can't write frame to the audio fifo buffer.");
+            return;
         }
 
-        std::cout << "Total video frames encoded: " << vFrameIndex + flushed[1] << " (" << flushed[1] << " flushed)." << std::endl;
+        av_packet_unref(pkt);
 
-        delete[] flushed;
+        if (audioResumePending.exchange(false))
+        {
+            auto latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - resumeTime);
+            LOG("Audio resumed: first sample " << latency.count() / 1000.0 << " ms after resume (" << packetDiscarded << " packets discarded while paused).");
+            packetDiscarded = 0;
+        }
+
+        frameWritten++;
+
+        cvAudioBufferNotEmpty.notify_one();
     }
 
-    av_write_trailer(outFormatContext);
+    FlushAudioDecoder(source);
+    audioSourcesFlushed++;
+    av_frame_free(&rawFrame);
+    av_frame_free(&newFrame);
+    placement.Leave("audio");
+}
 
-    Release();
+void ScreenRecord::ConvertVideo(AVFrame* src, AVFrame* dst)
+{
+    auto begin = std::chrono::steady_clock::now();
 
-    if(recordAudio)
+    bool bgr0 = src->format == AV_PIX_FMT_BGR0 && src->width == width && src->height == height;
+
+    if (screenContent && bgr0 && scaleShift == 0)
     {
-        std::cout << "Done muxing audio and video and relative cleaning." << std::endl << std::endl;
+        ConvertBgr0ToYuv444(src->data[0], src->linesize[0], dst->data, dst->linesize, outputWidth, outputHeight);
+        videoConversion = VideoConversion::Direct444;
+    }
+    else if (!screenContent && bgr0 && scaleShift > 0)
+    {
+        ConvertBgr0ToI420Downscale(src->data[0], src->linesize[0], dst->data, dst->linesize, outputWidth, outputHeight, scaleShift);
+        videoConversion = VideoConversion::FusedDownscale;
     }
     else
     {
-        std::cout << "Done muxing video and relative cleaning." << std::endl << std::endl;
+        sws_scale(swsContext, (const uint8_t* const*)src->data, src->linesize, 0, src->height, dst->data, dst->linesize);
+        videoConversion = VideoConversion::Swscale;
     }
-    state = RecordState::Finished;
+
+    convertCost.Record(std::chrono::steady_clock::now() - begin);
+
+    // Traffic the conversion can't avoid: the source picture read once, the output planes written once.
+    convertBytes += (int64_t)src->linesize[0] * src->height + videoImageSize;
 }
 
-void ScreenRecord::ScreenRecordThreadProc()
+// A full queue means the pool is more than the queue depth behind this session: the frame is dropped
+// rather than stalling the grabber. The session is put on the pool when it has no slice pending.
+void ScreenRecord::QueueSlice(AVPacket* pkt)
 {
-    int ret = -1;
-    int size = width * height;
-    int frameWritten = 0;
-    AVFrame	*oldFrame = av_frame_alloc();
-    AVFrame *newFrame = av_frame_alloc();
+    bool submit;
 
-    AVPacket* pkt = av_packet_alloc();
-    av_init_packet(pkt);
+    {
+        std::lock_guard<std::mutex> lk(mutexVideoBuffer);
 
-    int newFrameBufSize = av_image_get_buffer_size(videoEncodeContext->pix_fmt, width, height, 1);
-    uint8_t *newFrameBuf = (uint8_t*)av_malloc(newFrameBufSize);
+        if (sliceCount == sliceQueue.size())
+        {
+            slicesDropped++;
+            av_packet_unref(pkt);
+            return;
+        }
 
-    av_image_fill_arrays(newFrame->data, newFrame->linesize, newFrameBuf, videoEncodeContext->pix_fmt, width, height, 1);
+        av_packet_move_ref(sliceQueue[(sliceHead + sliceCount) % sliceQueue.size()], pkt);
+        sliceCount++;
+        submit = !sliceScheduled;
+        sliceScheduled = true;
+    }
 
-    while (state != RecordState::Stopped)
+    if (submit)
     {
-        if (state == RecordState::Paused)
-        {
-            LOG("Pausing the video thread...");
-            std::unique_lock<std::mutex> lk(mutexPause);
-            cvNotPause.wait(lk, [this] { return state != RecordState::Paused; });
-        }
+        workPool->Submit([this] { EncodeSlice(); }, sessionIndex);
+    }
+}
 
-        if(frameWritten % 100 == 0 && frameWritten != 0)
-        {
-            LOG(std::string("Video frame written: ").append(std::to_string(frameWritten)));
-        }
+// One frame per slice: decode, convert, cursor, encode and write. At most one slice of a session is
+// queued or running at a time, which keeps its codec contexts single-threaded; a session with more
+// frames waiting goes to the back of the queue, so busy sessions take turns with the others.
+void ScreenRecord::EncodeSlice()
+{
+    {
+        std::lock_guard<std::mutex> lk(mutexVideoBuffer);
+        av_packet_move_ref(slicePacket, sliceQueue[sliceHead]);
+        sliceHead = (sliceHead + 1) % sliceQueue.size();
+        sliceCount--;
+    }
 
-        if (av_read_frame(videoFormatContext, pkt) < 0)
+    int64_t captureTime = slicePacket->pts != AV_NOPTS_VALUE ? av_rescale_q(slicePacket->pts, videoFormatContext->streams[videoIndex]->time_base, AV_TIME_BASE_Q) : av_gettime();
+
+    if (avcodec_send_packet(videoDecodeContext, slicePacket) == 0 && avcodec_receive_frame(videoDecodeContext, sliceFrame) == 0)
+    {
+        ConvertVideo(sliceFrame, videoOutFrame);
+        av_frame_unref(sliceFrame);
+
+        if (cursorTracker)
         {
-            LOG("Can't read frame from the video format context.");
-            continue;
+            cursorTracker->Blend(videoOutFrame, widthOffset, heightOffset, chromaShift, (double)outputWidth / width);
         }
 
-        if (pkt->stream_index != videoIndex)
+        videoOutFrame->pts = sliceFrameIndex++;
+        videoOutFrame->format = videoEncodeContext->pix_fmt;
+        videoOutFrame->width = videoEncodeContext->width;
+        videoOutFrame->height = videoEncodeContext->height;
+
+        AVPacket* pkt = packetPool->Acquire();
+        auto encodeBegin = std::chrono::steady_clock::now();
+        int ret = avcodec_send_frame(videoEncodeContext, videoOutFrame);
+
+        while (ret == 0 && (ret = avcodec_receive_packet(videoEncodeContext, pkt)) == 0)
         {
-            av_packet_unref(pkt);
+            videoBytes += pkt->size;
+            pkt->stream_index = videoOutIndex;
+            av_packet_rescale_ts(pkt, videoEncodeContext->time_base, outFormatContext->streams[videoOutIndex]->time_base);
+            WritePacket(pkt);
         }
 
-        ret = avcodec_send_packet(videoDecodeContext, pkt);
+        encodeCost.Record(std::chrono::steady_clock::now() - encodeBegin);
+        av_packet_unref(pkt);
+        packetPool->Release(pkt);
 
-        if (ret != 0)
+        framesEncoded = sliceFrameIndex;
+        sliceLag = av_gettime() - captureTime;
+        sliceLagStats.Record(sliceLag * 1000);
+    }
+
+    av_packet_unref(slicePacket);
+
+    bool more;
+
+    {
+        // Notified under the lock: once the queue is idle, a stopping mux thread may release this recorder.
+        std::lock_guard<std::mutex> lk(mutexVideoBuffer);
+        more = sliceCount > 0;
+        sliceScheduled = more;
+
+        if (!more)
         {
-            av_packet_unref(pkt);
-            continue;
+            cvVideoBufferNotFull.notify_all();
         }
+    }
 
-        ret = avcodec_receive_frame(videoDecodeContext, oldFrame);
+    if (more)
+    {
+        workPool->Submit([this] { EncodeSlice(); }, sessionIndex);
+    }
+}
 
-        if (ret != 0)
+void ScreenRecord::PushVideo(AVFrame* frame)
+{
+    if (roiAnalyzer)
+    {
+        roiAnalyzer->Analyze(frame->data[0], frame->linesize[0], roiMap.data());
+    }
+
+    {
+        std::unique_lock<std::mutex> lk(mutexVideoBuffer);
+
+        // At a budget's cap the frame is dropped rather than holding up capture.
+        if (memory.Budget() && !videoRing->Free() && CaptureRunning())
         {
-            av_packet_unref(pkt);
-            continue;
+            framesDroppedAtCap++;
+            return;
         }
 
-        sws_scale(swsContext, (const uint8_t* const*)oldFrame->data, oldFrame->linesize, 0, videoEncodeContext->height, newFrame->data, newFrame->linesize);
+        // Past stop the filter graph's tail still waits for room, unless the mux thread has finished reading.
+        cvVideoBufferNotFull.wait(lk, [this] { return videoRing->Free() > 0 || videoReadDone; });
 
+        if (!videoRing->Free())
         {
-            std::unique_lock<std::mutex> lk(mutexVideoBuffer);
-            cvVideoBufferNotFull.wait(lk, [this] { return av_fifo_space(videoFifoBuffer) >= videoOutFrameSize; });
+            return;
         }
+    }
 
-        av_fifo_generic_write(videoFifoBuffer, newFrame->data[0], size, NULL);
-        av_fifo_generic_write(videoFifoBuffer, newFrame->data[1], size / 4, NULL);
-        av_fifo_generic_write(videoFifoBuffer, newFrame->data[2], size / 4, NULL);
-        cvVideoBufferNotEmpty.notify_one();
+    // The record keeps the aligned layout of the mux frame; frames coming out of the filter graph may have other strides.
+    uint8_t* record = videoRing->WriteSlot();
+    uint8_t* planes[4];
+    int linesizes[4];
 
-        frameWritten++;
+    av_image_fill_arrays(planes, linesizes, record, captureFormat.pixelFormat, encodeWidth, encodeHeight, FrameArena::Alignment);
+    av_image_copy(planes, linesizes, (const uint8_t**)frame->data, frame->linesize, captureFormat.pixelFormat, encodeWidth, encodeHeight);
 
-        av_packet_unref(pkt);
+    if (roiAnalyzer)
+    {
+        memcpy(record + videoImageSize, roiMap.data(), roiAnalyzer->MapSize());
     }
 
-    FlushVideoDecoder();
+    if (ingestReader)
+    {
+        memcpy(record + videoOutFrameSize - sizeof(frame->pts), &frame->pts, sizeof(frame->pts));
+    }
 
-    av_free(newFrameBuf);
-    av_frame_free(&oldFrame);
-    av_frame_free(&newFrame);
+    videoRing->Commit();
+    memory.Add(MemoryStage::VideoQueue, videoOutFrameSize);
+    cvVideoBufferNotEmpty.notify_one();
 }
 
-void ScreenRecord::SoundRecordThreadProc()
+// Called by the video capture thread once it sees the session stopped, so nothing it captured can
+// come after: the filter graph gives up the frames it holds back, and the mux thread may then stop
+// reading video as soon as the queue is empty.
+void ScreenRecord::QueueVideoTail()
 {
-    int ret = -1;
-    int nbSamples = numberOfSamples;
-    int dstNbSamples, maxDstNbSamples;
-    int frameWritten = 0;
+    if (filterStage)
+    {
+        filterStage->Flush(persistent);
+    }
 
-    AVFrame *rawFrame = av_frame_alloc();
-    AVFrame *newFrame = AllocAudioFrame(audioEncodeContext, nbSamples);
+    videoTailQueued = true;
+    cvVideoBufferNotEmpty.notify_one();
+}
 
-    AVPacket* pkt = av_packet_alloc();
-    av_init_packet(pkt);
+void ScreenRecord::AttachRoi()
+{
+    int n = roiAnalyzer->BuildRegions((const int8_t*)videoOutFrameBuffer + videoImageSize, roiRegions.data(), roiRegions.size());
+    AVFrameSideData* sd = av_frame_new_side_data(videoOutFrame, AV_FRAME_DATA_REGIONS_OF_INTEREST, n * sizeof(AVRegionOfInterest));
+
+    if (!sd)
+    {
+        LOG("Can't attach the region of interest map.");
+        return;
+    }
 
-    maxDstNbSamples = dstNbSamples = av_rescale_rnd(nbSamples, audioEncodeContext->sample_rate, audioDecodeContext->sample_rate, AV_ROUND_UP);
+    memcpy(sd->data, roiRegions.data(), n * sizeof(AVRegionOfInterest));
+}
 
-    while (state != RecordState::Stopped)
+bool ScreenRecord::PushAudio(AudioSource* source, uint8_t** data, int nbSamples)
+{
+    if (source->ring)
     {
-        if (state == RecordState::Paused)
-        {
-            LOG("Pausing the audio thread...");
-            std::unique_lock<std::mutex> lk(mutexPause);
-            cvNotPause.wait(lk, [this] { return state != RecordState::Paused; });
-        }
+        source->ring->Write((const float* const*)data, nbSamples);
+        return true;
+    }
 
-        if(frameWritten % 100 == 0 && frameWritten != 0)
-        {
-            LOG(std::string("Audio frame written: ").append(std::to_string(frameWritten)));
-        }
+    {
+        std::unique_lock<std::mutex> lk(mutexAudioBuffer);
+        cvAudioBufferNotFull.wait(lk, [nbSamples, this] { return av_audio_fifo_space(audioFifoBuffer) >= nbSamples || audioReadDone; });
 
-        if (av_read_frame(audioFormatContext, pkt) < 0)
+        // Past the stop deadline nothing reads the fifo any more.
+        if (audioReadDone)
         {
-            LOG("Can't read frame from the audio format context.");
-            continue;
+            return true;
         }
+    }
 
-        if (pkt->stream_index != audioIndex)
-        {
-            av_packet_unref(pkt);
-            continue;
-        }
+    if (av_audio_fifo_write(audioFifoBuffer, (void **)data, nbSamples) < nbSamples)
+    {
+        return false;
+    }
 
-        ret = avcodec_send_packet(audioDecodeContext, pkt);
+    memory.Add(MemoryStage::AudioQueue, (int64_t)nbSamples * audioFrameBytes);
 
-        if (ret != 0)
-        {
-            av_packet_unref(pkt);
-            continue;
-        }
+    cvAudioBufferNotEmpty.notify_one();
+    return true;
+}
 
-        ret = avcodec_receive_frame(audioDecodeContext, rawFrame);
+void ScreenRecord::MixThreadProc()
+{
+    int channels = captureFormat.channels;
+    int blockSize = numberOfSamples;
+    bool interleave = captureFormat.sampleFormat == AV_SAMPLE_FMT_FLT;
+    uint8_t *planes[AV_NUM_DATA_POINTERS] = { nullptr };
+    uint8_t *packed[1] = { nullptr };
+    int linesize;
 
-        if (ret != 0)
-        {
-            av_packet_unref(pkt);
-            continue;
-        }
+    placement.Enter("mix");
 
-        dstNbSamples = av_rescale_rnd(swr_get_delay(swrContext, audioDecodeContext->sample_rate) + rawFrame->nb_samples, audioEncodeContext->sample_rate, audioDecodeContext->sample_rate, AV_ROUND_UP);
+    if (av_samples_alloc(planes, &linesize, channels, blockSize, AV_SAMPLE_FMT_FLTP, 0) < 0 ||
+        av_samples_alloc(packed, &linesize, channels, blockSize, AV_SAMPLE_FMT_FLT, 0) < 0)
+    {
+        FATAL("Can't allocate mixer buffers.");
+    }
 
-        if (dstNbSamples > maxDstNbSamples)
+    // After stop, keeps mixing until every source has flushed its decoder and the master ring is empty.
+    for (;;)
+    {
+        // The rings are lock-free, so the mixer just polls the master source at a fraction of a block period.
+        if (!audioMixer->MixBlock((float* const*)planes))
         {
-            av_freep(&newFrame->data[0]);
-            ret = av_samples_alloc(newFrame->data, newFrame->linesize, audioEncodeContext->channels, dstNbSamples, audioEncodeContext->sample_fmt, 1);
-
-            if (ret < 0)
+            if (!(state == RecordState::Stopped && SourcesFlushed()))
             {
-                FATAL("Can't allocate audio samples.");
-                return;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
             }
 
-            maxDstNbSamples = dstNbSamples;
-            audioEncodeContext->frame_size = dstNbSamples;
-            numberOfSamples = newFrame->nb_samples;	
+            // Nothing more is coming: the master's tail, short of a block, goes out zero-padded.
+            if (!audioMixer->MixBlock((float* const*)planes, true))
+            {
+                break;
+            }
         }
 
-        newFrame->nb_samples = swr_convert(swrContext, newFrame->data, dstNbSamples, (const uint8_t **)rawFrame->data, rawFrame->nb_samples);
-
-        if (newFrame->nb_samples < 0)
+        if (interleave)
         {
-            FATAL("Can't convert raw audio frame to a new frame.");
-            return;
+            float *dst = (float*)packed[0];
+
+            for (int i = 0; i < blockSize; ++i)
+            {
+                for (int ch = 0; ch < channels; ++ch)
+                {
+                    dst[i * channels + ch] = ((float*)planes[ch])[i];
+                }
+            }
         }
 
         {
             std::unique_lock<std::mutex> lk(mutexAudioBuffer);
-            cvAudioBufferNotFull.wait(lk, [newFrame, this] { return av_audio_fifo_space(audioFifoBuffer) >= newFrame->nb_samples; });
-        }
+            cvAudioBufferNotFull.wait(lk, [blockSize, this] { return av_audio_fifo_space(audioFifoBuffer) >= blockSize || audioReadDone; });
 
-        if (av_audio_fifo_write(audioFifoBuffer, (void **)newFrame->data, newFrame->nb_samples) < newFrame->nb_samples)
-        {
-            FATAL("Can't write frame to the audio fifo buffer.");
-            return;
+            if (audioReadDone)
+            {
+                break;
+            }
         }
 
-        frameWritten++;
-
+        av_audio_fifo_write(audioFifoBuffer, interleave ? (void **)packed : (void **)planes, blockSize);
+        memory.Add(MemoryStage::AudioQueue, (int64_t)blockSize * audioFrameBytes);
         cvAudioBufferNotEmpty.notify_one();
     }
 
-    FlushAudioDecoder();
-    av_frame_free(&rawFrame);
-    av_frame_free(&newFrame);
+    av_freep(&planes[0]);
+    av_freep(&packed[0]);
+    mixing = false;
+    cvAudioBufferNotEmpty.notify_one();
+    placement.Leave("mix");
 }
@@ -1,6 +1,23 @@
 #pragma once
 
 #include "ffmpeg.h"
+#include "AVPool.h"
+#include "AudioMixer.h"
+#include "Cursor.h"
+#include "RoiMap.h"
+#include "FilterStage.h"
+#include "ThreadPlacement.h"
+#include "FrameArena.h"
+#include "RawSpool.h"
+#include "WorkPool.h"
+#include "Preview.h"
+#include "EncoderBackend.h"
+#include "FrameIngest.h"
+#include "PacketEgress.h"
+#include "MemoryBudget.h"
+
+#include <sstream>
+#include <vector>
 
 extern "C"
 {
@@ -20,39 +37,152 @@ class ScreenRecord
 private:
     enum RecordState {
         NotStarted,
+        Armed,
         Started,
         Paused,
         Stopped,
         Finished,
     };
 
+    // How a source's decoded audio reaches the encoder's format. Everything except Resample needs the
+    // encoder's rate and channel count already; the deinterleaving paths produce planar float.
+    enum class AudioConversion {
+        Resample,
+        Direct,
+        DeinterleaveFloat,
+        DeinterleaveS16,
+    };
+
+    // Which kernel ConvertVideo used on the last frame: swscale is the fallback for anything the
+    // BGR0 kernels don't cover.
+    enum class VideoConversion {
+        Swscale,
+        Direct444,
+        FusedDownscale,
+    };
+
+    struct AudioSource
+    {
+        int                 id;
+        std::string         device;
+        float               gain;
+        int                 index;
+        AVFormatContext*    formatContext;
+        AVCodecContext*     decodeContext;
+        SwrContext*         swrContext;
+        SampleRing*         ring;
+        AudioConversion     conversion;
+        DurationStats       convertCost;
+        int                 frameSize;          // conversion buffer in samples, grown by the capture thread only
+    };
+
+    // What the capture threads convert to, copied from the encoders when they are first opened. A persistent
+    // recorder frees and reopens the encoders between sessions while capture keeps running, so the capture
+    // threads never read the encoder contexts themselves.
+    struct CaptureFormat
+    {
+        AVPixelFormat       pixelFormat;
+        AVSampleFormat      sampleFormat;
+        int                 sampleRate;
+        int                 channels;
+        uint64_t            channelLayout;
+    };
+
 public:
     ScreenRecord(std::string path, std::string video, std::string audio, bool isAudioOn) :
-      fps(30), videoIndex(-1), audioIndex(-1)
-    , videoFormatContext(nullptr), audioFormatContext(nullptr)
+      outputWidth(0), outputHeight(0), encodeWidth(0), encodeHeight(0), scaleShift(0), fps(30), videoIndex(-1)
+    , videoFormatContext(nullptr)
     , outFormatContext(nullptr)
-    , videoDecodeContext(nullptr), audioDecodeContext(nullptr)
+    , videoDecodeContext(nullptr)
     , videoEncodeContext(nullptr), audioEncodeContext(nullptr)
-    , videoFifoBuffer(nullptr), audioFifoBuffer(nullptr)
-    , swsContext(nullptr), swrContext(nullptr)
+    , swsContext(nullptr)
+    , videoRing(nullptr), audioFifoBuffer(nullptr)
+    , audioFramePool(nullptr), packetPool(nullptr)
+    , audioMixer(nullptr)
     , state(RecordState::NotStarted)
     , videoCurrentPts(0), audioCurrentPts(0)
+    , videoResumePending(false), audioResumePending(false)
+    , audioFragmentSize(0), audioBufferDepth(30)
+    , audioSamplesCaptured(0), audioSamplesRead(0)
+    , fastStart(false), initialised(false)
+    , persistent(false), framesEncoded(0), sessionsCompleted(0), startPending(false)
+    , cursorOverlay(false), cursorTracker(nullptr)
+    , roiEnabled(false), roiAnalyzer(nullptr), videoImageSize(0)
+    , screenContent(false), lossless(false), chromaShift(1), videoBytes(0), convertBytes(0), videoConversion(VideoConversion::Swscale)
+    , filterStage(nullptr), coreBudget(0)
+    , hugePages(false), frameArena(nullptr), captureFrameBuffer(nullptr)
+    , stopDeadline(0), fastStartIndex(false), spool(false)
+    , burstSeconds(0), rawSpool(nullptr)
+    , videoFifoFrames(30), lateFrames(0)
+    , workPool(nullptr), sessionIndex(0), sliceHead(0), sliceCount(0), sliceScheduled(false)
+    , slicePacket(nullptr), sliceFrame(nullptr), sliceFrameIndex(0), sliceLag(0), slicesDropped(0)
+    , previewInterval(0), preview(nullptr), resamplerBypass(true)
+    , videoBackend("x264"), encoderPreset(EncoderPreset::Default)
+    , ingestReader(nullptr), outputSizeSet(false), firstIngestTimestamp(AV_NOPTS_VALUE), lastIngestPts(-1)
+    , egressMegabytes(16), egress(nullptr)
+    , latencyTarget(1000), muxCap(0), muxFlushes(0), framesDroppedAtCap(0), audioFrameBytes(0)
+    , audioSourcesFlushed(0), mixing(false), audioReadDone(false), videoTailQueued(true), videoReadDone(false)
+    , allocationCheck(false), allocationCheckFailed(false)
+    , firstFramePending(false)
     {
         av_log_set_level(AV_LOG_ERROR);
+        avdevice_register_all();
         filePath= path;
         audioBitrate = 128000;
         videoDevice = video;
         audioDevice = audio;
         recordAudio = isAudioOn;
+
+        // Several pulse sources can be mixed: "source1,source2@0.5", with an optional linear gain per source.
+        std::stringstream devices(audio);
+        std::string device;
+
+        while (std::getline(devices, device, ','))
+        {
+            AudioSource* source = new AudioSource();
+            size_t at = device.find('@');
+
+            source->id = audioSources.size();
+            source->device = device.substr(0, at);
+            source->gain = 1.0f;
+            source->index = -1;
+            source->frameSize = 0;
+
+            if (at != std::string::npos)
+            {
+                std::string text = device.substr(at + 1);
+                char* end = nullptr;
+                float gain = strtof(text.c_str(), &end);
+
+                if (text.empty() || *end || !(gain >= 0))
+                {
+                    std::cout << "Gain \"" << text << "\" of audio source " << source->device << " is not a valid gain, using 1." << std::endl;
+                }
+                else
+                {
+                    source->gain = gain;
+                }
+            }
+
+            audioSources.push_back(source);
+        }
     }
 
+    void Arm();
     void Start();
+    void Start(const std::string& path);
     void Pause();
     void Stop();
     void Resume();
 
     bool hasFinished()          { return state == RecordState::Finished; }
 
+    // Persistent recorders (daemon mode) keep devices and encoders open after Stop() and go back to
+    // Armed once the file is finalised, ready for the next Start(path). Shutdown() releases everything.
+    void SetPersistent(bool enabled)    { persistent = enabled; }
+    void Shutdown();
+    std::string Status();
+
     bool wasFatal()             { return fatal; }
 
     void SetDimensions(int w, int wo, int h, int ho)
@@ -61,8 +191,135 @@ public:
         height = h;
         widthOffset = wo;
         heightOffset = ho;
+        outputWidth = w;
+        outputHeight = h;
     }
 
+    // Capture and encode rate, 1 to 144 fps. GOP length, bitrate and the video fifo depth follow it.
+    void SetFrameRate(int rate)                 { fps = rate; }
+
+    // Encode at a different size than the captured region; exact 2x and 4x reductions of BGR0 input
+    // use the fused downscale-and-convert kernel, anything else goes through swscale.
+    void SetOutputSize(int w, int h)
+    {
+        outputWidth = w & ~1;
+        outputHeight = h & ~1;
+        outputSizeSet = true;
+    }
+
+    // Take frames from a producer's shared-memory ring (see FrameIngest.h) instead of x11grab. The
+    // ring sets the captured size, and the producer's timestamps drive the video pts.
+    void SetIngest(const std::string& path)
+    {
+        ingestPath = path;
+        cursorOverlay = false;
+    }
+
+    // Also publish every muxed packet into a POSIX shared-memory ring ("/recorder-packets") of
+    // `megabytes` that local readers map read-only (see PacketEgress.h).
+    void SetEgress(const std::string& shmName, int megabytes)
+    {
+        egressName = shmName;
+        egressMegabytes = megabytes;
+    }
+
+    // Size every queue from one memory budget and a latency target instead of fixed frame counts. At
+    // the cap a full video queue drops the frame and the muxer's interleaving queue is flushed, so memory
+    // never grows past the plan. Bytes per stage are accounted either way (see MemoryBudget.h).
+    void SetMemoryBudget(int megabytes, int latencyMs)
+    {
+        memory.SetBudget((size_t)megabytes * 1024 * 1024);
+        latencyTarget = latencyMs;
+    }
+
+    // libavfilter graph (e.g. "crop=1280:720:0:0,drawtext=...") run on its own thread between
+    // colour conversion and encode; the encoder takes the size the graph produces.
+    void SetFilter(const std::string& description) { filterDescription = description; }
+
+    // Thread placement: per-role core lists (see ThreadPlacement), SCHED_FIFO priority for the capture
+    // threads, and a total core budget from which the x264 thread count is derived.
+    bool SetAffinity(const std::string& spec)  { return placement.Parse(spec); }
+    void SetRealtimePriority(int priority)      { placement.SetRealtimePriority(priority); }
+    void SetCoreBudget(int cores)               { coreBudget = cores; }
+
+    // Take the large pixel buffers from one prefaulted huge-page arena instead of av_malloc.
+    void SetHugePages(bool enabled)             { hugePages = enabled; }
+
+    // Fail the recording if the mux thread allocates anything once it has encoded a second of video.
+    void SetAllocationCheck(bool enabled)       { allocationCheck = enabled; }
+    bool AllocationCheckFailed()                { return allocationCheckFailed; }
+
+    // Stop handling: drop queued frames not encoded within deadlineMs of stop (0 waits for all of
+    // them), and optionally move the MP4 index to the front of the finished file.
+    void SetStopDeadline(int deadlineMs)        { stopDeadline = deadlineMs; }
+    void SetFastStartIndex(bool enabled)        { fastStartIndex = enabled; }
+
+    // Capture to a lossless FFV1 spool next to the output and transcode it to H.264 in the background.
+    void SetSpool(bool enabled)                 { spool = enabled; }
+
+    // Burst capture: converted frames go to a memory-mapped ring file holding the last `seconds`
+    // seconds, nothing is encoded until "--encode-spool" is run on it. Video only.
+    void SetBurst(int seconds)
+    {
+        burstSeconds = seconds;
+        recordAudio = false;
+    }
+
+    // Encoder backends and speed preset (see EncoderBackend.h). An empty audio backend keeps the
+    // container's default audio codec.
+    void SetVideoBackend(const std::string& backend)    { videoBackend = backend; }
+    void SetAudioBackend(const std::string& backend)    { audioBackend = backend; }
+    void SetEncoderPreset(EncoderPreset preset)         { encoderPreset = preset; }
+
+    // Skip libswresample for sources already at the encoder's rate and channel count (default on);
+    // off forces every source through the resampler, e.g. to compare costs.
+    void SetResamplerBypass(bool enabled)       { resamplerBypass = enabled; }
+
+    // Live thumbnail every `seconds`: a JPEG next to the output ("<output>.preview.jpg") and, with a
+    // shmName, the raw planes in POSIX shared memory. Published on an idle-priority thread.
+    void SetPreview(double seconds, const std::string& shmName)
+    {
+        previewInterval = seconds;
+        previewShm = shmName;
+    }
+
+    // Farm session: colour conversion and encoding run as slices on a pool shared with other sessions
+    // instead of on this recorder's own threads, one frame per slice so sessions take turns. Video only,
+    // and x264 is limited to one thread because the pool already covers the cores.
+    void SetWorkPool(WorkPool* pool, int index)
+    {
+        workPool = pool;
+        sessionIndex = index;
+        recordAudio = false;
+    }
+
+    // Farm reporting: frames encoded in the current session, capture-to-encoded lag of the latest frame
+    // and frames dropped because the pool fell more than the slice queue behind.
+    int             FramesEncoded() const   { return framesEncoded; }
+    int64_t         SliceLag() const        { return sliceLag; }
+    int64_t         SlicesDropped() const   { return slicesDropped; }
+    const std::string& FilePath() const     { return filePath; }
+
+    // Low-latency audio: fragmentSize is the pulse fragment (and read) size in bytes, 0 keeps the
+    // libavdevice default; bufferDepth is the audio fifo depth in encoder frames.
+    void SetAudioLatency(int fragmentSize, int bufferDepth)
+    {
+        audioFragmentSize = fragmentSize;
+        audioBufferDepth = bufferDepth;
+    }
+
+    // Skip stream probing: x11grab and pulse already report their parameters when opened.
+    void SetFastStart(bool enabled)     { fastStart = enabled; }
+
+    // Grab without the pointer and composite a cached cursor image on the capture thread instead.
+    void SetCursorOverlay(bool enabled) { cursorOverlay = enabled; }
+
+    // Attach per-macroblock quantizer offsets from the screen-change map to every encoded frame.
+    void SetRoi(bool enabled)           { roiEnabled = enabled; }
+
+    // Encode 4:4:4 so coloured text and one-pixel UI lines keep their chroma; lossless also drops quantization.
+    void SetScreenContent(bool enabled, bool losslessMode) { screenContent = enabled || losslessMode; lossless = losslessMode; }
+
     void PrintDimensions()
     {
         std::cout << "Width: " << width << std::endl;
@@ -72,21 +329,47 @@ public:
     }
 
 private:
+    void            Initialise();
+    void            OpenEncoders();
+    void            FinishSession();
+    bool            CaptureRunning()    { return persistent || state != RecordState::Stopped; }
+    std::string     OutputPath() const  { return spool ? filePath + ".spool.mkv" : filePath; }
     void            MuxThreadProc();
     void            ScreenRecordThreadProc();
-    void            SoundRecordThreadProc();
+    void            IngestThreadProc();
+    int64_t         NextIngestPts(int64_t timestamp);
+    void            WritePacket(AVPacket* pkt);
+    void            SoundRecordThreadProc(AudioSource* source);
+    void            MixThreadProc();
 
     void            OpenVideo();
-    void            OpenAudio();
+    void            OpenAudio(AudioSource* source);
+    void            OpenVideoEncoder();
+    void            OpenAudioEncoder();
     void            OpenOutput();
+    void            InitResampler(AudioSource* source);
     void            LogStatus();
+    void            PrintCadence();
+    void            QueueSlice(AVPacket* pkt);
+    void            EncodeSlice();
 
-    AVFrame*        AllocAudioFrame(AVCodecContext* c, int nbSamples);
+    AVFrame*        AllocAudioFrame(AVSampleFormat format, int nbSamples);
+    AVFrame*        AcquireAudioFrame();
     void            InitVideoBuffer();
     void            InitAudioBuffer();
+    bool            PushAudio(AudioSource* source, uint8_t** data, int nbSamples);
+    bool            IsMixing()          { return audioSources.size() > 1; }
+
+    // Every capture thread has pushed its decoder's tail; a persistent recorder's capture threads don't
+    // flush between sessions, they just stop queueing.
+    bool            SourcesFlushed()    { return persistent || audioSourcesFlushed == (int)audioSources.size(); }
+    void            ConvertVideo(AVFrame* src, AVFrame* dst);
+    void            PushVideo(AVFrame* frame);
+    void            QueueVideoTail();
+    void            AttachRoi();
 
     void            FlushVideoDecoder();
-    void            FlushAudioDecoder();
+    void            FlushAudioDecoder(AudioSource* source);
     int*            FlushEncoders();
 
     void            Release();
@@ -99,27 +382,34 @@ private:
     int                         height;
     int                         widthOffset;
     int                         heightOffset;
+    int                         outputWidth;
+    int                         outputHeight;
+    int                         encodeWidth;
+    int                         encodeHeight;
+    int                         scaleShift;
     int                         fps;
     int                         audioBitrate;
 
     int                         videoIndex;       
-    int                         audioIndex;       
     int                         videoOutIndex;   
     int                         audioOutIndex; 
 
     AVFormatContext*            videoFormatContext;
-    AVFormatContext*            audioFormatContext;
     AVFormatContext*            outFormatContext;
 
     AVCodecContext*             videoDecodeContext;
-    AVCodecContext*             audioDecodeContext;
     AVCodecContext*             videoEncodeContext;
     AVCodecContext*             audioEncodeContext;
+    CaptureFormat               captureFormat;
     SwsContext*                 swsContext;
-    SwrContext*                 swrContext;
-    AVFifoBuffer*               videoFifoBuffer;
+    FrameRing*                  videoRing;
     AVAudioFifo*                audioFifoBuffer;
     AVInputFormat*              audioInputFormat;
+    FramePool*                  audioFramePool;
+    PacketPool*                 packetPool;
+
+    std::vector<AudioSource*>   audioSources;
+    AudioMixer*                 audioMixer;
 
     bool                        fatal;
     bool                        recordAudio;
@@ -130,10 +420,7 @@ private:
 
     int                         numberOfSamples;
     
-    RecordState                 state;
-
-    std::condition_variable     cvNotPause;  
-    std::mutex                  mutexPause;
+    std::atomic<RecordState>    state;
 
     std::condition_variable     cvVideoBufferNotFull;
     std::condition_variable     cvVideoBufferNotEmpty;
@@ -145,4 +432,122 @@ private:
 
     int64_t                     videoCurrentPts;
     int64_t                     audioCurrentPts;
+
+    std::chrono::steady_clock::time_point resumeTime;
+    std::atomic<bool>           videoResumePending;
+    std::atomic<bool>           audioResumePending;
+
+    int                         audioFragmentSize;
+    int                         audioBufferDepth;
+    int64_t                     audioSamplesCaptured;
+    int64_t                     audioSamplesRead;
+    TimestampQueue              audioCaptureTimes;
+    DurationStats               audioLatency;
+
+    bool                        fastStart;
+    bool                        initialised;
+    std::thread                 mixThread;
+    std::vector<std::thread>    captureThreads;
+
+    std::atomic<bool>           persistent;
+    std::atomic<int>            framesEncoded;
+    int                         sessionsCompleted;
+    std::condition_variable     cvSessionEnded;
+    std::mutex                  mutexSession;
+    std::string                 pendingPath;      // a start received while the previous session finalises
+    bool                        startPending;
+
+    bool                        cursorOverlay;
+    CursorTracker*              cursorTracker;
+
+    bool                        roiEnabled;
+    RoiAnalyzer*                roiAnalyzer;
+    int                         videoImageSize;
+    std::vector<int8_t>         roiMap;
+    std::vector<AVRegionOfInterest> roiRegions;
+
+    bool                        screenContent;
+    bool                        lossless;
+    int                         chromaShift;
+    int64_t                     videoBytes;
+    DurationStats               convertCost;
+    int64_t                     convertBytes;
+    VideoConversion             videoConversion;
+    DurationStats               encodeCost;
+
+    std::string                 filterDescription;
+    FilterStage*                filterStage;
+
+    ThreadPlacement             placement;
+    int                         coreBudget;
+
+    bool                        hugePages;
+    FrameArena*                 frameArena;
+    uint8_t*                    captureFrameBuffer;
+
+    int                         stopDeadline;
+    bool                        fastStartIndex;
+    std::chrono::steady_clock::time_point stopTime;
+
+    bool                        spool;
+
+    int                         burstSeconds;
+    RawSpoolWriter*             rawSpool;
+
+    int                         videoFifoFrames;
+    DurationStats               frameInterval;
+    DurationStats               frameJitter;
+    DurationStats               captureCost;
+    int64_t                     lateFrames;
+
+    WorkPool*                   workPool;
+    int                         sessionIndex;
+    std::vector<AVPacket*>      sliceQueue;
+    size_t                      sliceHead;
+    size_t                      sliceCount;
+    bool                        sliceScheduled;
+    AVPacket*                   slicePacket;
+    AVFrame*                    sliceFrame;
+    int                         sliceFrameIndex;
+    std::atomic<int64_t>        sliceLag;
+    std::atomic<int64_t>        slicesDropped;
+    DurationStats               sliceLagStats;
+
+    double                      previewInterval;
+    std::string                 previewShm;
+    PreviewPublisher*           preview;
+
+    bool                        resamplerBypass;
+
+    std::string                 videoBackend;
+    std::string                 audioBackend;
+    EncoderPreset               encoderPreset;
+
+    std::string                 ingestPath;
+    IngestReader*               ingestReader;
+    bool                        outputSizeSet;
+    int64_t                     firstIngestTimestamp;
+    int64_t                     lastIngestPts;
+
+    std::string                 egressName;
+    int                         egressMegabytes;
+    PacketEgress*               egress;
+
+    MemoryBudget                memory;
+    int                         latencyTarget;
+    int64_t                     muxCap;
+    InterleaveMeter             muxMeter;
+    int64_t                     muxFlushes;
+    std::atomic<int64_t>        framesDroppedAtCap;
+    int                         audioFrameBytes;
+    std::atomic<int>            audioSourcesFlushed;
+    std::atomic<bool>           mixing;
+    bool                        audioReadDone;    // the mux thread reads no more audio; under mutexAudioBuffer
+    std::atomic<bool>           videoTailQueued;  // the session's last frames are in the video queue
+    bool                        videoReadDone;    // the mux thread reads no more video; under mutexVideoBuffer
+    bool                        allocationCheck;
+    std::atomic<bool>           allocationCheckFailed;
+
+    std::chrono::steady_clock::time_point startTime;
+    std::atomic<bool>           firstFramePending;
 };
\ No newline at end of file
@@ -0,0 +1,173 @@
+#pragma once
+
+#include "ffmpeg.h"
+
+#include <algorithm>
+#include <time.h>
+
+// Log-linear histogram of durations in nanoseconds (32 sub-buckets per power of two, so about 3%
+// resolution). Storage is fixed at construction: recording a sample never allocates, which keeps
+// it usable from the capture and mux hot paths. Recording is single-threaded; read it once the
+// owning thread is done.
+class DurationStats
+{
+public:
+    DurationStats() : count(0), sum(0), max(0)
+    {
+        memset(buckets, 0, sizeof(buckets));
+    }
+
+    void Record(int64_t ns)
+    {
+        if (ns < 0)
+        {
+            ns = 0;
+        }
+
+        buckets[BucketOf((uint64_t)ns)]++;
+        count++;
+        sum += ns;
+
+        if (ns > max)
+        {
+            max = ns;
+        }
+    }
+
+    void Record(std::chrono::steady_clock::duration d)
+    {
+        Record((int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+    }
+
+    int64_t Count() const       { return count; }
+    int64_t Max() const         { return max; }
+    double  Mean() const        { return count ? (double)sum / count : 0.0; }
+
+    int64_t Percentile(double p) const
+    {
+        if (!count)
+        {
+            return 0;
+        }
+
+        int64_t rank = (int64_t)(p / 100.0 * count);
+        int64_t seen = 0;
+
+        for (int i = 0; i < NumBuckets; ++i)
+        {
+            seen += buckets[i];
+
+            if (seen > rank)
+            {
+                return std::min<int64_t>(UpperBound(i), max);
+            }
+        }
+
+        return max;
+    }
+
+    // "<name>: n=..., mean=..., p50=..., p99=..., max=..." with values divided by scale (1000 for us, 1000000 for ms).
+    void Print(const std::string& name, const char* unit = "us", double scale = 1000.0) const
+    {
+        std::cout << name << ": n=" << count
+        << ", mean=" << Mean() / scale << unit
+        << ", p50=" << Percentile(50) / scale << unit
+        << ", p99=" << Percentile(99) / scale << unit
+        << ", max=" << max / scale << unit << std::endl;
+    }
+
+private:
+    static const int SubBits = 5;
+    static const int NumBuckets = (64 - SubBits + 1) << SubBits;
+
+    static int BucketOf(uint64_t v)
+    {
+        if (v < (1u << SubBits))
+        {
+            return (int)v;
+        }
+
+        int exp = 63 - __builtin_clzll(v);
+        int shift = exp - SubBits;
+
+        return ((shift + 1) << SubBits) + (int)((v >> shift) & ((1u << SubBits) - 1));
+    }
+
+    static int64_t UpperBound(int bucket)
+    {
+        int group = bucket >> SubBits;
+        int64_t sub = bucket & ((1 << SubBits) - 1);
+
+        if (group == 0)
+        {
+            return sub;
+        }
+
+        int shift = group - 1;
+        return (((int64_t)1 << SubBits | sub) << shift) + ((int64_t)1 << shift) - 1;
+    }
+
+    int64_t     buckets[NumBuckets];
+    int64_t     count;
+    int64_t     sum;
+    int64_t     max;
+};
+
+// CPU time consumed by the calling thread, for costs that should not include time spent blocked.
+inline int64_t ThreadCpuNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Maps a running sample (or frame) position back to the wall-clock time it was captured at.
+// Producers push (end position, capture time) per chunk, the consumer asks for the capture time
+// of the position it is about to encode. Fixed capacity; the oldest entries are overwritten
+// when the consumer falls behind. Not thread-safe: guard it with the lock of the buffer it tracks.
+class TimestampQueue
+{
+public:
+    TimestampQueue() : head(0), tail(0) {}
+
+    void Push(int64_t endPosition, int64_t time)
+    {
+        if (tail - head == Capacity)
+        {
+            head++;
+        }
+
+        entries[tail % Capacity] = Entry{ endPosition, time };
+        tail++;
+    }
+
+    void Reset()
+    {
+        head = tail = 0;
+    }
+
+    // Capture time of the chunk holding position, or AV_NOPTS_VALUE if it was never recorded.
+    int64_t TimeOf(int64_t position)
+    {
+        while (head < tail && entries[head % Capacity].endPosition <= position)
+        {
+            head++;
+        }
+
+        return head < tail ? entries[head % Capacity].time : AV_NOPTS_VALUE;
+    }
+
+private:
+    struct Entry
+    {
+        int64_t endPosition;
+        int64_t time;
+    };
+
+    static const int64_t Capacity = 1024;
+
+    Entry       entries[Capacity];
+    int64_t     head;
+    int64_t     tail;
+};
@@ -0,0 +1,200 @@
+#include "ThreadPlacement.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// dTLB load misses of the calling thread in user space; -1 where perf events are unavailable.
+static thread_local int dtlbCounter = -1;
+
+static int OpenDtlbCounter()
+{
+    perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static std::string CpuList(const cpu_set_t& set)
+{
+    std::ostringstream out;
+    int first = -1;
+
+    for (int cpu = 0; cpu <= CPU_SETSIZE; ++cpu)
+    {
+        bool in = cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set);
+
+        if (in && first < 0)
+        {
+            first = cpu;
+        }
+        else if (!in && first >= 0)
+        {
+            out << (out.tellp() > 0 ? "," : "") << first;
+
+            if (cpu - 1 > first)
+            {
+                out << "-" << cpu - 1;
+            }
+
+            first = -1;
+        }
+    }
+
+    return out.str();
+}
+
+ThreadPlacement::ThreadPlacement() : realtimePriority(0)
+{
+}
+
+bool ThreadPlacement::Parse(const std::string& spec)
+{
+    std::istringstream entries(spec);
+    std::string entry;
+
+    while (std::getline(entries, entry, ','))
+    {
+        size_t colon = entry.find(':');
+
+        if (colon == std::string::npos)
+        {
+            return false;
+        }
+
+        std::string role = entry.substr(0, colon);
+        int first, last;
+
+        if (sscanf(entry.c_str() + colon + 1, "%d-%d", &first, &last) == 2)
+        {
+            for (int cpu = first; cpu <= last; ++cpu)
+            {
+                cpus[role].push_back(cpu);
+            }
+        }
+        else if (sscanf(entry.c_str() + colon + 1, "%d", &first) == 1)
+        {
+            cpus[role].push_back(first);
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void ThreadPlacement::Enter(const std::string& role, bool realtime)
+{
+    std::ostringstream placement;
+    cpu_set_t set;
+    auto it = cpus.find(role);
+
+    if (it != cpus.end())
+    {
+        CPU_ZERO(&set);
+
+        for (int cpu : it->second)
+        {
+            CPU_SET(cpu, &set);
+        }
+
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        {
+            placement << "(pinning refused) ";
+        }
+    }
+
+    if (realtime && realtimePriority > 0)
+    {
+        sched_param param;
+        param.sched_priority = realtimePriority;
+
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+        {
+            placement << "(SCHED_FIFO refused) ";
+        }
+    }
+
+    if (dtlbCounter >= 0)
+    {
+        close(dtlbCounter);
+    }
+
+    dtlbCounter = OpenDtlbCounter();
+
+    // Report what the kernel actually applied, not what was asked for.
+    int policy;
+    sched_param param;
+
+    pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+    pthread_getschedparam(pthread_self(), &policy, &param);
+    placement << "cpus " << CpuList(set) << ", " << (policy == SCHED_FIFO ? "SCHED_FIFO " + std::to_string(param.sched_priority) : std::string("SCHED_OTHER"));
+
+    std::lock_guard<std::mutex> lk(mutexReports);
+    Report& report = reports[role];
+
+    report.placement = placement.str();
+}
+
+void ThreadPlacement::Leave(const std::string& role)
+{
+    rusage usage;
+
+    int64_t dtlbMisses = -1;
+
+    getrusage(RUSAGE_THREAD, &usage);
+
+    if (dtlbCounter >= 0)
+    {
+        if (read(dtlbCounter, &dtlbMisses, sizeof(dtlbMisses)) != sizeof(dtlbMisses))
+        {
+            dtlbMisses = -1;
+        }
+
+        close(dtlbCounter);
+        dtlbCounter = -1;
+    }
+
+    std::lock_guard<std::mutex> lk(mutexReports);
+    Report& report = reports[role];
+
+    report.pageFaults += usage.ru_minflt + usage.ru_majflt;
+    report.dtlbMisses = dtlbMisses < 0 || report.dtlbMisses < 0 ? -1 : report.dtlbMisses + dtlbMisses;
+
+    report.threads++;
+    report.lastCpu = sched_getcpu();
+    report.voluntarySwitches += usage.ru_nvcsw;
+    report.involuntarySwitches += usage.ru_nivcsw;
+}
+
+void ThreadPlacement::Print()
+{
+    std::lock_guard<std::mutex> lk(mutexReports);
+
+    for (auto& it : reports)
+    {
+        const Report& report = it.second;
+
+        std::cout << "Thread " << it.first << ": " << report.placement;
+
+        if (report.threads)
+        {
+            std::cout << ", last on cpu " << report.lastCpu << ", " << report.voluntarySwitches << " voluntary and "
+            << report.involuntarySwitches << " involuntary context switches, " << report.pageFaults << " page faults, "
+            << (report.dtlbMisses < 0 ? std::string("n/a") : std::to_string(report.dtlbMisses)) << " dTLB misses over " << report.threads << " thread(s)";
+        }
+
+        std::cout << "." << std::endl;
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "ffmpeg.h"
+
+#include <map>
+#include <vector>
+
+// Pins pipeline threads to configured cores, optionally runs the capture threads under SCHED_FIFO,
+// and collects per-thread figures (last CPU, context switches, page faults, dTLB misses) for the
+// final report.
+// Threads are identified by role: "video", "audio", "mix", "mux", "filter" and "encoder"; the
+// latter is the thread that opens the video encoder, whose worker threads inherit its affinity.
+class ThreadPlacement
+{
+public:
+    ThreadPlacement();
+
+    // "video:2,audio:3,mux:4-5,encoder:8-15"; returns false on a malformed spec.
+    bool            Parse(const std::string& spec);
+    void            SetRealtimePriority(int priority)   { realtimePriority = priority; }
+    bool            Configured() const                  { return !cpus.empty() || realtimePriority > 0; }
+
+    // Called on the thread itself when it starts and just before it returns.
+    void            Enter(const std::string& role, bool realtime = false);
+    void            Leave(const std::string& role);
+
+    void            Print();
+
+private:
+    struct Report
+    {
+        std::string     placement;
+        int             threads;
+        int             lastCpu;
+        int64_t         voluntarySwitches;
+        int64_t         involuntarySwitches;
+        int64_t         pageFaults;
+        int64_t         dtlbMisses;
+    };
+
+    std::map<std::string, std::vector<int>> cpus;
+    int                                     realtimePriority;
+    std::map<std::string, Report>           reports;
+    std::mutex                              mutexReports;
+};
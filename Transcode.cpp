@@ -0,0 +1,374 @@
+#include "Transcode.h"
+#include "FastStart.h"
+#include "RawSpool.h"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+// From linux/ioprio.h, which isn't exported to user space on every distribution.
+static const int IoprioWhoProcess = 1;
+static const int IoprioClassIdle = 3;
+static const int IoprioClassShift = 13;
+
+static void LowerPriority()
+{
+    if (setpriority(PRIO_PROCESS, 0, 19) != 0)
+    {
+        std::cout << "Transcode: can't lower the CPU priority." << std::endl;
+    }
+
+    if (syscall(SYS_ioprio_set, IoprioWhoProcess, 0, IoprioClassIdle << IoprioClassShift) != 0)
+    {
+        std::cout << "Transcode: can't switch to idle I/O priority." << std::endl;
+    }
+}
+
+// Built like the live encoder, from the recorder's backend, preset and frame rate, so a spooled
+// capture ends up like a direct one.
+static AVCodecContext* OpenEncoder(const TranscodeSettings& settings, int width, int height, AVPixelFormat format, AVRational timeBase, int fps, bool globalHeader)
+{
+    AVCodec* encoder = FindVideoBackend(settings.backend);
+    AVCodecContext* c = encoder ? avcodec_alloc_context3(encoder) : nullptr;
+    AVDictionary* options = nullptr;
+
+    if (!c)
+    {
+        return nullptr;
+    }
+
+    c->width = width;
+    c->height = height;
+    c->pix_fmt = format;
+    c->time_base = timeBase;
+    c->framerate = AVRational{ fps, 1 };
+    ApplyVideoRateControl(c, fps);
+    ApplyVideoPreset(settings.backend, settings.preset, c, &options);
+
+    if (globalHeader)
+    {
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if (avcodec_open2(c, encoder, &options) < 0)
+    {
+        avcodec_free_context(&c);
+    }
+
+    av_dict_free(&options);
+    return c;
+}
+
+int TranscodeSpool(const std::string& spoolPath, const std::string& outputPath, const TranscodeSettings& settings, bool faststart)
+{
+    auto begin = std::chrono::steady_clock::now();
+    AVFormatContext* in = nullptr;
+    AVFormatContext* out = nullptr;
+    AVCodecContext* decodeContext = nullptr;
+    AVCodecContext* encodeContext = nullptr;
+    int videoIn = -1, videoOut = -1, audioIn = -1, audioOut = -1;
+    int64_t frames = 0;
+    bool ok = false;
+
+    LowerPriority();
+
+    if (avformat_open_input(&in, spoolPath.c_str(), nullptr, nullptr) != 0 || avformat_find_stream_info(in, nullptr) < 0)
+    {
+        std::cout << "Transcode: can't open " << spoolPath << "." << std::endl;
+        return -1;
+    }
+
+    if (avformat_alloc_output_context2(&out, nullptr, nullptr, outputPath.c_str()) < 0)
+    {
+        std::cout << "Transcode: can't create " << outputPath << "." << std::endl;
+        avformat_close_input(&in);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < in->nb_streams; ++i)
+    {
+        AVStream* stream = in->streams[i];
+
+        if (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && videoIn < 0)
+        {
+            AVCodec* decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+
+            decodeContext = avcodec_alloc_context3(decoder);
+            avcodec_parameters_to_context(decodeContext, stream->codecpar);
+            decodeContext->thread_count = 0;
+
+            if (!decoder || avcodec_open2(decodeContext, decoder, nullptr) < 0)
+            {
+                std::cout << "Transcode: can't decode the spooled video." << std::endl;
+                break;
+            }
+
+            // Older spools don't say what rate they were captured at; their stream does.
+            int fps = settings.fps > 0 ? settings.fps : std::max(1, (int)(av_q2d(stream->avg_frame_rate) + 0.5));
+
+            encodeContext = OpenEncoder(settings, decodeContext->width, decodeContext->height, decodeContext->pix_fmt, stream->time_base, fps, out->oformat->flags & AVFMT_GLOBALHEADER);
+
+            if (!encodeContext)
+            {
+                std::cout << "Transcode: can't open the " << settings.backend << " encoder." << std::endl;
+                break;
+            }
+
+            AVStream* outStream = avformat_new_stream(out, nullptr);
+
+            avcodec_parameters_from_context(outStream->codecpar, encodeContext);
+            outStream->time_base = stream->time_base;
+            videoIn = i;
+            videoOut = outStream->index;
+        }
+        else if (stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audioIn < 0)
+        {
+            // The audio was already encoded in its final codec during capture; it's only remuxed.
+            AVStream* outStream = avformat_new_stream(out, nullptr);
+
+            avcodec_parameters_copy(outStream->codecpar, stream->codecpar);
+            outStream->codecpar->codec_tag = 0;
+            outStream->time_base = stream->time_base;
+            audioIn = i;
+            audioOut = outStream->index;
+        }
+    }
+
+    bool opened = encodeContext && avio_open(&out->pb, outputPath.c_str(), AVIO_FLAG_WRITE) >= 0;
+
+    if (opened && avformat_write_header(out, nullptr) >= 0)
+    {
+        AVPacket* pkt = av_packet_alloc();
+        AVPacket* encoded = av_packet_alloc();
+        AVFrame* frame = av_frame_alloc();
+        bool draining = false;
+
+        // Encoder output for everything sent so far; a NULL frame flushes it.
+        auto encode = [&](AVFrame* f)
+        {
+            avcodec_send_frame(encodeContext, f);
+
+            while (avcodec_receive_packet(encodeContext, encoded) == 0)
+            {
+                encoded->stream_index = videoOut;
+                av_packet_rescale_ts(encoded, encodeContext->time_base, out->streams[videoOut]->time_base);
+                av_interleaved_write_frame(out, encoded);
+            }
+        };
+
+        while (!draining)
+        {
+            if (av_read_frame(in, pkt) < 0)
+            {
+                draining = true;
+                avcodec_send_packet(decodeContext, nullptr);
+            }
+            else if (pkt->stream_index == audioIn)
+            {
+                pkt->stream_index = audioOut;
+                av_packet_rescale_ts(pkt, in->streams[audioIn]->time_base, out->streams[audioOut]->time_base);
+                av_interleaved_write_frame(out, pkt);
+                continue;
+            }
+            else if (pkt->stream_index == videoIn)
+            {
+                avcodec_send_packet(decodeContext, pkt);
+                av_packet_unref(pkt);
+            }
+            else
+            {
+                av_packet_unref(pkt);
+                continue;
+            }
+
+            while (avcodec_receive_frame(decodeContext, frame) == 0)
+            {
+                frame->pts = frame->best_effort_timestamp;
+                frame->pict_type = AV_PICTURE_TYPE_NONE;
+                encode(frame);
+                av_frame_unref(frame);
+                frames++;
+            }
+        }
+
+        encode(nullptr);
+        ok = av_write_trailer(out) == 0;
+
+        av_frame_free(&frame);
+        av_packet_free(&encoded);
+        av_packet_free(&pkt);
+    }
+
+    if (opened)
+    {
+        avio_closep(&out->pb);
+    }
+
+    avcodec_free_context(&encodeContext);
+    avcodec_free_context(&decodeContext);
+    avformat_free_context(out);
+    avformat_close_input(&in);
+
+    if (!ok)
+    {
+        // The spool is kept for another try; a partial output would only be mistaken for the result.
+        if (opened)
+        {
+            unlink(outputPath.c_str());
+        }
+
+        std::cout << "Transcode of " << spoolPath << " failed, spool kept." << std::endl;
+        return -1;
+    }
+
+    if (faststart)
+    {
+        MoveIndexToFront(outputPath);
+    }
+
+    unlink(spoolPath.c_str());
+
+    std::cout << "Transcoded " << frames << " frames from " << spoolPath << " to " << outputPath << " in "
+    << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count() / 1000.0 << " s." << std::endl;
+
+    return 0;
+}
+
+int EncodeRawSpool(const std::string& spoolPath, const std::string& outputPath, const TranscodeSettings& settings)
+{
+    auto begin = std::chrono::steady_clock::now();
+    AVFormatContext* out = nullptr;
+    AVCodecContext* encodeContext = nullptr;
+    int64_t frames = 0;
+
+    try
+    {
+        RawSpoolReader spool(spoolPath);
+        const RawSpoolHeader& header = spool.Header();
+        AVRational timeBase = AV_TIME_BASE_Q;
+
+        if (avformat_alloc_output_context2(&out, nullptr, nullptr, outputPath.c_str()) < 0)
+        {
+            throw std::runtime_error("Can't create " + outputPath + ".");
+        }
+
+        encodeContext = OpenEncoder(settings, header.width, header.height, (AVPixelFormat)header.format, timeBase, settings.fps > 0 ? settings.fps : header.fps, out->oformat->flags & AVFMT_GLOBALHEADER);
+
+        if (!encodeContext)
+        {
+            throw std::runtime_error("Can't open the " + settings.backend + " encoder.");
+        }
+
+        AVStream* stream = avformat_new_stream(out, nullptr);
+
+        avcodec_parameters_from_context(stream->codecpar, encodeContext);
+        stream->time_base = timeBase;
+
+        if (avio_open(&out->pb, outputPath.c_str(), AVIO_FLAG_WRITE) < 0 || avformat_write_header(out, nullptr) < 0)
+        {
+            throw std::runtime_error("Can't write " + outputPath + ".");
+        }
+
+        AVFrame* frame = av_frame_alloc();
+        AVPacket* pkt = av_packet_alloc();
+        int64_t firstTimestamp = AV_NOPTS_VALUE;
+
+        auto encode = [&](AVFrame* f)
+        {
+            avcodec_send_frame(encodeContext, f);
+
+            while (avcodec_receive_packet(encodeContext, pkt) == 0)
+            {
+                pkt->stream_index = stream->index;
+                av_packet_rescale_ts(pkt, encodeContext->time_base, stream->time_base);
+                av_interleaved_write_frame(out, pkt);
+            }
+        };
+
+        frame->width = header.width;
+        frame->height = header.height;
+        frame->format = header.format;
+
+        // Frames keep their capture timestamps, so gaps from drops stay visible in the output timing.
+        for (uint64_t i = 0; i < spool.Count(); ++i)
+        {
+            int64_t timestamp;
+            const uint8_t* pixels = spool.Frame(i, &timestamp);
+
+            if (firstTimestamp == AV_NOPTS_VALUE)
+            {
+                firstTimestamp = timestamp;
+            }
+
+            av_image_fill_arrays(frame->data, frame->linesize, pixels, (AVPixelFormat)header.format, header.width, header.height, 1);
+            frame->pts = timestamp - firstTimestamp;
+            encode(frame);
+            frames++;
+        }
+
+        encode(nullptr);
+        av_write_trailer(out);
+        avio_closep(&out->pb);
+        av_packet_free(&pkt);
+        av_frame_free(&frame);
+
+        std::cout << "Encoded " << frames << " spooled frames (" << header.framesDropped << " dropped during capture) into " << outputPath << " in "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin).count() / 1000.0 << " s." << std::endl;
+    }
+    catch (std::exception& e)
+    {
+        std::cout << "[ERROR]  " << e.what() << std::endl;
+        frames = -1;
+    }
+
+    avcodec_free_context(&encodeContext);
+
+    if (out)
+    {
+        avio_closep(&out->pb);
+        avformat_free_context(out);
+    }
+
+    return frames < 0 ? -1 : 0;
+}
+
+bool LaunchTranscode(const std::string& spoolPath, const std::string& outputPath, const TranscodeSettings& settings, bool faststart)
+{
+    // Everything the child needs is built before fork: only exec-safe calls happen in between.
+    std::string spoolArgument = "--transcode-spool=" + spoolPath;
+    std::string backendArgument = "--video-encoder=" + settings.backend;
+    std::string presetArgument = std::string("--preset=") + EncoderPresetName(settings.preset);
+    std::string fpsArgument = "--fps=" + std::to_string(settings.fps);
+    std::vector<const char*> argv = { "main", spoolArgument.c_str(), outputPath.c_str(), backendArgument.c_str(), fpsArgument.c_str() };
+
+    // The default preset has no name the option parser takes; leaving it out keeps the default.
+    if (settings.preset != EncoderPreset::Default)
+    {
+        argv.push_back(presetArgument.c_str());
+    }
+
+    if (faststart)
+    {
+        argv.push_back("--faststart");
+    }
+
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        execv("/proc/self/exe", (char* const*)argv.data());
+        _exit(127);
+    }
+
+    if (pid < 0)
+    {
+        return false;
+    }
+
+    // Reap the worker so a long-running daemon doesn't collect zombies.
+    std::thread([pid] { int status; waitpid(pid, &status, 0); }).detach();
+
+    return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "EncoderBackend.h"
+
+// The recorder's video encoder settings, so a deferred encode matches a live one.
+struct TranscodeSettings
+{
+    std::string     backend;            // a video backend from EncoderBackend.h
+    EncoderPreset   preset;
+    int             fps;                // the recording's frame rate; 0: taken from the spool
+};
+
+// Turns a lossless capture spool (FFV1 video plus the final audio track, in Matroska) into the
+// final MP4 at idle CPU and I/O priority, then deletes the spool. Runs in its own process so
+// it outlives the recorder and never competes with a live capture for cycles.
+int TranscodeSpool(const std::string& spoolPath, const std::string& outputPath, const TranscodeSettings& settings, bool faststart);
+
+// Encodes a burst spool (see RawSpool.h), keeping each frame's capture timestamp.
+int EncodeRawSpool(const std::string& spoolPath, const std::string& outputPath, const TranscodeSettings& settings);
+
+// Starts "<this executable> --transcode-spool=<spool> <output> --video-encoder=<backend> --preset=<preset>
+// --fps=<fps> [--faststart]" in the background.
+bool LaunchTranscode(const std::string& spoolPath, const std::string& outputPath, const TranscodeSettings& settings, bool faststart);
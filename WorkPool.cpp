@@ -0,0 +1,133 @@
+#include "WorkPool.h"
+
+#include <iostream>
+
+thread_local int WorkPool::currentWorker = -1;
+
+WorkPool::WorkPool(int count) : pending(0), running(true)
+{
+    if (count <= 0)
+    {
+        count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        Worker* worker = new Worker();
+
+        worker->executed = 0;
+        worker->stolen = 0;
+        workers.push_back(worker);
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        workers[i]->thread = std::thread(&WorkPool::ThreadProc, this, i);
+    }
+}
+
+WorkPool::~WorkPool()
+{
+    {
+        std::lock_guard<std::mutex> lk(mutexIdle);
+        running = false;
+    }
+
+    cvWork.notify_all();
+
+    for (Worker* worker : workers)
+    {
+        worker->thread.join();
+        delete worker;
+    }
+}
+
+void WorkPool::Submit(Task task, int home)
+{
+    Worker* worker = workers[currentWorker >= 0 ? currentWorker : home % workers.size()];
+
+    {
+        std::lock_guard<std::mutex> lk(worker->mutex);
+        worker->tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(mutexIdle);
+        pending++;
+    }
+
+    cvWork.notify_one();
+}
+
+// Own deque from the front, so a worker's tasks run in submission order; steals take the back,
+// the task its owner would have reached last.
+bool WorkPool::Take(int index, Task& task)
+{
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        Worker* worker = workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lk(worker->mutex);
+
+        if (worker->tasks.empty())
+        {
+            continue;
+        }
+
+        if (i == 0)
+        {
+            task = std::move(worker->tasks.front());
+            worker->tasks.pop_front();
+        }
+        else
+        {
+            task = std::move(worker->tasks.back());
+            worker->tasks.pop_back();
+            workers[index]->stolen++;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+void WorkPool::ThreadProc(int index)
+{
+    currentWorker = index;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lk(mutexIdle);
+            cvWork.wait(lk, [this] { return pending > 0 || !running; });
+
+            if (pending == 0)
+            {
+                return;
+            }
+
+            pending--;
+        }
+
+        // pending counts queued tasks, so one is guaranteed to be found, possibly after a race with a thief.
+        Task task;
+
+        while (!Take(index, task))
+        {
+            std::this_thread::yield();
+        }
+
+        task();
+        workers[index]->executed++;
+    }
+}
+
+void WorkPool::PrintStats() const
+{
+    std::cout << "Work pool: " << workers.size() << " workers." << std::endl;
+
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        std::cout << "  worker " << i << ": " << workers[i]->executed << " tasks, " << workers[i]->stolen << " stolen." << std::endl;
+    }
+}
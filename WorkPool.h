@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads, one deque each. A worker runs its own deque oldest first and, when
+// it is empty, steals the newest task of another worker. Tasks submitted from outside the pool go
+// to the deque of the worker named by their home index; tasks submitted from a worker stay on it.
+class WorkPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    // workers <= 0 uses one worker per hardware thread.
+    explicit WorkPool(int workers = 0);
+    ~WorkPool();
+
+    void            Submit(Task task, int home = 0);
+    int             Workers() const         { return (int)workers.size(); }
+    void            PrintStats() const;
+
+private:
+    struct Worker
+    {
+        std::mutex          mutex;
+        std::deque<Task>    tasks;
+        std::thread         thread;
+        int64_t             executed;
+        int64_t             stolen;
+    };
+
+    bool            Take(int index, Task& task);
+    void            ThreadProc(int index);
+
+    std::vector<Worker*>        workers;
+    std::mutex                  mutexIdle;
+    std::condition_variable     cvWork;
+    int64_t                     pending;
+    bool                        running;
+
+    static thread_local int     currentWorker;
+};
@@ -1 +1,4 @@
-g++ -g main.cpp ScreenRecord.cpp $(pkg-config --libs libavformat libavcodec libavdevice libavfilter libavutil libswscale libswresample) -lz -lpthread -o main;
+g++ -g main.cpp ScreenRecord.cpp AudioMixer.cpp ControlServer.cpp Cursor.cpp RoiMap.cpp Bench.cpp ColorConvert.cpp FilterStage.cpp ThreadPlacement.cpp FrameArena.cpp FastStart.cpp Transcode.cpp RawSpool.cpp WorkPool.cpp Farm.cpp Preview.cpp SampleConvert.cpp EncoderBackend.cpp FrameIngest.cpp PacketEgress.cpp MemoryBudget.cpp AllocationCount.cpp $(pkg-config --libs libavformat libavcodec libavdevice libavfilter libavutil libswscale libswresample) -lX11 -lXfixes -lz -lpthread -lrt -o main;
+g++ -O2 -shared -fPIC FrameIngest.cpp -o libsringest.so;
+g++ -O2 -shared -fPIC PacketEgress.cpp -o libsregress.so;
+g++ -g -O2 RechunkMain.cpp Rechunk.cpp EncoderBackend.cpp $(pkg-config --libs libavformat libavcodec libavutil) -lpthread -o rechunk;
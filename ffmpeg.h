@@ -10,9 +10,15 @@ extern "C"
     #include "libavutil/imgutils.h"
     #include "libswresample/swresample.h"
     #include "libavutil/avassert.h"
+    #include "libavutil/time.h"
+    #include "libavutil/opt.h"
+    #include "libavfilter/avfilter.h"
+    #include "libavfilter/buffersrc.h"
+    #include "libavfilter/buffersink.h"
 };
 
 #include <atomic>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <cstring>
@@ -22,5 +28,6 @@ extern "C"
 #include <iostream>
 #include <thread>
 #include <fstream>
+#include <future>
 #include <signal.h>
 #include <unistd.h>
\ No newline at end of file
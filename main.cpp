@@ -1,4 +1,8 @@
 #include "ScreenRecord.h"
+#include "ControlServer.h"
+#include "Bench.h"
+#include "Transcode.h"
+#include "Farm.h"
 
 static std::string toUpperCase(std::string src) {
     std::string dst = "";
@@ -8,6 +12,287 @@ static std::string toUpperCase(std::string src) {
     return dst;
 }
 
+static std::string findOption(int argc, char** argv, const std::string& prefix)
+{
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string option = argv[i];
+
+        if (option.rfind(prefix, 0) == 0)
+        {
+            return option.substr(prefix.size());
+        }
+    }
+
+    return "";
+}
+
+// Encoder settings handed to a background transcode or spool encode, after "<spool> <output>".
+static TranscodeSettings transcodeSettings(int argc, char** argv)
+{
+    TranscodeSettings settings{ "x264", EncoderPreset::Default, 0 };
+    std::string backend = findOption(argc, argv, "--video-encoder=");
+    std::string preset = findOption(argc, argv, "--preset=");
+    std::string rate = findOption(argc, argv, "--fps=");
+
+    if (!backend.empty())
+    {
+        settings.backend = backend;
+    }
+
+    if (!preset.empty() && !ParseEncoderPreset(preset, &settings.preset))
+    {
+        std::cout << "Preset must be realtime, balanced or archival, ignored." << std::endl;
+    }
+
+    if (!rate.empty())
+    {
+        int fps = atoi(rate.c_str());
+
+        if (fps >= 1 && fps <= 144)
+        {
+            settings.fps = fps;
+        }
+        else
+        {
+            std::cout << "Frame rate must be between 1 and 144, ignored." << std::endl;
+        }
+    }
+
+    return settings;
+}
+
+static bool hasOption(int argc, char** argv, const std::string& name)
+{
+    for (int i = 3; i < argc; ++i)
+    {
+        if (name == argv[i])
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Optional flags after the video and audio device arguments. Returns true if the recording should be armed up front.
+static bool applyOptions(ScreenRecord* capture, int argc, char** argv)
+{
+    int audioFragment = 0, audioBuffer = 30;
+    bool prearm = false;
+
+    for (int i = 3; i < argc; ++i)
+    {
+        std::string option = argv[i];
+        std::string value = option.find('=') == std::string::npos ? "" : option.substr(option.find('=') + 1);
+
+        if (option == "--low-latency")
+        {
+            audioFragment = 1024;
+            audioBuffer = 4;
+        }
+        else if (option.rfind("--audio-fragment=", 0) == 0)
+        {
+            audioFragment = std::stoi(value);
+        }
+        else if (option.rfind("--audio-buffer=", 0) == 0)
+        {
+            // A fifo without room for a single frame would leave audio capture waiting forever.
+            if (std::stoi(value) > 0)
+            {
+                audioBuffer = std::stoi(value);
+            }
+            else
+            {
+                std::cout << "Audio buffer must be at least 1 frame, ignored." << std::endl;
+            }
+        }
+        else if (option == "--fast-start")
+        {
+            capture->SetFastStart(true);
+        }
+        else if (option == "--prearm")
+        {
+            prearm = true;
+        }
+        else if (option == "--cursor-overlay")
+        {
+            capture->SetCursorOverlay(true);
+        }
+        else if (option == "--roi")
+        {
+            capture->SetRoi(true);
+        }
+        else if (option == "--screen-content")
+        {
+            capture->SetScreenContent(true, false);
+        }
+        else if (option == "--lossless")
+        {
+            capture->SetScreenContent(true, true);
+        }
+        else if (option.rfind("--filter=", 0) == 0)
+        {
+            capture->SetFilter(value);
+        }
+        else if (option.rfind("--affinity=", 0) == 0)
+        {
+            if (!capture->SetAffinity(value))
+            {
+                std::cout << "Affinity must look like video:2,audio:3,mux:4-5, ignored." << std::endl;
+            }
+        }
+        else if (option.rfind("--rt-priority=", 0) == 0)
+        {
+            capture->SetRealtimePriority(std::stoi(value));
+        }
+        else if (option.rfind("--core-budget=", 0) == 0)
+        {
+            capture->SetCoreBudget(std::stoi(value));
+        }
+        else if (option == "--huge-pages")
+        {
+            capture->SetHugePages(true);
+        }
+        else if (option == "--check-allocations")
+        {
+            capture->SetAllocationCheck(true);
+        }
+        else if (option.rfind("--stop-deadline=", 0) == 0)
+        {
+            capture->SetStopDeadline(std::stoi(value));
+        }
+        else if (option == "--faststart")
+        {
+            capture->SetFastStartIndex(true);
+        }
+        else if (option == "--spool")
+        {
+            capture->SetSpool(true);
+        }
+        else if (option.rfind("--burst=", 0) == 0)
+        {
+            capture->SetBurst(std::stoi(value));
+        }
+        else if (option.rfind("--ingest=", 0) == 0)
+        {
+            capture->SetIngest(value);
+        }
+        else if (option.rfind("--video-encoder=", 0) == 0)
+        {
+            capture->SetVideoBackend(value);
+        }
+        else if (option.rfind("--audio-encoder=", 0) == 0)
+        {
+            capture->SetAudioBackend(value);
+        }
+        else if (option.rfind("--preset=", 0) == 0)
+        {
+            EncoderPreset preset;
+
+            if (ParseEncoderPreset(value, &preset))
+            {
+                capture->SetEncoderPreset(preset);
+            }
+            else
+            {
+                std::cout << "Preset must be realtime, balanced or archival, ignored." << std::endl;
+            }
+        }
+        else if (option == "--audio-resampler")
+        {
+            capture->SetResamplerBypass(false);
+        }
+        else if (option.rfind("--egress=", 0) == 0)
+        {
+            std::string size = findOption(argc, argv, "--egress-mb=");
+            capture->SetEgress(value, size.empty() ? 16 : std::max(1, std::stoi(size)));
+        }
+        else if (option.rfind("--memory-budget=", 0) == 0)
+        {
+            std::string latency = findOption(argc, argv, "--latency=");
+            capture->SetMemoryBudget(std::max(1, std::stoi(value)), latency.empty() ? 1000 : std::max(1, std::stoi(latency)));
+        }
+        else if (option.rfind("--preview=", 0) == 0)
+        {
+            capture->SetPreview(std::stod(value), findOption(argc, argv, "--preview-shm="));
+        }
+        else if (option.rfind("--fps=", 0) == 0)
+        {
+            int rate = std::stoi(value);
+
+            if (rate >= 1 && rate <= 144)
+            {
+                capture->SetFrameRate(rate);
+            }
+            else
+            {
+                std::cout << "Frame rate must be between 1 and 144, ignored." << std::endl;
+            }
+        }
+        else if (option.rfind("--output-size=", 0) == 0)
+        {
+            int outWidth, outHeight;
+
+            if (sscanf(value.c_str(), "%dx%d", &outWidth, &outHeight) == 2)
+            {
+                capture->SetOutputSize(outWidth, outHeight);
+            }
+            else
+            {
+                std::cout << "Output size must be <width>x<height>, ignored." << std::endl;
+            }
+        }
+        else if (option.rfind("--daemon=", 0) == 0 || option.rfind("--region=", 0) == 0 || option.rfind("--preview-shm=", 0) == 0 || option.rfind("--egress-mb=", 0) == 0 || option.rfind("--latency=", 0) == 0 || option == "--no-audio")
+        {
+            continue;
+        }
+        else
+        {
+            std::cout << "Unknown option " << option << ", ignored." << std::endl;
+        }
+    }
+
+    capture->SetAudioLatency(audioFragment, audioBuffer);
+
+    return prearm;
+}
+
+// Daemon mode: devices and encoders stay open, recordings are driven over a Unix socket.
+static int runDaemon(int argc, char** argv, const std::string& socketPath)
+{
+    int width, widthOffset, height, heightOffset;
+    std::string region = findOption(argc, argv, "--region=");
+
+    if (sscanf(region.c_str(), "%dx%d+%d+%d", &width, &height, &widthOffset, &heightOffset) != 4)
+    {
+        std::cout << "Daemon mode needs --region=<width>x<height>+<x>+<y>." << std::endl;
+        return -1;
+    }
+
+    ScreenRecord* capture = new ScreenRecord("", argv[1], argv[2], !hasOption(argc, argv, "--no-audio"));
+
+    capture->SetDimensions(width, widthOffset, height, heightOffset);
+    capture->SetPersistent(true);
+    applyOptions(capture, argc, argv);
+
+    try
+    {
+        capture->Arm();
+
+        ControlServer server(capture, socketPath);
+        server.Run();
+    }
+    catch(std::exception& e)
+    {
+        std::cout << "[ERROR]  " << e.what() << std::endl;
+        return -1;
+    }
+
+    delete capture;
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
     int width, widthOffset, height, heightOffset;
@@ -16,6 +301,19 @@ int main(int argc, char** argv)
     std::string filename;
     ScreenRecord* capture;
 
+    // Companion to burst capture: main --encode-spool=<spool> <output> [--video-encoder=..] [--preset=..] [--fps=..]
+    if (argc > 2 && std::string(argv[1]).rfind("--encode-spool=", 0) == 0)
+    {
+        return EncodeRawSpool(std::string(argv[1]).substr(std::string("--encode-spool=").size()), argv[2], transcodeSettings(argc, argv));
+    }
+
+    // Background worker started by a spooled recording:
+    // main --transcode-spool=<spool> <output> [--video-encoder=..] [--preset=..] [--fps=..] [--faststart]
+    if (argc > 2 && std::string(argv[1]).rfind("--transcode-spool=", 0) == 0)
+    {
+        return TranscodeSpool(std::string(argv[1]).substr(std::string("--transcode-spool=").size()), argv[2], transcodeSettings(argc, argv), hasOption(argc, argv, "--faststart"));
+    }
+
     std::cout
     << "======================================================================================================================" << std::endl
     << "================================================ SCREEN-AUDIO CAPTURE ================================================" << std::endl
@@ -24,6 +322,29 @@ int main(int argc, char** argv)
     << "It allows to record desktop screen (optionally with audio) in customizable size and save output video on specified file" << std::endl
     << "Authors: Angelo Marino Carmollingo - Matteo Biffoni - Simone Cavallo" << std::endl << std::endl;
 
+    if (argc > 1 && std::string(argv[1]).rfind("--bench-roi=", 0) == 0)
+    {
+        return RunRoiBench(std::string(argv[1]).substr(std::string("--bench-roi=").size()));
+    }
+
+    if (argc > 1 && std::string(argv[1]).rfind("--bench-encoders=", 0) == 0)
+    {
+        return RunEncoderBench(std::string(argv[1]).substr(std::string("--bench-encoders=").size()));
+    }
+
+    // Recording farm: main --farm=<session list> [--workers=<n>]
+    if (argc > 1 && std::string(argv[1]).rfind("--farm=", 0) == 0)
+    {
+        std::string workers = argc > 2 && std::string(argv[2]).rfind("--workers=", 0) == 0 ? std::string(argv[2]).substr(std::string("--workers=").size()) : "0";
+
+        return RunFarm(std::string(argv[1]).substr(std::string("--farm=").size()), std::stoi(workers));
+    }
+
+    if (!findOption(argc, argv, "--daemon=").empty())
+    {
+        return runDaemon(argc, argv, findOption(argc, argv, "--daemon="));
+    }
+
 
    
     std::cout << "Type the width of the recording: ";
@@ -61,10 +382,16 @@ int main(int argc, char** argv)
     }
 
     capture->SetDimensions(width, widthOffset, height, heightOffset);
+    bool prearm = applyOptions(capture, argc, argv);
     capture->PrintDimensions();
 
     try
     {
+        if (prearm)
+        {
+            capture->Arm();
+        }
+
         std::cout << std::endl << std::endl;
         std::cout << "Type 'start' to start recording, then available commands will be 'pause', 'resume' and 'stop'." << std::endl << std::endl;    
 
@@ -100,8 +427,6 @@ int main(int argc, char** argv)
                 {
                     std::cout << "Invalid command, try again." << std::endl;
                 }
-
-                sleep(2);
             }
             catch(std::runtime_error e)
             {
@@ -115,5 +440,5 @@ int main(int argc, char** argv)
         exit(-1);
     }
 
-    return 0;
+    return capture->AllocationCheckFailed() ? 1 : 0;
 }
\ No newline at end of file